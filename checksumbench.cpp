@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fs/checksum.hh"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *isaNames[] = { "portable", "sse", "avx2" };
+
+int main(int argc, char **argv)
+{
+    // Data area of a payload block is block size minus 8 byte header
+    uint32_t len = 4096 - 8;
+    uint32_t rounds = 200000;
+    if (argc > 1) {
+        len = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        rounds = atoi(argv[2]);
+    }
+    if (len == 0 || rounds == 0) {
+        printf("Usage: %s [bytes] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    uint8_t *data = new uint8_t[len];
+    for (uint32_t i = 0; i < len; ++i) {
+        data[i] = (i * 2654435761u) >> 24;
+    }
+
+    static const uint8_t masks[] = {
+        Checksum::ALGO_XOR,
+        Checksum::ALGO_CRC,
+        Checksum::ALGO_SUMMOD,
+        Checksum::ALGO_XOR | Checksum::ALGO_CRC | Checksum::ALGO_SUMMOD
+    };
+    uint32_t expect[sizeof(masks)];
+    bool ok = true;
+
+    for (uint32_t isa = Checksum::ISA_PORTABLE;
+            isa <= Checksum::ISA_AVX2; ++isa) {
+        if (Checksum::limitIsa(isa) != isa) {
+            continue;
+        }
+        for (uint32_t m = 0; m < sizeof(masks); ++m) {
+            uint32_t res = 0;
+            uint32_t acc = 0;
+            double start = now();
+            for (uint32_t r = 0; r < rounds; ++r) {
+                Checksum::compute(masks[m], data, len, &res);
+                acc += res;
+            }
+            double secs = now() - start;
+            if (isa == Checksum::ISA_PORTABLE) {
+                expect[m] = res;
+            } else if (expect[m] != res) {
+                ok = false;
+            }
+            printf("%-8s algo 0x%02x  %08x  %8.1f MiB/s  (%08x)\n",
+                isaNames[isa], masks[m], res,
+                (double)len * rounds / secs / (1024 * 1024), acc);
+        }
+    }
+    delete[] data;
+
+    if (!ok) {
+        printf("Kernel results differ\n");
+        return 1;
+    }
+    return 0;
+}
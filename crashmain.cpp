@@ -0,0 +1,198 @@
+#include "fs/clothesfs.hh"
+#include "fs/clothescheck.hh"
+#include "fs/filephys.hh"
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const uint64_t IMAGE_SIZE = 4 * 1024 * 1024;
+// Files created before the crash, every third is removed again
+static const uint32_t FILE_COUNT = 60;
+static const uint32_t CACHE_BUDGET = 64 * 1024;
+
+/* Contents of file i, spans a few payload blocks */
+static std::string contents(uint32_t i)
+{
+    std::string data;
+    for (uint32_t n = 0; n < 40 + i * 7; ++n) {
+        char line[32];
+        snprintf(line, sizeof(line), "file %u line %u\n", i, n);
+        data += line;
+    }
+    return data;
+}
+
+static std::string fileName(const char *prefix, uint32_t i)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%s%u", prefix, i);
+    return name;
+}
+
+static bool removeFile(ClothesFS *fs, uint32_t dir, const std::string &name)
+{
+    ClothesFS::Iterator iter = fs->list(dir);
+    while (iter.ok()) {
+        if (iter.name() == name) {
+            return iter.remove();
+        }
+        if (!iter.next()) {
+            break;
+        }
+    }
+    return false;
+}
+
+static bool addFiles(ClothesFS *fs, uint32_t dir, const char *prefix)
+{
+    for (uint32_t i = 0; i < FILE_COUNT; ++i) {
+        std::string data = contents(i);
+        if (!fs->addFile(dir, fileName(prefix, i).c_str(), data.c_str(), data.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool removeFiles(ClothesFS *fs, uint32_t dir, const char *prefix)
+{
+    for (uint32_t i = 0; i < FILE_COUNT; i += 3) {
+        if (!removeFile(fs, dir, fileName(prefix, i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Runs in a child, which dies right after its last commit. Blocks
+ * freed by the removes committed first are taken again as payload,
+ * so they are revoked from the previous transaction. Removes after
+ * that are released only by the commit that never gets in place. */
+static void crash(const char *image, uint8_t flags)
+{
+    remove(image);
+    FilePhys phys(image, IMAGE_SIZE);
+    ClothesFS cloth;
+    cloth.setPhysical(&phys);
+    cloth.setCache(CACHE_BUDGET, BlockCache::WRITE_BACK);
+    if (!phys.ok()
+        || !cloth.format("Crash test", flags)
+        || !cloth.enableJournal()
+        || !cloth.addDir(1, "before")
+        || !cloth.addDir(1, "after")) {
+        printf("Can't format %s\n", image);
+        fflush(stdout);
+        _exit(1);
+    }
+
+    uint32_t before = cloth.lookup("/before");
+    uint32_t after = cloth.lookup("/after");
+    if (!addFiles(&cloth, before, "b")
+        || !cloth.sync()
+        || !removeFiles(&cloth, before, "b")
+        || !cloth.sync()
+        || !addFiles(&cloth, after, "a")
+        || !removeFiles(&cloth, after, "a")
+        || !cloth.addDir(1, "empty")
+        || !cloth.commitWithoutCheckpoint()) {
+        printf("Can't update %s before crash\n", image);
+        fflush(stdout);
+        _exit(1);
+    }
+    // Places, cache and header are never written
+    _exit(0);
+}
+
+/* Everything committed before the crash is there after replay */
+static uint32_t verify(ClothesFS *fs, const char *path, const char *prefix)
+{
+    uint32_t bad = 0;
+    uint32_t dir = fs->lookup(path);
+    if (dir == 0) {
+        printf("%s missing\n", path);
+        return 1;
+    }
+    for (uint32_t i = 0; i < FILE_COUNT; ++i) {
+        std::string name = fileName(prefix, i);
+        uint32_t block = fs->find(dir, name.c_str());
+        if (i % 3 == 0) {
+            if (block != 0) {
+                printf("%s/%s was removed but is there\n", path, name.c_str());
+                ++bad;
+            }
+            continue;
+        }
+        ClothesFS::Iterator iter = fs->open(dir, block, fs->unlinkCount());
+        std::string data = contents(i);
+        std::string got(iter.ok() ? iter.size() : 0, 0);
+        if (!iter.ok()
+            || iter.size() != data.size()
+            || iter.read((uint8_t*)&got[0], got.size()) != got.size()
+            || got != data) {
+            printf("%s/%s is missing or wrong\n", path, name.c_str());
+            ++bad;
+        }
+    }
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t flags = 0;
+    const char *image = "crash.img";
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bitmap") == 0) {
+            flags |= ClothesFS::FLAG_BITMAP;
+        } else if (argv[i][0] != '-') {
+            image = argv[i];
+        } else {
+            printf("Usage: %s [--bitmap] [image]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Can't fork\n");
+        return 1;
+    }
+    if (pid == 0) {
+        crash(image, flags);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid
+        || !WIFEXITED(status)
+        || WEXITSTATUS(status) != 0) {
+        return 1;
+    }
+
+    // Mounting replays the transaction the crash left out of place
+    FilePhys phys(image, IMAGE_SIZE);
+    ClothesFS cloth;
+    cloth.setPhysical(&phys);
+    if (!phys.ok() || !cloth.detect()) {
+        printf("%s: no ClothesFS volume after crash\n", image);
+        return 1;
+    }
+    uint32_t bad = verify(&cloth, "/before", "b")
+        + verify(&cloth, "/after", "a");
+    if (cloth.lookup("/empty") == 0) {
+        printf("/empty missing\n");
+        ++bad;
+    }
+
+    ClothesCheck check(&cloth, 1);
+    check.check();
+    printf("%s: %u files, %u directories, %u blocks used, %u leaked, %u problems\n",
+        image, check.files(), check.dirs(), check.owned(), check.leaked(),
+        check.problems() + bad);
+    if (check.problems() + bad > 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,373 @@
+#include "fs/clothesfs.hh"
+#include "fs/filephys.hh"
+#include "fs/mmapphys.hh"
+#ifdef HAVE_IO_URING
+#include "fs/iouringphys.hh"
+#endif
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File contents are read in pieces of this many bytes
+static const uint32_t READ_CHUNK = 1024 * 1024;
+// Volume size in header
+static const uint32_t HEADER_SIZE_POS = 48;
+
+enum Backend {
+    BACKEND_FILE,
+    BACKEND_DIRECT,
+    BACKEND_MMAP,
+    BACKEND_URING
+};
+
+struct Dir {
+    uint32_t block;
+    std::string path;
+};
+
+struct File {
+    uint32_t parent;
+    uint32_t block;
+    // Reads go in order of this, so image is read mostly sequentially
+    uint32_t first;
+    // Removes before block was found, open() trusts it when unchanged
+    uint32_t unlinks;
+    std::string path;
+};
+
+static bool byPosition(const File &a, const File &b)
+{
+    return a.first < b.first;
+}
+
+struct Extract {
+    ClothesFS *fs;
+    // Directories waiting for a worker
+    std::vector<Dir> dirs;
+    uint32_t active;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    std::vector<File> files;
+    uint32_t dir_count;
+    uint32_t next_file;
+    uint32_t failed;
+    uint64_t bytes;
+};
+
+static void fail(Extract *ext)
+{
+    __atomic_add_fetch(&ext->failed, 1, __ATOMIC_RELAXED);
+}
+
+/* Names that would leave the target directory are not extracted */
+static bool safeName(const std::string &name)
+{
+    return !name.empty() && name != "." && name != ".."
+        && name.find('/') == std::string::npos;
+}
+
+static void listDir(Extract *ext, const Dir &dir, std::vector<File> *files)
+{
+    uint32_t unlinks = ext->fs->unlinkCount();
+    ClothesFS::Iterator iter = ext->fs->list(dir.block);
+    while (iter.ok()) {
+        std::string name = iter.name();
+        std::string path = dir.path + "/" + name;
+        if (!safeName(name)) {
+            printf("Skipping entry \"%s\" in %s\n", name.c_str(), dir.path.c_str());
+            fail(ext);
+        } else if (iter.type() == ClothesFS::META_DIR) {
+            if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+                printf("Can't create %s\n", path.c_str());
+                fail(ext);
+            } else {
+                Dir sub;
+                sub.block = iter.block();
+                sub.path = path;
+                pthread_mutex_lock(&ext->lock);
+                ext->dirs.push_back(sub);
+                ++ext->dir_count;
+                pthread_cond_signal(&ext->cond);
+                pthread_mutex_unlock(&ext->lock);
+            }
+        } else if (iter.type() == ClothesFS::META_FILE) {
+            File file;
+            file.parent = dir.block;
+            file.block = iter.block();
+            file.first = iter.firstBlock();
+            file.unlinks = unlinks;
+            file.path = path;
+            files->push_back(file);
+        }
+        if (!iter.next()) {
+            break;
+        }
+    }
+    if (!iter.end()) {
+        printf("Can't list %s\n", dir.path.c_str());
+        fail(ext);
+    }
+}
+
+/* Lists directories until none is left and no worker can add more */
+static void *walker(void *arg)
+{
+    Extract *ext = (Extract*)arg;
+    std::vector<File> files;
+    pthread_mutex_lock(&ext->lock);
+    while (true) {
+        while (ext->dirs.empty() && ext->active > 0) {
+            pthread_cond_wait(&ext->cond, &ext->lock);
+        }
+        if (ext->dirs.empty()) {
+            break;
+        }
+        Dir dir = ext->dirs.back();
+        ext->dirs.pop_back();
+        ++ext->active;
+        pthread_mutex_unlock(&ext->lock);
+
+        listDir(ext, dir, &files);
+
+        pthread_mutex_lock(&ext->lock);
+        --ext->active;
+        if (ext->active == 0 && ext->dirs.empty()) {
+            pthread_cond_broadcast(&ext->cond);
+        }
+    }
+    ext->files.insert(ext->files.end(), files.begin(), files.end());
+    pthread_mutex_unlock(&ext->lock);
+    return nullptr;
+}
+
+static bool extractFile(Extract *ext, const File &file, uint8_t *buf)
+{
+    ClothesFS::Iterator iter = ext->fs->open(
+        file.parent,
+        file.block,
+        file.unlinks);
+    if (!iter.ok()) {
+        printf("Can't read %s\n", file.path.c_str());
+        return false;
+    }
+    int fd = ::open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Can't create %s\n", file.path.c_str());
+        return false;
+    }
+
+    uint64_t size = iter.size();
+    uint64_t done = 0;
+    bool res = true;
+    while (res && done < size) {
+        uint64_t cnt = iter.read(buf, READ_CHUNK);
+        if (cnt == 0) {
+            res = false;
+            break;
+        }
+        uint64_t written = 0;
+        while (res && written < cnt) {
+            ssize_t len = write(fd, buf + written, cnt - written);
+            if (len <= 0) {
+                res = false;
+            } else {
+                written += len;
+            }
+        }
+        done += cnt;
+    }
+    if (close(fd) != 0) {
+        res = false;
+    }
+    if (!res) {
+        printf("Can't extract %s\n", file.path.c_str());
+        return false;
+    }
+    __atomic_add_fetch(&ext->bytes, done, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void *reader(void *arg)
+{
+    Extract *ext = (Extract*)arg;
+    uint8_t *buf = new uint8_t[READ_CHUNK];
+    uint32_t count = ext->files.size();
+    while (true) {
+        uint32_t next = __atomic_fetch_add(&ext->next_file, 1, __ATOMIC_RELAXED);
+        if (next >= count) {
+            break;
+        }
+        if (!extractFile(ext, ext->files[next], buf)) {
+            fail(ext);
+        }
+    }
+    delete[] buf;
+    return nullptr;
+}
+
+static void runPool(long threads, void *(*func)(void*), Extract *ext)
+{
+    std::vector<pthread_t> pool(threads);
+    for (long i = 0; i < threads; ++i) {
+        if (pthread_create(&pool[i], nullptr, func, ext) != 0) {
+            pool.resize(i);
+            break;
+        }
+    }
+    if (pool.empty()) {
+        func(ext);
+    }
+    for (size_t i = 0; i < pool.size(); ++i) {
+        pthread_join(pool[i], nullptr);
+    }
+}
+
+/* Image through backend picked on command line, plain file I/O when
+ * io_uring can't be set up */
+static FilesystemPhys *openImage(
+    const char *image,
+    uint64_t size,
+    Backend backend)
+{
+    if (backend == BACKEND_MMAP) {
+        MmapPhys *mapped = new MmapPhys(image, size);
+        if (mapped->ok()) {
+            return mapped;
+        }
+        delete mapped;
+        return nullptr;
+    }
+#ifdef HAVE_IO_URING
+    if (backend == BACKEND_URING) {
+        IoUringPhys *uring = new IoUringPhys(image, size);
+        if (uring->ok()) {
+            return uring;
+        }
+        // Kernel without io_uring or ring limits reached
+        printf("Can't set up io_uring, using plain file I/O\n");
+        delete uring;
+    }
+#endif
+    FilePhys *file = new FilePhys(image, size, backend == BACKEND_DIRECT);
+    if (file->ok()) {
+        return file;
+    }
+    delete file;
+    return nullptr;
+}
+
+static int extract(
+    FilesystemPhys *phys,
+    const char *image,
+    const char *target,
+    long threads)
+{
+    ClothesFS cloth;
+    cloth.setPhysical(phys);
+    if (!cloth.detect()) {
+        printf("%s: no ClothesFS volume\n", image);
+        return 1;
+    }
+    if (mkdir(target, 0755) != 0 && errno != EEXIST) {
+        printf("Can't create %s\n", target);
+        return 1;
+    }
+
+    Extract ext;
+    ext.fs = &cloth;
+    Dir root;
+    root.block = 1;
+    root.path = target;
+    ext.dirs.push_back(root);
+    ext.active = 0;
+    pthread_mutex_init(&ext.lock, nullptr);
+    pthread_cond_init(&ext.cond, nullptr);
+    ext.dir_count = 0;
+    ext.next_file = 0;
+    ext.failed = 0;
+    ext.bytes = 0;
+
+    runPool(threads, walker, &ext);
+    std::sort(ext.files.begin(), ext.files.end(), byPosition);
+    runPool(threads, reader, &ext);
+
+    pthread_cond_destroy(&ext.cond);
+    pthread_mutex_destroy(&ext.lock);
+    printf("%s: %zu files, %u directories, %llu bytes\n",
+        target, ext.files.size(), ext.dir_count,
+        (unsigned long long)ext.bytes);
+    if (ext.failed > 0) {
+        printf("%s: %u entries failed\n", target, ext.failed);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    Backend backend = BACKEND_FILE;
+    const char *image = nullptr;
+    const char *target = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            backend = BACKEND_DIRECT;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            backend = BACKEND_MMAP;
+#ifdef HAVE_IO_URING
+        } else if (strcmp(argv[i], "--uring") == 0) {
+            backend = BACKEND_URING;
+#endif
+        } else if (image == nullptr && argv[i][0] != '-') {
+            image = argv[i];
+        } else if (target == nullptr && argv[i][0] != '-') {
+            target = argv[i];
+        } else {
+            target = nullptr;
+            break;
+        }
+    }
+    if (target == nullptr || threads <= 0) {
+        printf("Usage: %s [--threads N] [--direct | --mmap | --uring] image directory\n", argv[0]);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(image, &st) != 0) {
+        printf("Can't open %s\n", image);
+        return 1;
+    }
+    // Image may end before volume does when its tail was never written
+    uint64_t size = st.st_size;
+    FILE *f = fopen(image, "rb");
+    uint8_t header[HEADER_SIZE_POS + 4];
+    if (f == nullptr) {
+        printf("Can't open %s\n", image);
+        return 1;
+    }
+    if (fread(header, 1, sizeof(header), f) == sizeof(header)
+        && ClothesFS::dataToNum(header, HEADER_SIZE_POS, 4) > size) {
+        size = ClothesFS::dataToNum(header, HEADER_SIZE_POS, 4);
+    }
+    fclose(f);
+
+    FilesystemPhys *phys = openImage(image, size, backend);
+    if (phys == nullptr) {
+        printf("Can't open %s\n", image);
+        return 1;
+    }
+    int res = extract(phys, image, target, threads);
+    delete phys;
+    return res;
+}
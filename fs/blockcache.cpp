@@ -0,0 +1,468 @@
+#include "fs/blockcache.hh"
+
+#ifdef LINUX_BUILD
+#include <string.h>
+#endif
+
+static void copyBlock(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+#ifdef LINUX_BUILD
+    memcpy(dst, src, size);
+#else
+    Mem::move(dst, src, size);
+#endif
+}
+
+BlockCache::BlockCache(
+    FilesystemPhys *phys,
+    uint32_t blocksize,
+    uint64_t budget,
+    Mode mode)
+    : m_phys(phys),
+    m_blocksize(blocksize),
+    m_block_in_sectors(blocksize / phys->sectorSize()),
+    m_mode(mode),
+    m_changes(0),
+    m_slots(budget / blocksize),
+    m_used(0),
+    m_buckets(1),
+    m_data(nullptr),
+    m_index(nullptr),
+    m_dirty(nullptr),
+    m_pins(nullptr),
+    m_hash_head(nullptr),
+    m_hash_next(nullptr),
+    m_prev(nullptr),
+    m_next(nullptr),
+    m_mru(NONE),
+    m_lru(NONE),
+    m_hits(0),
+    m_misses(0)
+{
+    if (m_slots == 0) {
+        return;
+    }
+    while (m_buckets < m_slots) {
+        m_buckets <<= 1;
+    }
+
+    // Slots are read and written in place, aligned for the backend
+    m_data = m_phys->allocBuffer((uint64_t)m_slots * m_blocksize);
+    if (m_data == nullptr) {
+        m_slots = 0;
+        return;
+    }
+    m_index = new uint32_t[m_slots];
+    m_dirty = new bool[m_slots];
+    m_pins = new uint32_t[m_slots];
+    m_hash_next = new uint32_t[m_slots];
+    m_prev = new uint32_t[m_slots];
+    m_next = new uint32_t[m_slots];
+    m_hash_head = new uint32_t[m_buckets];
+
+    invalidate();
+}
+
+BlockCache::~BlockCache()
+{
+    flush();
+
+    if (m_data != nullptr) {
+        FilesystemPhys::freeBuffer(m_data);
+        delete[] m_index;
+        delete[] m_dirty;
+        delete[] m_pins;
+        delete[] m_hash_next;
+        delete[] m_prev;
+        delete[] m_next;
+        delete[] m_hash_head;
+    }
+}
+
+void BlockCache::invalidate()
+{
+    MutexGuard guard(m_lock);
+    ++m_changes;
+    for (uint32_t i = 0; i < m_buckets && m_hash_head != nullptr; ++i) {
+        m_hash_head[i] = NONE;
+    }
+    m_used = 0;
+    m_mru = NONE;
+    m_lru = NONE;
+}
+
+uint32_t BlockCache::hash(uint32_t index) const
+{
+    return (index ^ (index >> 16)) & (m_buckets - 1);
+}
+
+uint32_t BlockCache::find(uint32_t index) const
+{
+    if (m_slots == 0) {
+        return NONE;
+    }
+    uint32_t slot = m_hash_head[hash(index)];
+    while (slot != NONE && m_index[slot] != index) {
+        slot = m_hash_next[slot];
+    }
+    return slot;
+}
+
+void BlockCache::hashRemove(uint32_t slot)
+{
+    uint32_t *link = &m_hash_head[hash(m_index[slot])];
+    while (*link != NONE) {
+        if (*link == slot) {
+            *link = m_hash_next[slot];
+            return;
+        }
+        link = &m_hash_next[*link];
+    }
+}
+
+void BlockCache::unlink(uint32_t slot)
+{
+    if (m_prev[slot] != NONE) {
+        m_next[m_prev[slot]] = m_next[slot];
+    } else {
+        m_mru = m_next[slot];
+    }
+    if (m_next[slot] != NONE) {
+        m_prev[m_next[slot]] = m_prev[slot];
+    } else {
+        m_lru = m_prev[slot];
+    }
+}
+
+void BlockCache::touch(uint32_t slot)
+{
+    if (m_mru == slot) {
+        return;
+    }
+    unlink(slot);
+    m_prev[slot] = NONE;
+    m_next[slot] = m_mru;
+    if (m_mru != NONE) {
+        m_prev[m_mru] = slot;
+    }
+    m_mru = slot;
+    if (m_lru == NONE) {
+        m_lru = slot;
+    }
+}
+
+bool BlockCache::evict(uint32_t slot)
+{
+    if (m_dirty[slot] && !writeSlots(&slot, 1)) {
+        return false;
+    }
+    ++m_changes;
+    hashRemove(slot);
+    unlink(slot);
+    return true;
+}
+
+uint32_t BlockCache::allocate(uint32_t index)
+{
+    if (m_slots == 0) {
+        return NONE;
+    }
+
+    uint32_t slot;
+    if (m_used < m_slots) {
+        slot = m_used;
+        ++m_used;
+    } else {
+        // Least recently used one that is not pinned
+        slot = m_lru;
+        while (slot != NONE && m_pins[slot] > 0) {
+            slot = m_prev[slot];
+        }
+        if (slot == NONE || !evict(slot)) {
+            return NONE;
+        }
+    }
+
+    m_index[slot] = index;
+    m_dirty[slot] = false;
+    m_pins[slot] = 0;
+    uint32_t bucket = hash(index);
+    m_hash_next[slot] = m_hash_head[bucket];
+    m_hash_head[bucket] = slot;
+
+    m_prev[slot] = NONE;
+    m_next[slot] = m_mru;
+    if (m_mru != NONE) {
+        m_prev[m_mru] = slot;
+    }
+    m_mru = slot;
+    if (m_lru == NONE) {
+        m_lru = slot;
+    }
+    return slot;
+}
+
+bool BlockCache::writeSlots(uint32_t *slots, uint32_t count)
+{
+    if (count == 0) {
+        return true;
+    }
+
+    // Ascending block order keeps flush mostly sequential
+    for (uint32_t gap = count / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < count; ++i) {
+            uint32_t tmp = slots[i];
+            uint32_t j = i;
+            for (; j >= gap && m_index[slots[j - gap]] > m_index[tmp]; j -= gap) {
+                slots[j] = slots[j - gap];
+            }
+            slots[j] = tmp;
+        }
+    }
+
+    FilesystemPhysVec *vec = new FilesystemPhysVec[count];
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t pos = (uint64_t)m_index[slots[i]] * m_blocksize;
+        vec[i].buffer = m_data + (uint64_t)slots[i] * m_blocksize;
+        vec[i].sectors = m_block_in_sectors;
+        vec[i].pos = pos & 0xFFFFFFFF;
+        vec[i].pos_hi = (pos >> 32) & 0xFFFFFFFF;
+    }
+    bool res = m_phys->writev(vec, count);
+    delete[] vec;
+
+    if (res) {
+        for (uint32_t i = 0; i < count; ++i) {
+            m_dirty[slots[i]] = false;
+        }
+    }
+    return res;
+}
+
+bool BlockCache::read(uint32_t index, uint8_t *data)
+{
+    // Miss goes to its slot when backend can't use caller's buffer
+    // without a copy, slots are aligned for it
+    if (m_slots > 0 && (uintptr_t)data % m_phys->alignment() != 0) {
+        const uint8_t *slot = pin(index);
+        if (slot != nullptr) {
+            MutexGuard guard(m_lock);
+            copyBlock(data, slot, m_blocksize);
+            unpin(index);
+            return true;
+        }
+    }
+    return readList(&index, 1, data);
+}
+
+bool BlockCache::readList(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data)
+{
+    FilesystemPhysVec *vec = new FilesystemPhysVec[count];
+    uint32_t runs = 0;
+
+    // Hits are served here, misses are fetched in one request
+    m_lock.lock();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = find(indices[i]);
+        uint8_t *dst = data + (uint64_t)i * m_blocksize;
+        if (slot != NONE) {
+            copyBlock(dst, m_data + (uint64_t)slot * m_blocksize, m_blocksize);
+            touch(slot);
+            ++m_hits;
+            continue;
+        }
+        ++m_misses;
+
+        if (runs > 0
+            && vec[runs - 1].buffer + vec[runs - 1].sectors * m_phys->sectorSize() == dst
+            && indices[i] == indices[i - 1] + 1) {
+            vec[runs - 1].sectors += m_block_in_sectors;
+            continue;
+        }
+        uint64_t pos = (uint64_t)indices[i] * m_blocksize;
+        vec[runs].buffer = dst;
+        vec[runs].sectors = m_block_in_sectors;
+        vec[runs].pos = pos & 0xFFFFFFFF;
+        vec[runs].pos_hi = (pos >> 32) & 0xFFFFFFFF;
+        ++runs;
+    }
+    uint64_t changes = m_changes;
+    m_lock.unlock();
+
+    bool res = true;
+    if (runs > 0) {
+        res = m_phys->readv(vec, runs);
+    }
+    delete[] vec;
+    if (!res) {
+        return false;
+    }
+
+    MutexGuard guard(m_lock);
+    if (m_changes != changes) {
+        return true;
+    }
+    for (uint32_t i = 0; i < count && runs > 0; ++i) {
+        if (find(indices[i]) != NONE) {
+            continue;
+        }
+        uint32_t slot = allocate(indices[i]);
+        if (slot != NONE) {
+            copyBlock(
+                m_data + (uint64_t)slot * m_blocksize,
+                data + (uint64_t)i * m_blocksize,
+                m_blocksize);
+        }
+    }
+    return true;
+}
+
+const uint8_t *BlockCache::pin(uint32_t index)
+{
+    m_lock.lock();
+    uint32_t slot = find(index);
+    if (slot != NONE) {
+        touch(slot);
+        ++m_hits;
+        ++m_pins[slot];
+        m_lock.unlock();
+        return m_data + (uint64_t)slot * m_blocksize;
+    }
+    ++m_misses;
+    slot = allocate(index);
+    if (slot == NONE) {
+        m_lock.unlock();
+        return nullptr;
+    }
+
+    // Slot is reserved while read runs without the lock, find() doesn't
+    // see it and the pin keeps it from eviction
+    hashRemove(slot);
+    m_index[slot] = NONE;
+    ++m_pins[slot];
+    uint8_t *data = m_data + (uint64_t)slot * m_blocksize;
+    uint64_t pos = (uint64_t)index * m_blocksize;
+    uint32_t other;
+    bool res;
+    while (true) {
+        uint64_t changes = m_changes;
+        m_lock.unlock();
+        res = m_phys->read(
+            data,
+            m_block_in_sectors,
+            pos & 0xFFFFFFFF,
+            (pos >> 32) & 0xFFFFFFFF);
+        m_lock.lock();
+        other = find(index);
+        // Block written or evicted meanwhile may have been read stale
+        if (!res || other != NONE || m_changes == changes) {
+            break;
+        }
+    }
+
+    if (!res || other != NONE) {
+        // Slot holds nothing, it ages out of LRU list
+        --m_pins[slot];
+        if (other != NONE) {
+            touch(other);
+            ++m_pins[other];
+            data = m_data + (uint64_t)other * m_blocksize;
+        } else {
+            data = nullptr;
+        }
+        m_lock.unlock();
+        return data;
+    }
+
+    m_index[slot] = index;
+    uint32_t bucket = hash(index);
+    m_hash_next[slot] = m_hash_head[bucket];
+    m_hash_head[bucket] = slot;
+    m_lock.unlock();
+    return data;
+}
+
+void BlockCache::unpin(uint32_t index)
+{
+    MutexGuard guard(m_lock);
+    uint32_t slot = find(index);
+    if (slot != NONE && m_pins[slot] > 0) {
+        --m_pins[slot];
+    }
+}
+
+bool BlockCache::write(uint32_t index, const uint8_t *data)
+{
+    MutexGuard guard(m_lock);
+    uint64_t pos = (uint64_t)index * m_blocksize;
+    ++m_changes;
+    uint32_t slot = find(index);
+
+    if (m_mode == WRITE_THROUGH || m_slots == 0) {
+        if (!m_phys->write(
+                (uint8_t*)data,
+                m_block_in_sectors,
+                pos & 0xFFFFFFFF,
+                (pos >> 32) & 0xFFFFFFFF)) {
+            return false;
+        }
+        if (slot == NONE) {
+            slot = allocate(index);
+        } else {
+            touch(slot);
+        }
+        if (slot != NONE) {
+            copyBlock(m_data + (uint64_t)slot * m_blocksize, data, m_blocksize);
+        }
+        return true;
+    }
+
+    if (slot == NONE) {
+        slot = allocate(index);
+    } else {
+        touch(slot);
+    }
+    if (slot == NONE) {
+        // Could not make room, write directly
+        return m_phys->write(
+            (uint8_t*)data,
+            m_block_in_sectors,
+            pos & 0xFFFFFFFF,
+            (pos >> 32) & 0xFFFFFFFF);
+    }
+    copyBlock(m_data + (uint64_t)slot * m_blocksize, data, m_blocksize);
+    m_dirty[slot] = true;
+    return true;
+}
+
+bool BlockCache::flush()
+{
+    MutexGuard guard(m_lock);
+    if (m_slots > 0 && m_mode == WRITE_BACK) {
+        uint32_t *dirty = new uint32_t[m_used];
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < m_used; ++i) {
+            if (m_dirty[i]) {
+                dirty[count] = i;
+                ++count;
+            }
+        }
+        bool res = writeSlots(dirty, count);
+        delete[] dirty;
+        if (!res) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockCache::sync()
+{
+    if (!flush()) {
+        return false;
+    }
+    return m_phys->sync();
+}
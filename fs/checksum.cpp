@@ -0,0 +1,379 @@
+#include "fs/checksum.hh"
+
+#ifdef LINUX_BUILD
+#include <string.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+typedef uint32_t (*Crc32cFunc)(uint32_t, const uint8_t *, uint32_t);
+typedef uint32_t (*BlockFunc)(const uint8_t *, uint32_t);
+
+static const uint32_t crc32c_poly = 0x82F63B78;
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_table_state = 0;
+static uint32_t select_state = 0;
+static Crc32cFunc crc32c_impl = nullptr;
+static const char *crc32c_impl_name = "";
+static BlockFunc xor32_impl = nullptr;
+static const char *xor32_impl_name = "";
+static BlockFunc sum_impl = nullptr;
+static const char *sum_impl_name = "";
+static uint32_t isa_limit = Checksum::ISA_AVX2;
+static uint32_t isa_level = Checksum::ISA_PORTABLE;
+
+enum {
+    ONCE_NONE = 0,
+    ONCE_BUSY,
+    ONCE_DONE
+};
+
+/* Runs init exactly once. Threads racing on first use wait until
+ * it is done, acquire pairs with release so they see what it wrote. */
+static void runOnce(uint32_t *state, void (*init)())
+{
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == ONCE_DONE) {
+        return;
+    }
+    uint32_t expected = ONCE_NONE;
+    if (__atomic_compare_exchange_n(
+            state, &expected, ONCE_BUSY, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        init();
+        __atomic_store_n(state, ONCE_DONE, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != ONCE_DONE) {
+    }
+}
+
+static void crc32cTable()
+{
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (uint32_t b = 0; b < 8; ++b) {
+            crc = (crc >> 1) ^ (crc32c_poly & (0 - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = crc32c_table[0][i];
+        for (uint32_t t = 1; t < 8; ++t) {
+            crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+            crc32c_table[t][i] = crc;
+        }
+    }
+}
+
+static inline uint32_t load32(const uint8_t *data)
+{
+    return data[0]
+        | (data[1] << 8)
+        | (data[2] << 16)
+        | ((uint32_t)data[3] << 24);
+}
+
+uint32_t Checksum::crc32cPortable(
+    uint32_t crc,
+    const uint8_t *data,
+    uint32_t len)
+{
+    runOnce(&crc32c_table_state, crc32cTable);
+
+    // Slicing by 8, eight table lookups per 8 bytes
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = load32(data) ^ crc;
+        uint32_t hi = load32(data + 4);
+        crc = crc32c_table[7][lo & 0xFF]
+            ^ crc32c_table[6][(lo >> 8) & 0xFF]
+            ^ crc32c_table[5][(lo >> 16) & 0xFF]
+            ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][hi & 0xFF]
+            ^ crc32c_table[2][(hi >> 8) & 0xFF]
+            ^ crc32c_table[1][(hi >> 16) & 0xFF]
+            ^ crc32c_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+        ++data;
+        --len;
+    }
+    return ~crc;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    crc = ~crc;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = crc64;
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *data);
+        ++data;
+        --len;
+    }
+    return ~crc;
+}
+#endif
+
+uint32_t Checksum::xor32Portable(const uint8_t *data, uint32_t len)
+{
+    // Four independent lanes so the loop is not one long dependency
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    uint32_t d = 0;
+    while (len >= 16) {
+        a ^= load32(data);
+        b ^= load32(data + 4);
+        c ^= load32(data + 8);
+        d ^= load32(data + 12);
+        data += 16;
+        len -= 16;
+    }
+    a ^= b ^ c ^ d;
+    while (len >= 4) {
+        a ^= load32(data);
+        data += 4;
+        len -= 4;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        a ^= (uint32_t)data[i] << (8 * i);
+    }
+    return a;
+}
+
+uint32_t Checksum::sumBytesPortable(const uint8_t *data, uint32_t len)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+    uint32_t d = 0;
+    while (len >= 4) {
+        a += data[0];
+        b += data[1];
+        c += data[2];
+        d += data[3];
+        data += 4;
+        len -= 4;
+    }
+    a += b + c + d;
+    while (len > 0) {
+        a += *data;
+        ++data;
+        --len;
+    }
+    return a;
+}
+
+#ifdef CHECKSUM_X86
+/* Vector kernels consume whole vectors and leave the tail to the
+ * portable ones. Vector sizes are multiples of 4, so the tail starts
+ * on a word boundary and XOR lanes line up. */
+__attribute__((target("sse2")))
+static uint32_t xor32Sse2(const uint8_t *data, uint32_t len)
+{
+    __m128i acc = _mm_setzero_si128();
+    while (len >= 16) {
+        acc = _mm_xor_si128(acc,
+            _mm_loadu_si128((const __m128i *)data));
+        data += 16;
+        len -= 16;
+    }
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+    return (uint32_t)_mm_cvtsi128_si32(acc)
+        ^ Checksum::xor32Portable(data, len);
+}
+
+__attribute__((target("sse2")))
+static uint32_t sumBytesSse2(const uint8_t *data, uint32_t len)
+{
+    // SAD against zero sums 8 bytes into each 64-bit lane
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    while (len >= 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(
+            _mm_loadu_si128((const __m128i *)data), zero));
+        data += 16;
+        len -= 16;
+    }
+    acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+    return (uint32_t)_mm_cvtsi128_si32(acc)
+        + Checksum::sumBytesPortable(data, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t xor32Avx2(const uint8_t *data, uint32_t len)
+{
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    while (len >= 64) {
+        acc0 = _mm256_xor_si256(acc0,
+            _mm256_loadu_si256((const __m256i *)data));
+        acc1 = _mm256_xor_si256(acc1,
+            _mm256_loadu_si256((const __m256i *)(data + 32)));
+        data += 64;
+        len -= 64;
+    }
+    if (len >= 32) {
+        acc0 = _mm256_xor_si256(acc0,
+            _mm256_loadu_si256((const __m256i *)data));
+        data += 32;
+        len -= 32;
+    }
+    acc0 = _mm256_xor_si256(acc0, acc1);
+    __m128i acc = _mm_xor_si128(
+        _mm256_castsi256_si128(acc0),
+        _mm256_extracti128_si256(acc0, 1));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+    return (uint32_t)_mm_cvtsi128_si32(acc)
+        ^ Checksum::xor32Portable(data, len);
+}
+
+__attribute__((target("avx2")))
+static uint32_t sumBytesAvx2(const uint8_t *data, uint32_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    while (len >= 32) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+            _mm256_loadu_si256((const __m256i *)data), zero));
+        data += 32;
+        len -= 32;
+    }
+    __m128i sum = _mm_add_epi64(
+        _mm256_castsi256_si128(acc),
+        _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+    return (uint32_t)_mm_cvtsi128_si32(sum)
+        + Checksum::sumBytesPortable(data, len);
+}
+#endif
+
+static void checksumSelect()
+{
+    crc32c_impl = Checksum::crc32cPortable;
+    crc32c_impl_name = "portable";
+    xor32_impl = Checksum::xor32Portable;
+    xor32_impl_name = "portable";
+    sum_impl = Checksum::sumBytesPortable;
+    sum_impl_name = "portable";
+    isa_level = Checksum::ISA_PORTABLE;
+#ifdef CHECKSUM_X86
+    if (isa_limit >= Checksum::ISA_SSE) {
+        if (__builtin_cpu_supports("sse2")) {
+            xor32_impl = xor32Sse2;
+            xor32_impl_name = "sse2";
+            sum_impl = sumBytesSse2;
+            sum_impl_name = "sse2";
+            isa_level = Checksum::ISA_SSE;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            crc32c_impl = crc32cSse42;
+            crc32c_impl_name = "sse4.2";
+            isa_level = Checksum::ISA_SSE;
+        }
+    }
+    if (isa_limit >= Checksum::ISA_AVX2
+        && __builtin_cpu_supports("avx2")) {
+        xor32_impl = xor32Avx2;
+        xor32_impl_name = "avx2";
+        sum_impl = sumBytesAvx2;
+        sum_impl_name = "avx2";
+        isa_level = Checksum::ISA_AVX2;
+    }
+#endif
+}
+
+uint32_t Checksum::crc32c(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    runOnce(&select_state, checksumSelect);
+    return crc32c_impl(crc, data, len);
+}
+
+uint32_t Checksum::xor32(const uint8_t *data, uint32_t len)
+{
+    runOnce(&select_state, checksumSelect);
+    return xor32_impl(data, len);
+}
+
+uint32_t Checksum::sumBytes(const uint8_t *data, uint32_t len)
+{
+    runOnce(&select_state, checksumSelect);
+    return sum_impl(data, len);
+}
+
+const char *Checksum::name(uint8_t algo)
+{
+    runOnce(&select_state, checksumSelect);
+    switch (algo) {
+    case ALGO_XOR:
+        return xor32_impl_name;
+    case ALGO_CRC:
+        return crc32c_impl_name;
+    case ALGO_SUMMOD:
+        return sum_impl_name;
+    }
+    return "unknown";
+}
+
+uint32_t Checksum::limitIsa(uint32_t isa)
+{
+    runOnce(&select_state, checksumSelect);
+    isa_limit = isa;
+    checksumSelect();
+    return isa_level;
+}
+
+bool Checksum::compute(
+    uint8_t algo,
+    const uint8_t *data,
+    uint32_t len,
+    uint32_t *res)
+{
+    *res = 0;
+    for (uint32_t bit = 1; bit <= 0x80; bit <<= 1) {
+        if (!(algo & bit)) {
+            continue;
+        }
+        switch (bit) {
+        case ALGO_XOR:
+            *res ^= xor32(data, len);
+            break;
+        case ALGO_CRC:
+            *res ^= crc32c(0, data, len);
+            break;
+        case ALGO_SUMMOD:
+            *res ^= sumBytes(data, len);
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,576 @@
+#include "fs/clothescheck.hh"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+// Blocks read at once when following freechain, it mostly runs upwards
+static const uint32_t CHAIN_WINDOW = 256;
+
+ClothesCheck::ClothesCheck(ClothesFS *fs, uint32_t threads)
+    : m_fs(fs),
+    m_threads(threads > 0 ? threads : 1),
+    m_blocksize(fs->m_blocksize),
+    m_blocks(fs->m_blocks),
+    m_checked(false),
+    m_owned(nullptr),
+    m_shared(nullptr),
+    m_free(nullptr),
+    m_chain_ok(true),
+    m_owned_max(0),
+    m_queue(nullptr),
+    m_queue_count(0),
+    m_queue_size(0),
+    m_active(0),
+    m_problems(0),
+    m_bad(0),
+    m_shared_count(0),
+    m_files(0),
+    m_dirs(0),
+    m_owned_count(0),
+    m_leaked(0)
+{
+    pthread_mutex_init(&m_lock, nullptr);
+    pthread_cond_init(&m_cond, nullptr);
+    pthread_mutex_init(&m_report_lock, nullptr);
+
+    uint32_t words = (m_blocks + 31) / 32;
+    m_owned = new uint32_t[words];
+    m_shared = new uint32_t[words];
+    m_free = new uint32_t[words];
+    for (uint32_t i = 0; i < words; ++i) {
+        m_owned[i] = 0;
+        m_shared[i] = 0;
+        m_free[i] = 0;
+    }
+}
+
+ClothesCheck::~ClothesCheck()
+{
+    delete[] m_owned;
+    delete[] m_shared;
+    delete[] m_free;
+    if (m_queue != nullptr) {
+        delete[] m_queue;
+    }
+    pthread_mutex_destroy(&m_lock);
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_report_lock);
+}
+
+void ClothesCheck::report(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    pthread_mutex_lock(&m_report_lock);
+    ++m_problems;
+    vprintf(fmt, args);
+    printf("\n");
+    pthread_mutex_unlock(&m_report_lock);
+    va_end(args);
+}
+
+bool ClothesCheck::claim(uint32_t block, uint32_t node)
+{
+    if (block >= m_blocks) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: points to %u past end of volume", node, block);
+        return false;
+    }
+
+    uint32_t bit = 1u << (block % 32);
+    uint32_t old = __atomic_fetch_or(
+        &m_owned[block / 32], bit, __ATOMIC_RELAXED);
+    if (old & bit) {
+        __atomic_fetch_or(&m_shared[block / 32], bit, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m_shared_count, 1, __ATOMIC_RELAXED);
+        report("block %u: referenced again by %u", block, node);
+        return false;
+    }
+    return true;
+}
+
+void ClothesCheck::reserve(uint32_t start, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        claim(start + i, 0);
+    }
+}
+
+bool ClothesCheck::readMeta(uint32_t block, uint8_t type, uint8_t *data)
+{
+    if (!m_fs->getBlock(block, data)) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: read failed", block);
+        return false;
+    }
+    if (data[0] != 0x42 || data[1] != 0x00 || data[2] != type) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: expected metadata type 0x%02x, found %02x %02x type 0x%02x",
+            block, type, data[0], data[1], data[2]);
+        return false;
+    }
+    return true;
+}
+
+void ClothesCheck::walkIndex(uint32_t index, uint32_t dir, uint8_t *data)
+{
+    if (!claim(index, dir)
+        || !readMeta(index, ClothesFS::META_DIR_CONT, data)) {
+        return;
+    }
+
+    // Bucket table is only needed while its chains are followed
+    uint32_t count = (m_blocksize - 8) / 4;
+    uint32_t *buckets = new uint32_t[count];
+    for (uint32_t i = 0; i < count; ++i) {
+        buckets[i] = ClothesFS::dataToNum(data, 4 + 4 * i, 4);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t block = buckets[i];
+        while (block != 0) {
+            if (!claim(block, dir)
+                || !readMeta(block, ClothesFS::META_DIR_CONT, data)) {
+                break;
+            }
+            block = ClothesFS::dataToNum(data, m_blocksize - 4, 4);
+        }
+    }
+    delete[] buckets;
+}
+
+void ClothesCheck::walk(const Node &node, uint8_t *data)
+{
+    if (!claim(node.block, node.parent)) {
+        return;
+    }
+    if (!m_fs->getBlock(node.block, data)) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: read failed", node.block);
+        return;
+    }
+
+    uint8_t type = data[2];
+    uint8_t base = m_fs->baseType(type);
+    bool dir = base == ClothesFS::META_DIR;
+    if (data[0] != 0x42 || data[1] != 0x00
+        || (dir && type != ClothesFS::META_DIR
+            && type != (ClothesFS::META_DIR | ClothesFS::META_INDEXED))
+        || (!dir && (type & ~(ClothesFS::META_EXTENTS
+            | ClothesFS::META_INLINE)) != ClothesFS::META_FILE)) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: entry of %u is not file or directory, type 0x%02x",
+            node.block, node.parent, type);
+        return;
+    }
+
+    uint32_t start = m_fs->entryStart(data);
+    if (start > m_blocksize - 4) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: name does not fit in block", node.block);
+        return;
+    }
+    uint64_t size = ClothesFS::dataToNum(data, 4, 4)
+        | ((uint64_t)ClothesFS::dataToNum(data, 8, 4) << 32);
+
+    if (dir) {
+        __atomic_add_fetch(&m_dirs, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&m_files, 1, __ATOMIC_RELAXED);
+    }
+    if (!dir && (type & ClothesFS::META_INLINE)) {
+        if (size > m_blocksize - 4 - start) {
+            __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+            report("block %u: inline size %llu does not fit in block",
+                node.block, (unsigned long long)size);
+        }
+        if (ClothesFS::dataToNum(data, m_blocksize - 4, 4) != 0) {
+            __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+            report("block %u: inline file continues", node.block);
+        }
+        return;
+    }
+    if (type == (ClothesFS::META_DIR | ClothesFS::META_INDEXED)) {
+        uint32_t index = ClothesFS::dataToNum(data, start - 4, 4);
+        if (index != 0) {
+            // Index walk reuses buffer, keep entry block aside
+            uint8_t *entry = new uint8_t[m_blocksize];
+            m_fs->copyBuffer(entry, data, m_blocksize);
+            walkIndex(index, node.block, data);
+            m_fs->copyBuffer(data, entry, m_blocksize);
+            delete[] entry;
+        }
+    }
+
+    // Entries end at first zero of each block, chain may go on
+    bool extents = !dir && (type & ClothesFS::META_EXTENTS);
+    uint32_t width = extents ? 8 : 4;
+    uint8_t cont = dir ? ClothesFS::META_DIR_CONT : ClothesFS::META_FILE_CONT;
+    uint64_t payload = 0;
+    while (true) {
+        for (uint32_t pos = start; pos + width <= m_blocksize - 4; pos += width) {
+            uint32_t block = ClothesFS::dataToNum(data, pos, 4);
+            if (block == 0) {
+                break;
+            }
+            if (dir) {
+                push(block, node.block);
+                continue;
+            }
+            uint32_t len = 1;
+            if (extents) {
+                len = ClothesFS::dataToNum(data, pos + 4, 4);
+                if (len == 0) {
+                    break;
+                }
+                if (len > m_blocks - block) {
+                    __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+                    report("block %u: extent %u+%u past end of volume",
+                        node.block, block, len);
+                    continue;
+                }
+            }
+            for (uint32_t i = 0; i < len; ++i) {
+                claim(block + i, node.block);
+            }
+            payload += len;
+        }
+
+        uint32_t next = ClothesFS::dataToNum(data, m_blocksize - 4, 4);
+        if (next == 0
+            || !claim(next, node.block)
+            || !readMeta(next, cont, data)) {
+            break;
+        }
+        start = m_fs->entryStart(data);
+    }
+
+    // Smallest payload header leaves blocksize - 4 bytes of data
+    if (!dir && size > payload * (m_blocksize - 4)) {
+        __atomic_add_fetch(&m_bad, 1, __ATOMIC_RELAXED);
+        report("block %u: size %llu needs more than %llu payload blocks",
+            node.block, (unsigned long long)size,
+            (unsigned long long)payload);
+    }
+}
+
+void ClothesCheck::push(uint32_t block, uint32_t parent)
+{
+    pthread_mutex_lock(&m_lock);
+    if (m_queue_count == m_queue_size) {
+        uint32_t size = m_queue_size == 0 ? 256 : 2 * m_queue_size;
+        Node *queue = new Node[size];
+        for (uint32_t i = 0; i < m_queue_count; ++i) {
+            queue[i] = m_queue[i];
+        }
+        if (m_queue != nullptr) {
+            delete[] m_queue;
+        }
+        m_queue = queue;
+        m_queue_size = size;
+    }
+    m_queue[m_queue_count].block = block;
+    m_queue[m_queue_count].parent = parent;
+    ++m_queue_count;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+}
+
+bool ClothesCheck::pop(Node *node)
+{
+    pthread_mutex_lock(&m_lock);
+    // Busy workers may still push more
+    while (m_queue_count == 0 && m_active > 0) {
+        pthread_cond_wait(&m_cond, &m_lock);
+    }
+    if (m_queue_count == 0) {
+        pthread_mutex_unlock(&m_lock);
+        return false;
+    }
+    --m_queue_count;
+    *node = m_queue[m_queue_count];
+    ++m_active;
+    pthread_mutex_unlock(&m_lock);
+    return true;
+}
+
+void ClothesCheck::done()
+{
+    pthread_mutex_lock(&m_lock);
+    --m_active;
+    if (m_active == 0 && m_queue_count == 0) {
+        pthread_cond_broadcast(&m_cond);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+void *ClothesCheck::worker(void *arg)
+{
+    ((ClothesCheck*)arg)->work();
+    return nullptr;
+}
+
+void ClothesCheck::work()
+{
+    uint8_t *data = new uint8_t[m_blocksize];
+    Node node;
+    while (pop(&node)) {
+        walk(node, data);
+        done();
+    }
+    delete[] data;
+}
+
+void ClothesCheck::checkFreechain()
+{
+    uint32_t limit = m_blocks;
+    if (m_fs->m_flags & ClothesFS::FLAG_LAZY) {
+        limit = m_fs->m_untouched;
+    }
+
+    uint8_t *window = new uint8_t[CHAIN_WINDOW * m_blocksize];
+    uint32_t window_start = 0;
+    uint32_t window_count = 0;
+    uint32_t prev = 0;
+    uint32_t block = m_fs->m_freechain;
+    while (block != 0) {
+        if (block >= limit) {
+            report("freechain: block %u after %u is outside free area",
+                block, prev);
+            m_chain_ok = false;
+            break;
+        }
+        if (test(m_free, block)) {
+            report("freechain: cycle back to %u after %u", block, prev);
+            m_chain_ok = false;
+            break;
+        }
+        // Its link is contents of the owner now, chain ends here
+        if (test(m_owned, block)) {
+            report("freechain: block %u after %u is in use", block, prev);
+            m_chain_ok = false;
+            break;
+        }
+        set(m_free, block);
+
+        if (block < window_start || block >= window_start + window_count) {
+            window_start = block;
+            window_count = limit - block;
+            if (window_count > CHAIN_WINDOW) {
+                window_count = CHAIN_WINDOW;
+            }
+            if (!m_fs->getBlocks(window_start, window_count, window)) {
+                report("freechain: read of block %u failed", block);
+                m_chain_ok = false;
+                break;
+            }
+        }
+        const uint8_t *data = window + (block - window_start) * m_blocksize;
+        if (data[0] != 0x42 || data[2] != ClothesFS::META_FREE) {
+            report("freechain: block %u after %u is not marked free",
+                block, prev);
+            m_chain_ok = false;
+            break;
+        }
+        prev = block;
+        block = ClothesFS::dataToNum((uint8_t*)data, m_blocksize - 4, 4);
+    }
+    delete[] window;
+}
+
+uint8_t ClothesCheck::spaceState(uint32_t block) const
+{
+    bool used = test(m_owned, block);
+    bool free;
+    if (m_fs->m_flags & ClothesFS::FLAG_BITMAP) {
+        free = !m_fs->bitmapTest(block);
+    } else {
+        free = test(m_free, block)
+            || ((m_fs->m_flags & ClothesFS::FLAG_LAZY)
+                && block >= m_fs->m_untouched);
+    }
+    if (used && free) {
+        return SPACE_CONFLICT;
+    }
+    if (!used && !free) {
+        return SPACE_LEAKED;
+    }
+    return SPACE_OK;
+}
+
+uint32_t ClothesCheck::reportRuns(uint8_t state, const char *what)
+{
+    uint32_t total = 0;
+    uint32_t start = 0;
+    uint32_t len = 0;
+    for (uint32_t block = 0; block <= m_blocks; ++block) {
+        if (block < m_blocks && spaceState(block) == state) {
+            if (len == 0) {
+                start = block;
+            }
+            ++len;
+            continue;
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (len == 1) {
+            report("%s: block %u", what, start);
+        } else {
+            report("%s: blocks %u-%u", what, start, start + len - 1);
+        }
+        total += len;
+        len = 0;
+    }
+    return total;
+}
+
+bool ClothesCheck::check()
+{
+    // Header, free space map and journal areas belong to volume
+    reserve(0, 1);
+    if (m_fs->m_flags & ClothesFS::FLAG_BITMAP) {
+        reserve(m_fs->m_bitmap_start, m_fs->m_bitmap_blocks);
+    }
+    uint32_t area = Journal::areaBlocks(m_blocksize);
+    if (m_fs->m_journal1 != 0) {
+        reserve(m_fs->m_journal1, area);
+    }
+    if (m_fs->m_journal2 != 0) {
+        reserve(m_fs->m_journal2, area);
+    }
+
+    push(m_fs->m_root, 0);
+    pthread_t *threads = new pthread_t[m_threads];
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < m_threads; ++i) {
+        if (pthread_create(&threads[started], nullptr, worker, this) == 0) {
+            ++started;
+        }
+    }
+    if (started == 0) {
+        work();
+    }
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], nullptr);
+    }
+    delete[] threads;
+
+    if (m_fs->m_flags & ClothesFS::FLAG_BITMAP) {
+        reportRuns(SPACE_CONFLICT, "in use but marked free");
+    } else {
+        checkFreechain();
+        if (m_fs->m_flags & ClothesFS::FLAG_LAZY) {
+            if (reportRuns(SPACE_CONFLICT, "in use in untouched area") > 0) {
+                m_chain_ok = false;
+            }
+        }
+    }
+    m_leaked = reportRuns(SPACE_LEAKED, "leaked");
+
+    m_owned_count = 0;
+    for (uint32_t block = 0; block < m_blocks; ++block) {
+        if (test(m_owned, block)) {
+            ++m_owned_count;
+            m_owned_max = block;
+        }
+    }
+    if (m_owned_count != m_fs->m_used) {
+        report("header: %u blocks used, %u found", m_fs->m_used, m_owned_count);
+    }
+
+    m_checked = true;
+    return m_problems == 0;
+}
+
+bool ClothesCheck::rebuildFreechain()
+{
+    uint32_t limit = m_blocks;
+    if (m_fs->m_flags & ClothesFS::FLAG_LAZY) {
+        // Owned blocks of untouched area become touched
+        if (m_fs->m_untouched <= m_owned_max) {
+            m_fs->m_untouched = m_owned_max + 1;
+        }
+        limit = m_fs->m_untouched;
+    }
+
+    // Chain runs upwards and is written downwards in runs,
+    // each block links to the free block above it
+    uint8_t *buf = new uint8_t[m_blocksize * IO_BATCH_BLOCKS];
+    uint32_t next = 0;
+    uint32_t count = 0;
+    bool res = true;
+    for (uint32_t block = limit; res && block-- > 1;) {
+        bool free = !test(m_owned, block);
+        if (count > 0 && (!free || count == IO_BATCH_BLOCKS)) {
+            res = m_fs->putBlocks(next, count,
+                buf + (IO_BATCH_BLOCKS - count) * m_blocksize);
+            count = 0;
+        }
+        if (!free) {
+            continue;
+        }
+        uint8_t *data = buf + (IO_BATCH_BLOCKS - 1 - count) * m_blocksize;
+        m_fs->clearBuffer(data, m_blocksize);
+        ClothesFS::numToData(0x42, data, 0, 4);
+        ClothesFS::numToData(next, data, m_blocksize - 4, 4);
+        next = block;
+        ++count;
+    }
+    if (res && count > 0) {
+        res = m_fs->putBlocks(next, count,
+            buf + (IO_BATCH_BLOCKS - count) * m_blocksize);
+    }
+    delete[] buf;
+    if (res) {
+        m_fs->m_freechain = next;
+    }
+    return res;
+}
+
+bool ClothesCheck::repair()
+{
+    if (!m_checked) {
+        return false;
+    }
+
+    // Whole map may not fit in journal, it is written in place
+    Journal *journal = m_fs->m_journal;
+    if (journal != nullptr) {
+        if (!m_fs->sync()) {
+            return false;
+        }
+        m_fs->m_journal = nullptr;
+    }
+
+    bool res = true;
+    if (m_fs->m_flags & ClothesFS::FLAG_BITMAP) {
+        for (uint32_t block = 0; res && block < m_blocks; ++block) {
+            bool used = test(m_owned, block);
+            if (m_fs->bitmapTest(block) != used) {
+                res = m_fs->bitmapSet(block, used);
+            }
+        }
+    } else if (m_chain_ok) {
+        // Sound chain is kept, leaked blocks go in front of it
+        for (uint32_t block = m_blocks; res && block-- > 1;) {
+            if (spaceState(block) == SPACE_LEAKED) {
+                res = m_fs->formatBlock(block, m_fs->m_freechain);
+                m_fs->m_freechain = block;
+            }
+        }
+    } else {
+        res = rebuildFreechain();
+    }
+
+    if (res) {
+        m_fs->m_used = m_owned_count;
+        m_fs->m_super_dirty = true;
+        res = m_fs->flushSuper() && m_fs->sync();
+    }
+    // Replaying last transaction would bring back stale map blocks
+    if (res && journal != nullptr) {
+        res = journal->clear();
+    }
+    m_fs->m_journal = journal;
+    return res;
+}
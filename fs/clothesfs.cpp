@@ -1,4 +1,5 @@
 #include "fs/clothesfs.hh"
+#include "fs/blockcache.hh"
 
 #ifdef LINUX_BUILD
 #include <stdlib.h>
@@ -11,8 +12,16 @@
 #endif
 
 static uint32_t header_begin = 8 * 4;
+static uint32_t header_flags = header_begin + 6;
+static uint32_t header_root = header_begin + 56;
+static uint32_t header_used = header_begin + 60;
+static uint32_t header_journal1 = header_begin + 64;
+static uint32_t header_journal2 = header_begin + 68;
+static uint32_t header_freechain = header_begin + 72;
+static uint32_t header_untouched = header_begin + 76;
 static uint32_t metadata_id = 0x42;
 static uint32_t payload_id = 0x4242;
+static uint8_t meta_modifiers = ClothesFS::META_EXTENTS | ClothesFS::META_INLINE;
 
 static const uint32_t MAX_SECTOR_SIZE = 4096;
 static const uint32_t MAX_BLOCK_SIZE = 4096;
@@ -33,7 +42,33 @@ do {\
 
 ClothesFS::ClothesFS()
     : m_phys(nullptr),
-    m_blocksize(512)
+    m_blocksize(512),
+    m_freechain(0),
+    m_root(0),
+    m_used(0),
+    m_journal1(0),
+    m_journal2(0),
+    m_super_dirty(false),
+    m_flags(0),
+    m_untouched(0),
+    m_bitmap(nullptr),
+    m_bitmap_dirty(nullptr),
+    m_bitmap_free(nullptr),
+    m_bitmap_start(0),
+    m_bitmap_blocks(0),
+    m_groups(nullptr),
+    m_group_count(0),
+    m_group_blocks(0),
+    m_cache(nullptr),
+    m_cache_budget(0),
+    m_cache_mode(BlockCache::WRITE_THROUGH),
+    m_dentry(new DentryCache(DENTRY_SLOTS)),
+    m_algo(ALGO_DISABLED),
+    m_journal(nullptr),
+    m_hazards(nullptr),
+    m_retired(nullptr),
+    m_retired_count(0),
+    m_retired_size(0)
 {
 #ifdef LINUX_BUILD
     struct timeval tv;
@@ -45,6 +80,100 @@ ClothesFS::ClothesFS()
 
 ClothesFS::~ClothesFS()
 {
+    releaseRetired();
+    if (m_journal != nullptr) {
+        sync();
+        dropJournal();
+    } else {
+        flushSuper();
+    }
+    freeBitmap();
+    if (m_cache != nullptr) {
+        delete m_cache;
+    }
+    delete m_dentry;
+    while (m_hazards != nullptr) {
+        Hazard *next = m_hazards->next;
+        delete m_hazards;
+        m_hazards = next;
+    }
+    if (m_retired != nullptr) {
+        delete[] m_retired;
+    }
+}
+
+bool ClothesFS::setChecksum(uint8_t algo)
+{
+    uint32_t res;
+    if (!Checksum::compute(algo, nullptr, 0, &res)) {
+        returnError(false);
+    }
+    m_algo = algo;
+    return true;
+}
+
+void ClothesFS::setDentryCache(uint32_t slots)
+{
+    delete m_dentry;
+    m_dentry = new DentryCache(slots);
+}
+
+void ClothesFS::setCache(uint64_t budget, BlockCache::Mode mode)
+{
+    m_cache_budget = budget;
+    m_cache_mode = mode;
+    resetCache();
+}
+
+void ClothesFS::dropCache(bool discard)
+{
+    if (m_cache != nullptr) {
+        if (discard) {
+            m_cache->invalidate();
+        }
+        delete m_cache;
+        m_cache = nullptr;
+    }
+}
+
+void ClothesFS::resetCache()
+{
+    dropCache(false);
+    if (m_phys != nullptr && m_cache_budget >= m_blocksize) {
+        m_cache = new BlockCache(
+            m_phys,
+            m_blocksize,
+            m_cache_budget,
+            m_cache_mode);
+    }
+}
+
+bool ClothesFS::sync()
+{
+    if (m_phys == nullptr) {
+        return false;
+    }
+    releaseRetired();
+    MutexGuard guard(m_meta_lock);
+    if (m_journal != nullptr) {
+        // Commit is durable once written, places are flushed by next one
+        do {
+            if (!commitJournal()) {
+                returnError(false);
+            }
+        } while (m_journal->freeCount() > 0);
+        if (m_cache != nullptr) {
+            return m_cache->flush();
+        }
+        return true;
+    }
+    if (!flushSuper()) {
+        return false;
+    }
+    if (m_cache != nullptr) {
+        return m_cache->sync();
+    }
+    return m_phys->sync();
 }
 
 bool ClothesFS::verifySectorSize() const
@@ -79,56 +208,347 @@ bool ClothesFS::detect()
         returnError(false);
     }
 
+    // Header is read from disk, so flush pending writes first
+    if (m_journal != nullptr) {
+        sync();
+        dropJournal();
+    } else {
+        flushSuper();
+    }
+    dropCache(false);
+    m_dentry->invalidate();
+
     uint8_t buf[MAX_SECTOR_SIZE];
     if (!m_phys->read(buf, 1, 0, 0)) {
         returnError(false);
     }
 
     m_blocksize = dataToNum(buf, header_begin + 4, 2);
+    if (m_blocksize < m_phys->sectorSize()) {
+        returnError(false);
+    }
+    m_blocks = m_phys->size() / m_blocksize;
+    m_block_in_sectors = m_blocksize / m_phys->sectorSize();
+    resetCache();
 
-    return (m_blocksize <= MAX_BLOCK_SIZE
+    if (!(m_blocksize <= MAX_BLOCK_SIZE
         && buf[header_begin + 0] == 0x00
         && buf[header_begin + 1] == 0x42
         && buf[header_begin + 2] == 0x00
-        && buf[header_begin + 3] == 0x41);
+        && buf[header_begin + 3] == 0x41)) {
+        return false;
+    }
+
+    // Committed updates may be missing from their places after crash
+    uint32_t journal1 = dataToNum(buf, header_journal1, 4);
+    uint32_t journal2 = dataToNum(buf, header_journal2, 4);
+    if (journal1 != 0 && !openJournal(journal1, journal2)) {
+        returnError(false);
+    }
+
+    return loadSuper();
 }
 
 bool ClothesFS::getBlock(uint32_t index, uint8_t *data)
 {
-    for (uint32_t block = 0; block < m_block_in_sectors; --block) {
-        uint64_t pos = index * m_blocksize;
-        pos += block * m_phys->sectorSize();
+    return getBlocks(index, 1, data);
+}
 
-        if (!m_phys->read(
-                data + m_phys->sectorSize() * block,
-                1,
-                pos & 0xFFFFFFFF,
-                (pos >> 32) & 0xFFFFFFFF)) {
-            returnError(false);
+bool ClothesFS::putBlock(uint32_t index, uint8_t *data)
+{
+    return putBlocks(index, 1, data);
+}
+
+bool ClothesFS::getBlocks(uint32_t index, uint32_t count, uint8_t *data)
+{
+    uint64_t commits = journalCommits();
+    do {
+        if (m_cache != nullptr) {
+            for (uint32_t i = 0; i < count; ++i) {
+                if (!m_cache->read(index + i, data + i * m_blocksize)) {
+                    returnError(false);
+                }
+            }
+        } else {
+            uint64_t pos = (uint64_t)index * m_blocksize;
+
+            if (!m_phys->read(
+                    data,
+                    count * m_block_in_sectors,
+                    pos & 0xFFFFFFFF,
+                    (pos >> 32) & 0xFFFFFFFF)) {
+                returnError(false);
+            }
+        }
+    } while (!overlayJournal(index, nullptr, count, data, &commits));
+    return true;
+}
+
+bool ClothesFS::putBlocks(uint32_t index, uint32_t count, uint8_t *data)
+{
+    if (m_journal != nullptr) {
+        MutexGuard guard(m_meta_lock);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!logBlock(index + i, data + i * m_blocksize)) {
+                returnError(false);
+            }
+        }
+        return true;
+    }
+    return storeBlocks(index, count, data);
+}
+
+bool ClothesFS::storeBlocks(uint32_t index, uint32_t count, uint8_t *data)
+{
+    if (m_cache != nullptr) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!m_cache->write(index + i, data + i * m_blocksize)) {
+                returnError(false);
+            }
         }
+        return true;
+    }
+
+    uint64_t pos = (uint64_t)index * m_blocksize;
+
+    if (!m_phys->write(
+            data,
+            count * m_block_in_sectors,
+            pos & 0xFFFFFFFF,
+            (pos >> 32) & 0xFFFFFFFF)) {
+        returnError(false);
     }
 
     return true;
 }
 
-bool ClothesFS::putBlock(uint32_t index, uint8_t *data)
+const uint8_t *ClothesFS::borrowBlock(uint32_t index)
+{
+    // Backend memory may be older than cached or logged block
+    if (m_cache != nullptr || journalHas(index)) {
+        return nullptr;
+    }
+
+    uint64_t pos = (uint64_t)index * m_blocksize;
+
+    return m_phys->borrow(
+        m_block_in_sectors,
+        pos & 0xFFFFFFFF,
+        (pos >> 32) & 0xFFFFFFFF);
+}
+
+void ClothesFS::releaseBlock(const uint8_t *data)
+{
+    m_phys->release((uint8_t*)data);
+}
+
+const uint8_t *ClothesFS::pinBlock(uint32_t index)
+{
+    if (journalHas(index)) {
+        return nullptr;
+    }
+    if (m_cache != nullptr) {
+        return m_cache->pin(index);
+    }
+    return borrowBlock(index);
+}
+
+void ClothesFS::unpinBlock(uint32_t index, const uint8_t *data)
+{
+    if (m_cache != nullptr) {
+        m_cache->unpin(index);
+        return;
+    }
+    releaseBlock(data);
+}
+
+const uint8_t *ClothesFS::viewBlock(uint32_t index, uint8_t *buffer)
+{
+    const uint8_t *view = pinBlock(index);
+    if (view != nullptr) {
+        return view;
+    }
+    if (!getBlock(index, buffer)) {
+        return nullptr;
+    }
+    return buffer;
+}
+
+void ClothesFS::dropView(
+    uint32_t index,
+    const uint8_t *view,
+    const uint8_t *buffer)
+{
+    if (view != nullptr && view != buffer) {
+        unpinBlock(index, view);
+    }
+}
+
+uint32_t ClothesFS::blockRuns(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data,
+    FilesystemPhysVec *vec)
+{
+    uint32_t runs = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (runs > 0
+            && indices[i] == indices[i - 1] + 1) {
+            vec[runs - 1].sectors += m_block_in_sectors;
+            continue;
+        }
+        uint64_t pos = (uint64_t)indices[i] * m_blocksize;
+        vec[runs].buffer = data + i * m_blocksize;
+        vec[runs].sectors = m_block_in_sectors;
+        vec[runs].pos = pos & 0xFFFFFFFF;
+        vec[runs].pos_hi = (pos >> 32) & 0xFFFFFFFF;
+        ++runs;
+    }
+    return runs;
+}
+
+bool ClothesFS::getBlockList(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data)
+{
+    if (count == 0) return true;
+    uint64_t commits = journalCommits();
+    do {
+        if (m_cache != nullptr) {
+            if (!m_cache->readList(indices, count, data)) {
+                returnError(false);
+            }
+        } else {
+            FilesystemPhysVec *vec = new FilesystemPhysVec[count];
+            uint32_t runs = blockRuns(indices, count, data, vec);
+            bool res = m_phys->readv(vec, runs);
+            delete[] vec;
+
+            if (!res) {
+                returnError(false);
+            }
+        }
+    } while (!overlayJournal(0, indices, count, data, &commits));
+    return true;
+}
+
+bool ClothesFS::putBlockList(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data,
+    bool logged)
 {
-    for (uint32_t block = 0; block < m_block_in_sectors; --block) {
-        uint64_t pos = index * m_blocksize;
-        pos += block * m_phys->sectorSize();
+    if (m_journal == nullptr) {
+        return storeBlockList(indices, count, data);
+    }
 
-        if (!m_phys->write(
-                data + m_phys->sectorSize() * block,
-                1,
-                pos & 0xFFFFFFFF,
-                (pos >> 32) & 0xFFFFFFFF)) {
+    // Direct payload write itself goes outside the lock
+    m_meta_lock.lock();
+    bool direct = !logged;
+    for (uint32_t i = 0; direct && i < count; ++i) {
+        // Link of block still on committed freechain can't be overwritten
+        direct = !m_journal->taken(indices[i]);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t *block = data + i * m_blocksize;
+        bool res = true;
+        if (logged || m_journal->taken(indices[i])) {
+            res = logBlock(indices[i], block);
+        } else if (!revokeBlock(indices[i])) {
+            res = false;
+        } else if (!direct) {
+            res = storeBlocks(indices[i], 1, block);
+        }
+        if (!res) {
+            m_meta_lock.unlock();
             returnError(false);
         }
     }
+    m_meta_lock.unlock();
+    if (direct) {
+        return storeBlockList(indices, count, data);
+    }
+    return true;
+}
+
+bool ClothesFS::storeBlockList(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data)
+{
+    if (count == 0) return true;
+    if (m_cache != nullptr) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!m_cache->write(indices[i], data + i * m_blocksize)) {
+                returnError(false);
+            }
+        }
+        return true;
+    }
+
+    FilesystemPhysVec *vec = new FilesystemPhysVec[count];
+    uint32_t runs = blockRuns(indices, count, data, vec);
+    bool res = m_phys->writev(vec, runs);
+    delete[] vec;
+
+    if (!res) {
+        returnError(false);
+    }
+    return true;
+}
+
+bool ClothesFS::prefetchBlocks(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data,
+    FilesystemPhysRequest *req,
+    uint32_t *pending)
+{
+    *pending = 0;
+    if (count == 0) return true;
+
+    // Backend may hold older copy of cached or logged blocks
+    bool logged = false;
+    if (m_journal != nullptr) {
+        MutexGuard guard(m_meta_lock);
+        logged = !m_journal->empty();
+    }
+    if (m_cache != nullptr || logged) {
+        return getBlockList(indices, count, data);
+    }
+
+    FilesystemPhysVec *vec = new FilesystemPhysVec[count];
+    uint32_t runs = blockRuns(indices, count, data, vec);
+    for (uint32_t i = 0; i < runs; ++i) {
+        req[i].vec = vec[i];
+        req[i].write = false;
+        req[i].done = false;
+        req[i].ok = false;
+    }
+    delete[] vec;
 
+    if (!m_phys->submit(req, runs)) {
+        returnError(false);
+    }
+    *pending = runs;
     return true;
 }
 
+bool ClothesFS::waitBlocks(FilesystemPhysRequest *req, uint32_t count)
+{
+    bool res = true;
+    for (uint32_t i = 0; i < count; ++i) {
+        // Completion may be reaped by another thread
+        while (!req[i].finished()) {
+            if (m_phys->complete(1) == 0 && !req[i].finished()) {
+                returnError(false);
+            }
+        }
+        res = res && req[i].ok;
+    }
+    return res;
+}
 
 bool ClothesFS::formatBlock(uint32_t num, uint32_t next)
 {
@@ -143,17 +563,51 @@ bool ClothesFS::formatBlock(uint32_t num, uint32_t next)
 
 uint32_t ClothesFS::formatBlocks()
 {
-    uint32_t next = 0;
     uint32_t start = 2;
-    for (uint32_t i = m_blocks - 1; i >= start; --i) {
-        if (!formatBlock(i, next)) {
-            return 0;
+    if (m_blocks <= start) {
+        return 0;
+    }
+
+    // Chain runs upwards, so whole runs can be written at once
+    uint8_t *buf = allocBlocks(IO_BATCH_BLOCKS);
+    if (buf == nullptr) {
+        return 0;
+    }
+    clearBuffer(buf, m_blocksize * IO_BATCH_BLOCKS);
+
+    bool res = true;
+    for (uint32_t i = start; res && i < m_blocks; i += IO_BATCH_BLOCKS) {
+        uint32_t cnt = m_blocks - i;
+        if (cnt > IO_BATCH_BLOCKS) {
+            cnt = IO_BATCH_BLOCKS;
         }
-        next = i;
+        for (uint32_t b = 0; b < cnt; ++b) {
+            uint8_t *block = buf + b * m_blocksize;
+            uint32_t next = i + b + 1;
+            if (next >= m_blocks) {
+                next = 0;
+            }
+            numToData(metadata_id, block, 0, 4);
+            numToData(next, block, m_blocksize - 4, 4);
+        }
+        res = putBlocks(i, cnt, buf);
+    }
+
+    FilesystemPhys::freeBuffer(buf);
+    if (!res) {
+        return 0;
     }
     return start;
 }
 
+uint8_t *ClothesFS::allocBlocks(uint32_t count) const
+{
+    if (m_phys == nullptr) {
+        return nullptr;
+    }
+    return m_phys->allocBuffer((uint64_t)count * m_blocksize);
+}
+
 void ClothesFS::clearBuffer(uint8_t *buf, uint32_t size)
 {
     for (uint32_t i = 0; i < size; ++i) {
@@ -161,20 +615,41 @@ void ClothesFS::clearBuffer(uint8_t *buf, uint32_t size)
     }
 }
 
+void ClothesFS::copyBuffer(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+#ifdef LINUX_BUILD
+    memcpy(dst, src, size);
+#else
+    Mem::move(dst, src, size);
+#endif
+}
+
 void ClothesFS::setPhysical(FilesystemPhys *phys)
 {
+    if (m_journal != nullptr) {
+        sync();
+        dropJournal();
+    }
+    dropCache(false);
     m_phys = phys;
     m_blocks = m_phys->size() / m_blocksize;
     m_block_in_sectors = m_blocksize / m_phys->sectorSize();
+    resetCache();
 }
 
 bool ClothesFS::format(
-    const char *volid)
+    const char *volid,
+    uint8_t flags)
 {
     if (!verifySectorSize()) return false;
 
-    uint8_t buf[MAX_SECTOR_SIZE];
-    clearBuffer(buf, m_phys->sectorSize());
+    // Whole volume is rewritten, old cached and logged blocks are void
+    dropJournal();
+    dropCache(true);
+    m_dentry->invalidate();
+
+    uint8_t buf[MAX_BLOCK_SIZE];
+    clearBuffer(buf, m_blocksize);
 
     buf[header_begin + 0] = 0x00;
     buf[header_begin + 1] = 0x42;
@@ -186,8 +661,14 @@ bool ClothesFS::format(
 
     pos += 2;
 
+    // Bitmap is small to write, lazy format is for freechain only
+    flags &= FLAG_BITMAP | FLAG_LAZY;
+    if (flags & FLAG_BITMAP) {
+        flags &= ~FLAG_LAZY;
+    }
+
     //flags
-    buf[pos] = 0x0;
+    buf[pos] = flags;
     //grpindex
     buf[pos + 1] = 0x0;
 
@@ -221,7 +702,20 @@ bool ClothesFS::format(
     numToData(1, buf, pos, 4);
     pos += 4;
 
-    uint32_t freechain = formatBlocks();
+    // Bitmap volumes keep free space map right after root
+    freeBitmap();
+    uint32_t freechain = 0;
+    if (flags & FLAG_BITMAP) {
+        if (!initBitmap(2)) {
+            returnError(false);
+        }
+        freechain = m_bitmap_start;
+    } else if (flags & FLAG_LAZY) {
+        // Blocks from untouched onwards are free without formatting
+        numToData(2, buf, header_untouched, 4);
+    } else {
+        freechain = formatBlocks();
+    }
 
     // Used
     numToData(2, buf, pos, 4);
@@ -239,7 +733,28 @@ bool ClothesFS::format(
     numToData(freechain, buf, pos, 4);
     pos += 4;
 
-    bool res = m_phys->write(buf, 1, 0, 0);
+    bool res = putBlock(0, buf);
+    resetCache();
+
+    m_flags = flags;
+    m_untouched = 0;
+    if (m_flags & FLAG_LAZY) {
+        m_untouched = 2;
+    }
+    m_root = 1;
+    m_used = 2;
+    m_journal1 = 0;
+    m_journal2 = 0;
+    m_freechain = freechain;
+    m_super_dirty = false;
+    if (m_flags & FLAG_BITMAP) {
+        m_freechain = 0;
+        m_used += m_bitmap_blocks;
+        m_super_dirty = true;
+        if (!flushSuper()) {
+            returnError(false);
+        }
+    }
 
     if (res and m_blocksize > 512) {
         // TODO
@@ -270,517 +785,3002 @@ bool ClothesFS::initMeta(
 }
 
 uint32_t ClothesFS::initData(
-    uint32_t index,
+    uint8_t *data,
     uint8_t type,
     uint8_t algo)
 {
-    uint8_t data[MAX_BLOCK_SIZE];
     clearBuffer(data, m_blocksize);
 
     numToData(payload_id, data, 0, 2);
     numToData(type, data, 2, 1);
     numToData(algo, data, 3, 1);
 
-    if (!putBlock(index, data)) {
-        return 0;
-    }
+    return dataStart(algo);
+}
 
+uint32_t ClothesFS::dataStart(uint8_t algo) const
+{
+    // Check field exists only with an algorithm
+    if (algo != ALGO_DISABLED) {
+        return 8;
+    }
     return 4;
 }
 
-uint32_t ClothesFS::takeFreeBlock()
+void ClothesFS::sealData(uint8_t *data)
 {
-    uint8_t data[MAX_BLOCK_SIZE];
-    uint8_t block[MAX_BLOCK_SIZE];
-    if (!getBlock(0, data)) {
-        return 0;
+    uint8_t algo = data[3];
+    uint32_t sum = 0;
+    if (algo == ALGO_DISABLED
+        || !Checksum::compute(algo, data + 8, m_blocksize - 8, &sum)) {
+        return;
     }
+    numToData(sum, data, 4, 4);
+}
 
-    uint32_t freechain = dataToNum(data, 104, 4);
-
-    if (!getBlock(freechain, block)) {
-        return 0;
+bool ClothesFS::verifyData(const uint8_t *data) const
+{
+    uint8_t algo = data[3];
+    if (algo == ALGO_DISABLED) {
+        return true;
     }
-    uint32_t next_freechain = dataToNum(block, m_blocksize - 4, 4);
-
-    numToData(next_freechain, data, 104, 4);
-    if (!putBlock(0, data)) {
-        return 0;
+    uint32_t sum = 0;
+    if (!Checksum::compute(algo, data + 8, m_blocksize - 8, &sum)) {
+        return false;
     }
-
-    return freechain;
+    return sum == dataToNum((uint8_t*)data, 4, 4);
 }
 
-bool ClothesFS::addFreeBlock(uint32_t id)
+bool ClothesFS::loadSuper()
 {
-    if (id == 0) return false;
-
     uint8_t data[MAX_BLOCK_SIZE];
-    uint8_t block[MAX_BLOCK_SIZE];
-
     if (!getBlock(0, data)) {
-        return false;
-    }
-    if (!getBlock(id, block)) {
-        return false;
-    }
-    uint8_t status = dataToNum(block, 2, 1);
-    if (status == META_FREE) {
-        return false;
+        returnError(false);
     }
 
-    uint32_t freechain = dataToNum(data, 104, 4);
-
-    numToData(freechain, block, m_blocksize - 4, 4);
-    numToData(0x42, block, 0, 4);
-    numToData(id, data, 104, 4);
+    m_flags = dataToNum(data, header_flags, 1);
+    m_root = dataToNum(data, header_root, 4);
+    m_used = dataToNum(data, header_used, 4);
+    m_journal1 = dataToNum(data, header_journal1, 4);
+    m_journal2 = dataToNum(data, header_journal2, 4);
+    m_freechain = dataToNum(data, header_freechain, 4);
+    m_untouched = 0;
+    if (m_flags & FLAG_LAZY) {
+        m_untouched = dataToNum(data, header_untouched, 4);
+    }
+    m_super_dirty = false;
 
-    if (!putBlock(0, data)) {
-        return false;
+    freeBitmap();
+    if (m_flags & FLAG_BITMAP) {
+        uint32_t start = m_freechain;
+        m_freechain = 0;
+        return loadBitmap(start);
     }
 
     return true;
 }
 
-bool ClothesFS::dirContinues(
-    uint32_t index,
-    uint32_t next)
+bool ClothesFS::flushSuper()
 {
+    MutexGuard guard(m_meta_lock);
+    if (!flushBitmap()) {
+        returnError(false);
+    }
+    // Allocation groups mark it dirty without meta lock
+    if (!__atomic_exchange_n(&m_super_dirty, false, __ATOMIC_ACQ_REL)) {
+        return true;
+    }
+
     uint8_t data[MAX_BLOCK_SIZE];
-    if (!getBlock(index, data)) {
+    if (!getBlock(0, data)) {
+        __atomic_store_n(&m_super_dirty, true, __ATOMIC_RELEASE);
         returnError(false);
     }
 
-    numToData(next, data, m_blocksize - 4, 4);
-    return putBlock(index, data);
-}
+    // Bitmap volumes store bitmap location in freechain slot
+    uint32_t freechain = m_freechain;
+    if (m_flags & FLAG_BITMAP) {
+        freechain = m_bitmap_start;
+    }
 
-uint8_t ClothesFS::baseType(uint8_t type) const
-{
-    if (type == META_FILE_CONT) type = META_FILE;
-    else if (type == META_DIR_CONT) type = META_DIR;
-    return type;
-}
+    numToData(m_flags, data, header_flags, 1);
+    numToData(m_root, data, header_root, 4);
+    numToData(__atomic_load_n(&m_used, __ATOMIC_RELAXED), data, header_used, 4);
+    numToData(m_journal1, data, header_journal1, 4);
+    numToData(m_journal2, data, header_journal2, 4);
+    numToData(freechain, data, header_freechain, 4);
+    numToData(m_untouched, data, header_untouched, 4);
 
-bool ClothesFS::validType(uint8_t type, uint8_t valid) const
-{
-    type = baseType(type);
-    valid = baseType(valid);
+    if (!putBlock(0, data)) {
+        __atomic_store_n(&m_super_dirty, true, __ATOMIC_RELEASE);
+        returnError(false);
+    }
 
-    return type == valid;
+    return true;
 }
 
-bool ClothesFS::addToMeta(
-    uint32_t index,
-    uint32_t meta,
-    uint8_t type)
+bool ClothesFS::enableJournal()
 {
-    uint8_t data[MAX_BLOCK_SIZE];
-    if (!getBlock(index, data)) {
+    if (m_phys == nullptr) {
         returnError(false);
     }
-
-    uint32_t id = dataToNum(data, 0, 2);
-    if (id != metadata_id) {
-        returnError(false);
+    if (m_journal != nullptr) {
+        return true;
     }
 
-    uint32_t data_type = dataToNum(data, 2, 1);
-    //FIXME hardcode
-    if (!validType(data_type, type)) {
+    // Areas are written as one request, so each needs a contiguous run
+    uint32_t count = Journal::areaBlocks(m_blocksize);
+    uint32_t *blocks = new uint32_t[2 * count];
+    if (takeFreeBlocks(2 * count, blocks, allocGroup()) != 2 * count) {
+        delete[] blocks;
         returnError(false);
     }
-
-    uint32_t ptr = 4;
-    if (type == META_FILE
-        || type == META_DIR) {
-        ptr += 8;
-        uint32_t namelen = dataToNum(data, ptr, 4);
-        ptr += namelen;
-        while (ptr % 4 != 0) {
-            ++ptr;
+    bool contiguous = true;
+    for (uint32_t i = 1; i < 2 * count; ++i) {
+        if (i != count && blocks[i] != blocks[i - 1] + 1) {
+            contiguous = false;
         }
     }
-    while (ptr < m_blocksize - 4) {
-        uint32_t val = dataToNum(data, ptr, 4);
-        if (val == 0) {
-            numToData(meta, data, ptr, 4);
-            return putBlock(index, data);
+    uint32_t area1 = blocks[0];
+    uint32_t area2 = blocks[count];
+    if (!contiguous) {
+        for (uint32_t i = 0; i < 2 * count; ++i) {
+            pushFreeBlock(blocks[i]);
         }
-        ptr += 4;
     }
-    uint32_t next = dataToNum(data, m_blocksize - 4, 4);
-    if (next != 0) {
-        return addToMeta(next, meta, type);
+    delete[] blocks;
+    if (!contiguous) {
+        returnError(false);
     }
 
-    next = takeFreeBlock();
-    uint32_t next_type = META_DIR_CONT;
-    if (type == META_FILE
-        || type == META_FILE_CONT) {
-        next_type = META_FILE_CONT;
+    // Areas and header pointing to them are written in place
+    m_journal1 = area1;
+    m_journal2 = area2;
+    m_super_dirty = true;
+    if (!sync()) {
+        returnError(false);
     }
-    if (next != 0) {
-        if (dirContinues(index, next)
-            && initMeta(next, next_type)) {
-            return addToMeta(next, meta, type);
-        }
+    m_journal = new Journal(m_phys, m_blocksize, area1, area2);
+    if (!m_journal->clear()) {
+        dropJournal();
+        returnError(false);
     }
-
-    returnError(false);
+    return true;
 }
 
-bool ClothesFS::addData(
-    uint32_t meta,
-    const char *contents,
-    uint64_t size)
+bool ClothesFS::openJournal(uint32_t area1, uint32_t area2)
 {
-    uint32_t data_block = takeFreeBlock();
-    if (data_block == 0) {
-        returnError(false);
-    }
-    if (!addToMeta(meta, data_block, META_FILE)) {
+    uint32_t count = Journal::areaBlocks(m_blocksize);
+    if (area1 < 2 || area2 < 2
+        || area1 + count > m_blocks || area2 + count > m_blocks) {
         returnError(false);
     }
 
-    uint32_t pos = initData(data_block, PAYLOAD_USED, 0);
-    uint8_t data[MAX_BLOCK_SIZE];
-    if (!getBlock(data_block, data)) {
+    // Replay writes places directly, cache must not have them yet
+    dropJournal();
+    if (m_cache != nullptr) {
+        m_cache->invalidate();
+    }
+    m_journal = new Journal(m_phys, m_blocksize, area1, area2);
+    if (!m_journal->replay()) {
+        dropJournal();
         returnError(false);
     }
+    return true;
+}
 
-    const char *input = contents;
-    uint64_t data_size = size;
-    while (data_size > 0 && pos < m_blocksize) {
-        data[pos] = *input;
-        ++pos;
-        ++input;
-        --data_size;
+void ClothesFS::dropJournal()
+{
+    if (m_journal != nullptr) {
+        delete m_journal;
     }
+    m_journal = nullptr;
+}
 
-    if (!putBlock(data_block, data)) {
-        returnError(false);
-    }
-    if (data_size > 0) {
-        return addData(meta, input, data_size);
+bool ClothesFS::journalHas(uint32_t index)
+{
+    if (m_journal == nullptr) {
+        return false;
     }
+    MutexGuard guard(m_meta_lock);
+    return m_journal->contains(index);
+}
 
-    return true;
+uint64_t ClothesFS::journalCommits()
+{
+    if (m_journal == nullptr) {
+        return 0;
+    }
+    MutexGuard guard(m_meta_lock);
+    return m_journal->commits();
 }
 
-bool ClothesFS::updateMeta(
+bool ClothesFS::overlayJournal(
     uint32_t index,
-    const uint8_t *name,
-    uint64_t size)
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data,
+    uint64_t *commits)
 {
-    uint8_t data[MAX_BLOCK_SIZE];
-    if (!getBlock(index, data)) {
-        returnError(false);
+    if (m_journal == nullptr) {
+        return true;
     }
 
-    uint32_t type = baseType(dataToNum(data, 2, 1));
-    if (type != META_FILE
-        && type != META_DIR) {
-        returnError(false);
+    // Commit since the read may have moved logged blocks in place
+    // after their places were read, read again then
+    MutexGuard guard(m_meta_lock);
+    if (m_journal->commits() != *commits) {
+        *commits = m_journal->commits();
+        return false;
     }
 
-    numToData(size, data, 4, 8);
-    uint32_t len = 0;
-    uint32_t pos = 16;
-    while (name != nullptr
-        && *name != 0) {
-        data[pos] = *name;
-        ++pos;
-        ++name;
-        ++len;
+    // Uncommitted blocks are newer than their places
+    if (indices != nullptr) {
+        m_journal->overlayList(indices, count, data);
+    } else {
+        m_journal->overlay(index, count, data);
     }
-    numToData(len, data, 12, 4);
+    return true;
+}
 
-    while (pos % 4 != 0) {
-        ++pos;
+bool ClothesFS::logBlock(uint32_t index, const uint8_t *data)
+{
+    MutexGuard guard(m_meta_lock);
+    // Last entry is kept for header, which is written on commit
+    if (index != 0
+        && m_journal->room() <= 1
+        && !m_journal->contains(index)) {
+        if (!commitJournal()) {
+            returnError(false);
+        }
     }
-
-    return putBlock(index, data);
+    if (!m_journal->log(index, data)) {
+        returnError(false);
+    }
+    return true;
 }
 
-bool ClothesFS::addFile(
-    uint32_t parent,
-    const char *name,
-    const char *contents,
-    uint64_t size)
+bool ClothesFS::revokeBlock(uint32_t index)
 {
-    if (parent == 0) {
-        returnError(false);
+    MutexGuard guard(m_meta_lock);
+    if (m_journal->room() <= 1 && m_journal->needsRevoke(index)) {
+        if (!commitJournal()) {
+            returnError(false);
+        }
     }
-    uint32_t block = takeFreeBlock();
-    if (block == 0) {
+    if (!m_journal->revoke(index)) {
         returnError(false);
     }
-    if (!addToMeta(parent, block, META_DIR)) {
-        returnError(false);
+    return true;
+}
+
+/* Open transaction is durable once this returns, meta lock is held */
+bool ClothesFS::writeJournal()
+{
+    // Release of freed blocks commits now, leaving room for header
+    while (m_journal->freeCount() > 0 && m_journal->room() > 2) {
+        if (!pushFreeBlock(m_journal->takeFree())) {
+            returnError(false);
+        }
     }
-    if (!initMeta(block, META_FILE)) {
+    if (!flushSuper()) {
         returnError(false);
     }
-    if (!updateMeta(block, (const uint8_t*)name, size)) {
-        returnError(false);
+    if (m_journal->empty()) {
+        return true;
     }
 
-    return addData(block, contents, size);
+    // Payload and places of last commit reach disk before this one,
+    // the single flush after journal write covers them all
+    if (m_cache != nullptr && !m_cache->flush()) {
+        returnError(false);
+    }
+    return m_journal->write();
 }
 
-bool ClothesFS::addDir(
-    uint32_t parent,
-    const char *name)
+bool ClothesFS::commitWithoutCheckpoint()
 {
-    if (parent == 0) {
-        returnError(false);
-    }
-    uint32_t block = takeFreeBlock();
-    if (block == 0) {
+    if (m_journal == nullptr) {
         returnError(false);
     }
-    if (!addToMeta(parent, block, META_DIR)) {
+    MutexGuard guard(m_meta_lock);
+    return writeJournal();
+}
+
+bool ClothesFS::commitJournal()
+{
+    MutexGuard guard(m_meta_lock);
+    if (!writeJournal()) {
         returnError(false);
     }
-    if (!initMeta(block, META_DIR)) {
-        returnError(false);
+    if (m_journal->empty()) {
+        return true;
     }
-    if (!updateMeta(block, (const uint8_t*)name, 0)) {
+    if (!storeBlockList(
+            m_journal->blocks(),
+            m_journal->count(),
+            (uint8_t*)m_journal->images())) {
         returnError(false);
     }
+    m_journal->finish();
     return true;
 }
 
-ClothesFS::Iterator ClothesFS::list(
-    uint32_t parent)
+bool ClothesFS::endUpdate(bool res)
 {
-    Iterator iter(parent, 0);
-    if (parent == 0) {
-        returnError(iter);
+    if (m_journal == nullptr) {
+        return res;
     }
 
-    // FIXME free old
-    iter.m_parent = (uint8_t*)new uint8_t[m_blocksize];
-    iter.m_data = (uint8_t*)new uint8_t[m_blocksize];
-    iter.m_content = (uint8_t*)new uint8_t[m_blocksize];
-    iter.m_fs = this;
-
-    if (!getBlock(parent, iter.m_parent)) {
-        returnError(iter);
-    }
-    if (!iter.getCurrent()) {
-        returnError(iter);
+    // Updates are grouped, commit once half of journal is used
+    MutexGuard guard(m_meta_lock);
+    if (m_journal->needsCommit()) {
+        if (!commitJournal()) {
+            returnError(false);
+        }
     }
+    return res;
+}
 
-    iter.m_ok = true;
-    return iter;
+uint32_t ClothesFS::bitmapSize() const
+{
+    uint32_t bits = m_blocksize * 8;
+    return (m_blocks + bits - 1) / bits;
 }
 
-bool ClothesFS::Iterator::getCurrent()
+void ClothesFS::freeBitmap()
 {
-    uint32_t type = dataToNum(m_parent, 2, 1);
-    if (type == 0) {
-        returnError(false);
+    if (m_bitmap != nullptr) {
+        FilesystemPhys::freeBuffer(m_bitmap);
+        delete[] m_bitmap_dirty;
+        delete[] m_bitmap_free;
+        delete[] m_groups;
     }
+    m_bitmap = nullptr;
+    m_bitmap_dirty = nullptr;
+    m_bitmap_free = nullptr;
+    m_bitmap_start = 0;
+    m_bitmap_blocks = 0;
+    m_groups = nullptr;
+    m_group_count = 0;
+    m_group_blocks = 0;
+}
 
-    uint32_t start = 4;
-    if (type == META_FILE
-        || type == META_DIR) {
-        start += 8;
-        uint32_t namelen = m_fs->dataToNum(m_parent, start, 4);
-        start += 4;
-        start += namelen;
-        while (start % 4 != 0) {
-            ++start;
-        }
+void ClothesFS::allocBitmap()
+{
+    freeBitmap();
+    m_bitmap_blocks = bitmapSize();
+    m_bitmap = allocBlocks(m_bitmap_blocks);
+    m_bitmap_dirty = new bool[m_bitmap_blocks];
+    m_bitmap_free = new uint32_t[m_bitmap_blocks];
+
+    // Whole bitmap bytes per group, so no byte is shared
+    m_group_count = m_blocks / ALLOC_GROUP_MIN;
+    if (m_group_count > ALLOC_GROUPS) {
+        m_group_count = ALLOC_GROUPS;
     }
-    uint32_t pos = 4  * m_index + start;
-    if (pos >= m_fs->blockSize() - 4) {
-        uint32_t next_block = m_fs->dataToNum(
-            m_parent,
-            m_fs->blockSize() - 4,
-            4);
-        if (next_block == 0) {
-            return false;
+    if (m_group_count == 0) {
+        m_group_count = 1;
+    }
+    m_group_blocks = (m_blocks + m_group_count - 1) / m_group_count;
+    m_group_blocks = (m_group_blocks + 7) & ~7;
+    m_group_count = (m_blocks + m_group_blocks - 1) / m_group_blocks;
+    m_groups = new AllocGroup[m_group_count];
+    for (uint32_t i = 0; i < m_group_count; ++i) {
+        m_groups[i].start = i * m_group_blocks;
+        m_groups[i].end = m_groups[i].start + m_group_blocks;
+        if (m_groups[i].end > m_blocks) {
+            m_groups[i].end = m_blocks;
         }
-        if (!m_fs->getBlock(next_block, m_parent)) {
-            return false;
+        m_groups[i].hint = m_groups[i].start;
+        m_groups[i].free = 0;
+    }
+}
+
+void ClothesFS::countBitmap()
+{
+    uint32_t bits = m_blocksize * 8;
+    for (uint32_t i = 0; i < m_bitmap_blocks; ++i) {
+        m_bitmap_free[i] = 0;
+    }
+    for (uint32_t i = 0; i < m_group_count; ++i) {
+        m_groups[i].free = 0;
+    }
+    for (uint32_t b = 0; b < m_blocks; ++b) {
+        if (!bitmapTest(b)) {
+            ++m_bitmap_free[b / bits];
+            ++m_groups[groupOf(b)].free;
         }
-        m_index = 0;
-        pos = 4  * m_index;
     }
+}
 
-    m_block = m_fs->dataToNum(m_parent, pos, 4);
-    if (m_block == 0) {
-        return false;
+bool ClothesFS::bitmapTest(uint32_t block) const
+{
+    if (block >= m_blocks) {
+        return true;
     }
-    return m_fs->getBlock(m_block, m_data);
+    return (m_bitmap[block / 8] >> (block % 8)) & 1;
 }
 
-uint64_t ClothesFS::Iterator::read(
-    uint8_t *buf,
-    uint64_t cnt)
+bool ClothesFS::bitmapSet(uint32_t block, bool used)
 {
-    uint32_t type = dataToNum(m_data, 2, 1);
-/*
-    if (type != META_FILE
-        || type != META_FILE_CONT) {
-        returnError(0);
+    if (block >= m_blocks || bitmapTest(block) == used) {
+        return true;
     }
-*/
 
-    if ((m_pos == 0 && m_data_block == 0)
-        || m_pos >= m_fs->blockSize()) {
-        // FIXME: store pos
-        uint32_t start = 4;
-        if (type == META_FILE) {
-            start += 8;
-            uint32_t namelen = m_fs->dataToNum(m_data, start, 4);
-            start += 4;
-            start += namelen;
-            while (start % 4 != 0) {
-                ++start;
-            }
+    // Counts and dirty flags of a bitmap block may be shared by groups
+    uint32_t index = block / (m_blocksize * 8);
+    AllocGroup &group = m_groups[groupOf(block)];
+    if (m_journal != nullptr
+        && !__atomic_load_n(&m_bitmap_dirty[index], __ATOMIC_RELAXED)) {
+        // Takes journal entry before the change, so header fits in when
+        // committing and bit isn't changed when no entry is left.
+        // Contents are logged again by flushBitmap on commit.
+        if (!logBlock(m_bitmap_start + index, m_bitmap + index * m_blocksize)) {
+            returnError(false);
         }
+    }
+    if (used) {
+        m_bitmap[block / 8] |= 1 << (block % 8);
+        __atomic_sub_fetch(&m_bitmap_free[index], 1, __ATOMIC_RELAXED);
+        --group.free;
+    } else {
+        m_bitmap[block / 8] &= ~(1 << (block % 8));
+        __atomic_add_fetch(&m_bitmap_free[index], 1, __ATOMIC_RELAXED);
+        ++group.free;
+    }
+    __atomic_store_n(&m_bitmap_dirty[index], true, __ATOMIC_RELAXED);
+    return true;
+}
 
-        uint32_t pos = 4  * m_data_index + start;
-        if (pos >= m_fs->blockSize() - 4) {
-            uint32_t next_block = m_fs->dataToNum(
-                m_data,
-                m_fs->blockSize() - 4,
-                4);
-            if (next_block == 0) {
-                return false;
-            }
-            if (!m_fs->getBlock(next_block, m_data)) {
-                return false;
-            }
-            m_data_index = 0;
-            pos = 4  * m_data_index + 4;
-        }
+bool ClothesFS::initBitmap(uint32_t start)
+{
+    allocBitmap();
+    clearBuffer(m_bitmap, m_bitmap_blocks * m_blocksize);
+    // Bits past end of volume are never free
+    for (uint32_t i = m_blocks; i < m_bitmap_blocks * m_blocksize * 8; ++i) {
+        m_bitmap[i / 8] |= 1 << (i % 8);
+    }
+    countBitmap();
 
-        m_data_block = m_fs->dataToNum(m_data, pos, 4);
-        if (m_data_block == 0) {
-            returnError(0);
-        }
-        if (!m_fs->getBlock(m_data_block, m_content)) {
-            return 0;
-        }
-        if (m_fs->dataToNum(m_content, 0, 2) != 0x4242) {
-            return 0;
-        }
-        if (m_fs->dataToNum(m_content, 2, 1) != PAYLOAD_USED) {
-            return 0;
+    m_bitmap_start = start;
+    for (uint32_t i = 0; i < start + m_bitmap_blocks; ++i) {
+        if (!bitmapSet(i, true)) {
+            returnError(false);
         }
-        //FIXME algo
-        m_pos = 4;
     }
-
-    uint8_t *dest = buf;
-    uint64_t got = 0;
-    while (m_pos < m_fs->blockSize() && cnt > 0) {
-        *dest = m_content[m_pos];
-        ++m_pos;
-        ++dest;
-        --cnt;
-        ++got;
+    for (uint32_t i = 0; i < m_bitmap_blocks; ++i) {
+        m_bitmap_dirty[i] = true;
     }
 
-    return got;
+    return flushBitmap();
 }
 
-bool ClothesFS::Iterator::next()
+bool ClothesFS::loadBitmap(uint32_t start)
 {
-    ++m_index;
-    m_ok = getCurrent();
-    m_pos = 0;
-    m_data_block = 0;
-    m_data_index = 0;
-    return m_ok;
+    allocBitmap();
+    m_bitmap_start = start;
+    if (start == 0
+        || start + m_bitmap_blocks > m_blocks
+        || !getBlocks(start, m_bitmap_blocks, m_bitmap)) {
+        freeBitmap();
+        returnError(false);
+    }
+    for (uint32_t i = 0; i < m_bitmap_blocks; ++i) {
+        m_bitmap_dirty[i] = false;
+    }
+    countBitmap();
+
+    return true;
 }
 
-uint32_t ClothesFS::Iterator::nameLen()
+bool ClothesFS::flushBitmap()
 {
-    if (m_data == nullptr) return 0;
+    if (m_bitmap == nullptr) {
+        return true;
+    }
 
-    return dataToNum(m_data, 12, 4);
+    // Groups may share bitmap blocks, all are held while writing
+    for (uint32_t g = 0; g < m_group_count; ++g) {
+        m_groups[g].lock.lock();
+    }
+    bool res = true;
+    for (uint32_t i = 0; res && i < m_bitmap_blocks; ++i) {
+        if (!m_bitmap_dirty[i]) {
+            continue;
+        }
+        // Neighbouring dirty blocks go in one write
+        uint32_t cnt = 1;
+        while (i + cnt < m_bitmap_blocks && m_bitmap_dirty[i + cnt]) {
+            ++cnt;
+        }
+        res = putBlocks(m_bitmap_start + i, cnt, m_bitmap + i * m_blocksize);
+        if (res) {
+            for (uint32_t b = i; b < i + cnt; ++b) {
+                m_bitmap_dirty[b] = false;
+            }
+        }
+        i += cnt - 1;
+    }
+    for (uint32_t g = m_group_count; g > 0; --g) {
+        m_groups[g - 1].lock.unlock();
+    }
+    if (!res) {
+        returnError(false);
+    }
+    return true;
 }
 
-STD_STRING_TYPE ClothesFS::Iterator::name()
+uint32_t ClothesFS::bitmapFind(uint32_t from, uint32_t end) const
 {
-    if (m_data == nullptr) return "";
-
-    STD_STRING_TYPE res;
-    uint32_t namelen = nameLen();
-    for (uint32_t i = 0; i < namelen; ++i) {
-        res += (char)m_data[16 + i];
+    uint32_t bits = m_blocksize * 8;
+    uint32_t block = from;
+
+    while (block < end) {
+        uint32_t index = block / bits;
+        uint32_t stop = (index + 1) * bits;
+        // Full bitmap blocks are skipped without looking at bits
+        if (__atomic_load_n(&m_bitmap_free[index], __ATOMIC_RELAXED) == 0) {
+            block = stop;
+            continue;
+        }
+        if (stop > end) {
+            stop = end;
+        }
+        while (block < stop) {
+            if ((block % 8) == 0 && m_bitmap[block / 8] == 0xFF) {
+                block += 8;
+                continue;
+            }
+            if (!bitmapTest(block)) {
+                return block;
+            }
+            ++block;
+        }
     }
-    return res;
+    return 0;
 }
 
-uint64_t ClothesFS::Iterator::size()
+uint32_t ClothesFS::takeFreeRun(
+    uint32_t want,
+    uint32_t *start,
+    uint32_t group)
 {
-    if (m_data == nullptr) return 0;
+    *start = 0;
+    if (want == 0) {
+        return 0;
+    }
+    if (!(m_flags & FLAG_BITMAP)) {
+        MutexGuard guard(m_meta_lock);
+        // Untouched area gives contiguous runs once chain is used up
+        if (m_freechain == 0 && (m_flags & FLAG_LAZY)
+            && m_untouched < m_blocks) {
+            uint32_t len = m_blocks - m_untouched;
+            if (len > want) {
+                len = want;
+            }
+            *start = m_untouched;
+            m_untouched += len;
+            countUsed(len);
+            return len;
+        }
+        *start = takeFreeBlock();
+        return *start != 0 ? 1 : 0;
+    }
 
-    return dataToNum(m_data, 4, 8);
+    // Other groups are used only when own one is full
+    for (uint32_t n = 0; n < m_group_count; ++n) {
+        uint32_t len = takeGroupRun((group + n) % m_group_count, want, start);
+        if (len > 0) {
+            return len;
+        }
+    }
+    returnError(0);
 }
 
-uint8_t ClothesFS::Iterator::type() const
+uint32_t ClothesFS::findGroupRun(
+    uint32_t group,
+    uint32_t want,
+    uint32_t *start) const
 {
-    if (m_data == nullptr) return 0;
+    const AllocGroup &grp = m_groups[group];
+    *start = 0;
+    if (grp.free == 0) {
+        return 0;
+    }
 
-    return m_fs->baseType(dataToNum(m_data, 2, 1));
+    // First run long enough wins, else longest one seen
+    uint32_t best = 0;
+    uint32_t best_len = 0;
+    uint32_t block = bitmapFind(grp.hint, grp.end);
+    if (block == 0) {
+        block = bitmapFind(grp.start, grp.end);
+    }
+    uint32_t first = block;
+    bool wrapped = false;
+    while (block != 0) {
+        uint32_t len = 1;
+        while (len < want && block + len < grp.end
+            && !bitmapTest(block + len)) {
+            ++len;
+        }
+        if (len > best_len) {
+            best = block;
+            best_len = len;
+        }
+        if (len >= want) {
+            break;
+        }
+        uint32_t next = bitmapFind(block + len, grp.end);
+        if (next == 0) {
+            next = bitmapFind(grp.start, grp.end);
+        }
+        if (next <= block) {
+            wrapped = true;
+        }
+        if (wrapped && next >= first) {
+            break;
+        }
+        block = next;
+    }
+
+    *start = best;
+    return best_len;
 }
 
-bool ClothesFS::Iterator::remove()
+uint32_t ClothesFS::takeGroupRun(
+    uint32_t group,
+    uint32_t want,
+    uint32_t *start)
 {
-    if (m_data == nullptr) return false;
-    m_pos = 0;
-    m_data_block = 0;
-    m_data_index = 0;
-    uint32_t type = dataToNum(m_data, 2, 1);
-    uint32_t the_block = m_block;
+    GroupGuard guard(this, group);
+    uint32_t len = findGroupRun(group, want, start);
+    if (len > 0 && !claimRun(*start, len)) {
+        return 0;
+    }
+    return len;
+}
 
-    uint32_t start = 4;
+bool ClothesFS::claimRun(uint32_t start, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; ++i) {
+        if (!bitmapSet(start + i, true)) {
+            // Blocks set so far are in logged bitmap blocks already
+            while (i-- > 0) {
+                bitmapSet(start + i, false);
+            }
+            returnError(false);
+        }
+    }
+    m_groups[groupOf(start)].hint = start + len;
+    countUsed(len);
+    return true;
+}
+
+void ClothesFS::countUsed(int32_t delta)
+{
+    // Groups count without common lock, count never goes below zero
+    uint32_t used = __atomic_load_n(&m_used, __ATOMIC_RELAXED);
+    uint32_t next;
+    do {
+        next = used + delta;
+        if (delta < 0 && used < (uint32_t)-delta) {
+            next = 0;
+        }
+    } while (!__atomic_compare_exchange_n(
+        &m_used, &used, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_store_n(&m_super_dirty, true, __ATOMIC_RELEASE);
+}
+
+ClothesFS::GroupGuard::GroupGuard(ClothesFS *fs, uint32_t group)
+    : m_fs(fs),
+    m_lock(fs->m_groups[group].lock),
+    m_meta(fs->m_journal != nullptr)
+{
+    if (m_meta) {
+        m_fs->m_meta_lock.lock();
+    }
+    m_lock.lock();
+}
+
+ClothesFS::GroupGuard::~GroupGuard()
+{
+    m_lock.unlock();
+    if (m_meta) {
+        m_fs->m_meta_lock.unlock();
+    }
+}
+
+bool ClothesFS::convertToBitmap()
+{
+    if (m_flags & FLAG_BITMAP) {
+        return true;
+    }
+
+    // Whole bitmap may not fit in journal, it is written in place
+    Journal *journal = m_journal;
+    if (journal != nullptr) {
+        if (!sync()) {
+            returnError(false);
+        }
+        m_journal = nullptr;
+        bool res = convertToBitmap() && sync();
+        m_journal = journal;
+        return res;
+    }
+
+    allocBitmap();
+    for (uint32_t i = 0; i < m_bitmap_blocks * m_blocksize; ++i) {
+        m_bitmap[i] = 0xFF;
+    }
+    countBitmap();
+
+    // Everything not in freechain is in use
+    uint8_t data[MAX_BLOCK_SIZE];
+    uint32_t block = m_freechain;
+    while (block != 0) {
+        if (block >= m_blocks || !bitmapTest(block)) {
+            freeBitmap();
+            returnError(false);
+        }
+        if (!bitmapSet(block, false) || !getBlock(block, data)) {
+            freeBitmap();
+            returnError(false);
+        }
+        block = dataToNum(data, m_blocksize - 4, 4);
+    }
+    if (m_flags & FLAG_LAZY) {
+        for (uint32_t i = m_untouched; i < m_blocks; ++i) {
+            if (!bitmapSet(i, false)) {
+                freeBitmap();
+                returnError(false);
+            }
+        }
+    }
+
+    uint8_t flags = m_flags;
+    uint32_t untouched = m_untouched;
+    m_flags &= ~FLAG_LAZY;
+    m_flags |= FLAG_BITMAP;
+    m_untouched = 0;
+    // First group with a run long enough gets bitmap
+    uint32_t start = 0;
+    for (uint32_t g = 0; g < m_group_count && start == 0; ++g) {
+        if (findGroupRun(g, m_bitmap_blocks, &start) != m_bitmap_blocks) {
+            start = 0;
+        }
+    }
+    if (start == 0) {
+        // Not enough contiguous space for bitmap, keep freechain
+        m_flags = flags;
+        m_untouched = untouched;
+        freeBitmap();
+        returnError(false);
+    }
+    if (!claimRun(start, m_bitmap_blocks)) {
+        m_flags = flags;
+        m_untouched = untouched;
+        freeBitmap();
+        returnError(false);
+    }
+
+    m_bitmap_start = start;
+    for (uint32_t i = 0; i < m_bitmap_blocks; ++i) {
+        m_bitmap_dirty[i] = true;
+    }
+    m_freechain = 0;
+    m_used = 0;
+    for (uint32_t i = 0; i < m_blocks; ++i) {
+        if (bitmapTest(i)) {
+            ++m_used;
+        }
+    }
+    m_super_dirty = true;
+
+    return flushSuper();
+}
+
+uint32_t ClothesFS::takeFreeBlock()
+{
+    if (m_flags & FLAG_BITMAP) {
+        uint32_t block = 0;
+        if (takeFreeRun(1, &block, allocGroup()) == 0) {
+            returnError(0);
+        }
+        return block;
+    }
+
+    MutexGuard guard(m_meta_lock);
+    uint32_t freechain = m_freechain;
+    if (freechain == 0) {
+        if ((m_flags & FLAG_LAZY) && m_untouched < m_blocks) {
+            ++m_untouched;
+            countUsed(1);
+            return m_untouched - 1;
+        }
+        returnError(0);
+    }
+
+    uint32_t next_freechain;
+    const uint8_t *view = borrowBlock(freechain);
+    if (view != nullptr) {
+        next_freechain = dataToNum((uint8_t*)view, m_blocksize - 4, 4);
+        releaseBlock(view);
+    } else {
+        uint8_t block[MAX_BLOCK_SIZE];
+        if (!getBlock(freechain, block)) {
+            return 0;
+        }
+        next_freechain = dataToNum(block, m_blocksize - 4, 4);
+    }
+
+    if (m_journal != nullptr) {
+        m_journal->noteTaken(freechain);
+    }
+
+    // Header is written on sync
+    m_freechain = next_freechain;
+    countUsed(1);
+
+    return freechain;
+}
+
+uint32_t ClothesFS::takeFreeBlocks(
+    uint32_t count,
+    uint32_t *blocks,
+    uint32_t group)
+{
+    uint32_t got = 0;
+    while (got < count) {
+        uint32_t start = 0;
+        uint32_t len = takeFreeRun(count - got, &start, group);
+        if (len == 0) {
+            // Out of space, give back what was taken
+            for (uint32_t i = 0; i < got; ++i) {
+                pushFreeBlock(blocks[i]);
+            }
+            returnError(0);
+        }
+        for (uint32_t i = 0; i < len; ++i) {
+            blocks[got] = start + i;
+            ++got;
+        }
+    }
+    return got;
+}
+
+bool ClothesFS::addFreeBlock(uint32_t id)
+{
+    if (id == 0 || id >= m_blocks) return false;
+    if (m_flags & FLAG_BITMAP) {
+        GroupGuard guard(this, groupOf(id));
+        // Refuse double free
+        if (!bitmapTest(id)) {
+            return false;
+        }
+        // Held back until commit like freechain blocks below
+        if (m_journal != nullptr) {
+            m_journal->deferFree(id);
+            return true;
+        }
+        return pushFreeBlock(id);
+    }
+
+    MutexGuard guard(m_meta_lock);
+    if ((m_flags & FLAG_LAZY) && id >= m_untouched) return false;
+
+    // Refuse double free
+    uint8_t block[MAX_BLOCK_SIZE];
+    if (!getBlock(id, block)) {
+        return false;
+    }
+    uint8_t status = dataToNum(block, 2, 1);
+    if (status == META_FREE) {
+        return false;
+    }
+
+    // Reusing it before commit would overwrite what committed state has
+    if (m_journal != nullptr) {
+        m_journal->deferFree(id);
+        return true;
+    }
+    return pushFreeBlock(id);
+}
+
+ClothesFS::Hazard *ClothesFS::takeHazard()
+{
+    MutexGuard guard(m_hazard_lock);
+    Hazard *hazard = m_hazards;
+    while (hazard != nullptr && hazard->used) {
+        hazard = hazard->next;
+    }
+    if (hazard == nullptr) {
+        hazard = new Hazard;
+        hazard->next = m_hazards;
+        m_hazards = hazard;
+    }
+    hazard->used = true;
+    hazard->dir.set(0);
+    hazard->file.set(0);
+    return hazard;
+}
+
+void ClothesFS::dropHazard(Hazard *hazard)
+{
+    bool retired;
+    {
+        MutexGuard guard(m_hazard_lock);
+        hazard->dir.set(0);
+        hazard->file.set(0);
+        hazard->used = false;
+        retired = m_retired_count > 0;
+    }
+    if (retired) {
+        releaseRetired();
+    }
+}
+
+bool ClothesFS::hazardHeld(uint32_t node) const
+{
+    for (Hazard *hazard = m_hazards; hazard != nullptr; hazard = hazard->next) {
+        if (hazard->used
+            && (hazard->dir.get() == node || hazard->file.get() == node)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ClothesFS::freeNodeBlock(uint32_t id, uint32_t node)
+{
+    {
+        // Iterator that published node may still read the block
+        MutexGuard guard(m_hazard_lock);
+        if (hazardHeld(node)) {
+            if (m_retired_count == m_retired_size) {
+                uint32_t size = m_retired_size == 0 ? 64 : 2 * m_retired_size;
+                uint32_t *retired = new uint32_t[2 * size];
+                for (uint32_t i = 0; i < 2 * m_retired_count; ++i) {
+                    retired[i] = m_retired[i];
+                }
+                if (m_retired != nullptr) {
+                    delete[] m_retired;
+                }
+                m_retired = retired;
+                m_retired_size = size;
+            }
+            m_retired[2 * m_retired_count] = id;
+            m_retired[2 * m_retired_count + 1] = node;
+            ++m_retired_count;
+            return true;
+        }
+    }
+    return addFreeBlock(id);
+}
+
+void ClothesFS::releaseRetired()
+{
+    uint32_t *released = nullptr;
+    uint32_t count = 0;
+    {
+        MutexGuard guard(m_hazard_lock);
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < m_retired_count; ++i) {
+            uint32_t id = m_retired[2 * i];
+            uint32_t node = m_retired[2 * i + 1];
+            if (hazardHeld(node)) {
+                m_retired[2 * kept] = id;
+                m_retired[2 * kept + 1] = node;
+                ++kept;
+                continue;
+            }
+            if (released == nullptr) {
+                released = new uint32_t[m_retired_count];
+            }
+            released[count] = id;
+            ++count;
+        }
+        m_retired_count = kept;
+    }
+
+    // Allocator lock is not taken under hazard lock
+    for (uint32_t i = 0; i < count; ++i) {
+        addFreeBlock(released[i]);
+    }
+    if (released != nullptr) {
+        delete[] released;
+    }
+}
+
+bool ClothesFS::pushFreeBlock(uint32_t id)
+{
+    if (m_flags & FLAG_BITMAP) {
+        GroupGuard guard(this, groupOf(id));
+        if (!bitmapSet(id, false)) {
+            returnError(false);
+        }
+        countUsed(-1);
+        return true;
+    }
+
+    MutexGuard guard(m_meta_lock);
+    if (!formatBlock(id, m_freechain)) {
+        return false;
+    }
+
+    m_freechain = id;
+    countUsed(-1);
+
+    return true;
+}
+
+uint8_t ClothesFS::baseType(uint8_t type) const
+{
+    type &= ~meta_modifiers;
+    if (type == META_FILE_CONT) type = META_FILE;
+    else if (type == META_DIR_CONT) type = META_DIR;
+    return type;
+}
+
+uint32_t ClothesFS::entryStart(const uint8_t *data) const
+{
+    uint32_t raw = dataToNum((uint8_t*)data, 2, 1);
+    uint32_t type = raw & ~meta_modifiers;
+    uint32_t start = 4;
     if (type == META_FILE
         || type == META_DIR) {
         start += 8;
-        uint32_t namelen = m_fs->dataToNum(m_data, start, 4);
+        uint32_t namelen = dataToNum((uint8_t*)data, start, 4);
         start += 4;
         start += namelen;
         while (start % 4 != 0) {
             ++start;
         }
     }
-    uint32_t pos = 4  * m_data_index + start;
+    // Pointer to hash index precedes entries
+    if (type == META_DIR
+        && (raw & META_INDEXED)) {
+        start += 4;
+    }
+    return start;
+}
+
+bool ClothesFS::validType(uint8_t type, uint8_t valid) const
+{
+    type = baseType(type);
+    valid = baseType(valid);
+
+    return type == valid;
+}
+
+bool ClothesFS::addToMeta(
+    uint32_t index,
+    uint32_t meta,
+    uint8_t type)
+{
+    return addToMetaList(index, &meta, 1, type);
+}
+
+bool ClothesFS::addToMetaList(
+    uint32_t index,
+    const uint32_t *metas,
+    uint32_t count,
+    uint8_t type,
+    uint32_t width)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    const uint8_t *view = viewBlock(index, data);
+    if (view == nullptr) {
+        returnError(false);
+    }
+
+    uint32_t id = dataToNum((uint8_t*)view, 0, 2);
+    uint32_t data_type = dataToNum((uint8_t*)view, 2, 1);
+    //FIXME hardcode
+    if (id != metadata_id || !validType(data_type, type)) {
+        dropView(index, view, data);
+        returnError(false);
+    }
+
+    uint32_t next_type = META_DIR_CONT;
+    if (type == META_FILE
+        || type == META_FILE_CONT) {
+        next_type = META_FILE_CONT;
+    }
+
+    // Entries are packed, so first empty slot is the end of list.
+    // Entry of several words never crosses a block. Full blocks are
+    // only looked at, the one to update is copied.
+    uint32_t entry = 4 * width;
+    uint32_t ptr = entryStart(view);
     while (true) {
-        if (pos >= m_fs->blockSize() - 4) {
-            m_fs->addFreeBlock(the_block);
-            uint32_t next_block = m_fs->dataToNum(
-                m_data,
-                m_fs->blockSize() - 4,
-                4);
-            if (next_block == 0) {
-                break;
+        while (ptr + entry <= m_blocksize - 4
+            && dataToNum((uint8_t*)view, ptr, 4) != 0) {
+            ptr += entry;
+        }
+        if (ptr + entry <= m_blocksize - 4) {
+            break;
+        }
+        uint32_t next = dataToNum((uint8_t*)view, m_blocksize - 4, 4);
+        if (next == 0) {
+            break;
+        }
+        dropView(index, view, data);
+        index = next;
+        view = viewBlock(index, data);
+        if (view == nullptr) {
+            returnError(false);
+        }
+        ptr = entryStart(view);
+    }
+    if (view != data) {
+        dropView(index, view, data);
+        if (!getBlock(index, data)) {
+            returnError(false);
+        }
+    }
+
+    // Continuation blocks are taken first, so running out of space
+    // leaves the list as it was
+    uint32_t fits = 0;
+    if (ptr + entry <= m_blocksize - 4) {
+        fits = (m_blocksize - 4 - ptr) / entry;
+    }
+    uint32_t spare_count = 0;
+    uint32_t *spare = nullptr;
+    if (count > fits) {
+        uint32_t per_block = (m_blocksize - 8) / entry;
+        spare_count = (count - fits + per_block - 1) / per_block;
+        spare = new uint32_t[spare_count];
+        if (takeFreeBlocks(spare_count, spare, allocGroup()) != spare_count) {
+            delete[] spare;
+            returnError(false);
+        }
+    }
+
+    uint32_t done = 0;
+    uint32_t used = 0;
+    while (true) {
+        while (ptr + entry <= m_blocksize - 4 && done < count) {
+            for (uint32_t w = 0; w < width; ++w) {
+                numToData(metas[done * width + w], data, ptr, 4);
+                ptr += 4;
+            }
+            ++done;
+        }
+        if (done == count) {
+            break;
+        }
+
+        uint32_t next = spare[used];
+        ++used;
+        numToData(next, data, m_blocksize - 4, 4);
+        if (!putBlock(index, data)) {
+            for (uint32_t i = used - 1; i < spare_count; ++i) {
+                pushFreeBlock(spare[i]);
             }
-            if (!m_fs->getBlock(next_block, m_data)) {
+            delete[] spare;
+            returnError(false);
+        }
+
+        clearBuffer(data, m_blocksize);
+        numToData(metadata_id, data, 0, 2);
+        numToData(next_type, data, 2, 1);
+        numToData(ATTRIB_NONE, data, 3, 1);
+        index = next;
+        ptr = entryStart(data);
+    }
+    if (spare != nullptr) {
+        delete[] spare;
+    }
+
+    return putBlock(index, data);
+}
+
+bool ClothesFS::removeFromMeta(
+    uint32_t index,
+    uint32_t meta,
+    uint32_t width)
+{
+    uint32_t entry = 4 * width;
+    uint8_t data[MAX_BLOCK_SIZE];
+    uint32_t block = index;
+    uint32_t pos = 0;
+    uint32_t last_block = 0;
+    uint32_t last_pos = 0;
+
+    // Find the entry and last entry of chain, blocks are only looked at
+    while (block != 0) {
+        const uint8_t *view = viewBlock(block, data);
+        if (view == nullptr) {
+            returnError(false);
+        }
+        for (uint32_t ptr = entryStart(view);
+            ptr + entry <= m_blocksize - 4;
+            ptr += entry) {
+            uint32_t val = dataToNum((uint8_t*)view, ptr, 4);
+            if (val == 0) {
                 break;
             }
-            the_block = next_block;
-            m_data_index = 0;
-            pos = 4  * m_data_index + 4;
+            if (val == meta && pos == 0) {
+                index = block;
+                pos = ptr;
+            }
+            last_block = block;
+            last_pos = ptr;
         }
+        uint32_t next = dataToNum((uint8_t*)view, m_blocksize - 4, 4);
+        dropView(block, view, data);
+        block = next;
+    }
+    if (pos == 0) {
+        returnError(false);
+    }
 
-        m_data_block = m_fs->dataToNum(m_data, pos, 4);
-        if (m_data_block == 0) {
-            break;
+    // Entries end at first zero, so last one fills the hole
+    if (!getBlock(last_block, data)) {
+        returnError(false);
+    }
+    uint32_t last[MAX_BLOCK_SIZE / 4];
+    for (uint32_t w = 0; w < width; ++w) {
+        last[w] = dataToNum(data, last_pos + 4 * w, 4);
+        numToData(0, data, last_pos + 4 * w, 4);
+    }
+    if (last_block == index) {
+        if (last_pos != pos) {
+            for (uint32_t w = 0; w < width; ++w) {
+                numToData(last[w], data, pos + 4 * w, 4);
+            }
         }
-        m_fs->addFreeBlock(m_data_block);
-        pos += 4;
+        return putBlock(last_block, data);
+    }
+    if (!putBlock(last_block, data)) {
+        returnError(false);
     }
 
-    m_fs->addFreeBlock(the_block);
+    if (!getBlock(index, data)) {
+        returnError(false);
+    }
+    for (uint32_t w = 0; w < width; ++w) {
+        numToData(last[w], data, pos + 4 * w, 4);
+    }
+    return putBlock(index, data);
+}
 
-    return true;
+bool ClothesFS::addData(
+    uint32_t meta,
+    const char *contents,
+    uint64_t size,
+    uint8_t mapping)
+{
+    uint8_t head[MAX_BLOCK_SIZE];
+    if (!getBlock(meta, head)) {
+        returnError(false);
+    }
+    uint32_t start = entryStart(head);
+    if (start <= m_blocksize - 4 && size <= m_blocksize - 4 - start) {
+        // Small contents fit after the name, no payload blocks needed
+        numToData(META_FILE | META_INLINE, head, 2, 1);
+        copyBuffer(head + start, (const uint8_t*)contents, size);
+        return putBlock(meta, head);
+    }
+
+    uint32_t payload = m_blocksize - dataStart(m_algo);
+    uint64_t count = (size + payload - 1) / payload;
+    if (count == 0) {
+        count = 1;
+    }
+    if (count > m_blocks) {
+        returnError(false);
+    }
+
+    // Reserve whole file at once, so it lands in few runs
+    uint32_t *blocks = new uint32_t[count];
+    if (takeFreeBlocks(count, blocks, allocGroup()) != count) {
+        delete[] blocks;
+        returnError(false);
+    }
+
+    uint8_t *batch = allocBlocks(IO_BATCH_BLOCKS);
+    bool res = batch != nullptr;
+
+    const uint8_t *input = (const uint8_t*)contents;
+    uint64_t data_size = size;
+    for (uint32_t i = 0; res && i < count; i += IO_BATCH_BLOCKS) {
+        uint32_t cnt = count - i;
+        if (cnt > IO_BATCH_BLOCKS) {
+            cnt = IO_BATCH_BLOCKS;
+        }
+        for (uint32_t b = 0; b < cnt; ++b) {
+            uint8_t *data = batch + b * m_blocksize;
+            uint32_t pos = initData(data, PAYLOAD_USED, m_algo);
+            uint32_t len = m_blocksize - pos;
+            if (data_size < len) {
+                len = data_size;
+            }
+            copyBuffer(data + pos, input, len);
+            sealData(data);
+            input += len;
+            data_size -= len;
+        }
+        res = putBlockList(blocks + i, cnt, batch, false);
+    }
+    if (batch != nullptr) {
+        FilesystemPhys::freeBuffer(batch);
+    }
+
+    if (res && mapping == MAP_EXTENTS) {
+        // Runs of blocks as (start, length) pairs
+        uint32_t *runs = new uint32_t[2 * count];
+        uint32_t extents = 0;
+        uint32_t i = 0;
+        while (i < count) {
+            uint32_t len = 1;
+            while (i + len < count && blocks[i + len] == blocks[i] + len) {
+                ++len;
+            }
+            runs[2 * extents] = blocks[i];
+            runs[2 * extents + 1] = len;
+            ++extents;
+            i += len;
+        }
+        res = addToMetaList(meta, runs, extents, META_FILE, 2);
+        delete[] runs;
+    } else if (res) {
+        res = addToMetaList(meta, blocks, count, META_FILE);
+    }
+    if (!res) {
+        for (uint32_t i = 0; i < count; ++i) {
+            pushFreeBlock(blocks[i]);
+        }
+    }
+    delete[] blocks;
+    if (!res) {
+        returnError(false);
+    }
+
+    return true;
+}
+
+bool ClothesFS::updateMeta(
+    uint32_t index,
+    const uint8_t *name,
+    uint64_t size)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    if (!getBlock(index, data)) {
+        returnError(false);
+    }
+
+    uint32_t type = baseType(dataToNum(data, 2, 1));
+    if (type != META_FILE
+        && type != META_DIR) {
+        returnError(false);
+    }
+
+    numToData(size, data, 4, 8);
+    uint32_t len = 0;
+    uint32_t pos = 16;
+    while (name != nullptr
+        && *name != 0) {
+        data[pos] = *name;
+        ++pos;
+        ++name;
+        ++len;
+    }
+    numToData(len, data, 12, 4);
+
+    while (pos % 4 != 0) {
+        ++pos;
+    }
+
+    return putBlock(index, data);
+}
+
+bool ClothesFS::addFile(
+    uint32_t parent,
+    const char *name,
+    const char *contents,
+    uint64_t size,
+    uint8_t mapping)
+{
+    if (parent == 0
+        || (mapping != MAP_BLOCKS && mapping != MAP_EXTENTS)) {
+        returnError(false);
+    }
+    uint32_t block = takeFreeBlock();
+    if (block == 0) {
+        returnError(false);
+    }
+    if (!initMeta(block, META_FILE | mapping)) {
+        pushFreeBlock(block);
+        returnError(false);
+    }
+    bool res = updateMeta(block, (const uint8_t*)name, size)
+        && addData(block, contents, size, mapping);
+    if (res) {
+        // Entry goes in last, file is complete once it can be found
+        ExclusiveGuard guard(nodeLock(parent));
+        res = addEntry(parent, block, name);
+    }
+    if (!res) {
+        uint8_t data[MAX_BLOCK_SIZE];
+        discardChain(block, mapping == MAP_EXTENTS ? 2 : 1, data);
+    }
+    return endUpdate(res);
+}
+
+bool ClothesFS::addDir(
+    uint32_t parent,
+    const char *name,
+    uint8_t layout)
+{
+    if (parent == 0
+        || (layout != DIR_LINEAR && layout != DIR_HASHED)) {
+        returnError(false);
+    }
+    uint32_t block = takeFreeBlock();
+    if (block == 0) {
+        returnError(false);
+    }
+    if (!initMeta(block, META_DIR | layout)) {
+        pushFreeBlock(block);
+        returnError(false);
+    }
+    bool res = updateMeta(block, (const uint8_t*)name, 0)
+        && (layout != DIR_HASHED || initIndex(block));
+    if (res) {
+        ExclusiveGuard guard(nodeLock(parent));
+        res = addEntry(parent, block, name);
+    }
+    if (!res) {
+        uint8_t data[MAX_BLOCK_SIZE];
+        discardChain(block, 1, data);
+    }
+    return endUpdate(res);
+}
+
+bool ClothesFS::addEntry(
+    uint32_t parent,
+    uint32_t meta,
+    const char *name)
+{
+    if (!addToMeta(parent, meta, META_DIR)) {
+        returnError(false);
+    }
+    // Name may be cached as missing
+    m_dentry->remove(parent, name, strlen(name));
+
+    uint32_t index = dirIndex(parent);
+    if (index != 0 && !indexAdd(index, meta, name)) {
+        // Entry not found through index is taken out, caller frees it
+        removeFromMeta(parent, meta);
+        returnError(false);
+    }
+    return true;
+}
+
+/* Frees a file or directory nothing links to, with blocks its entries
+ * point to. Only new, empty directories are freed this way. Block tail
+ * may not be written yet, its entries up to tail_end are taken from
+ * tail_data instead. buffer holds one block. */
+void ClothesFS::discardChain(
+    uint32_t block,
+    uint32_t width,
+    uint8_t *buffer,
+    uint32_t tail,
+    const uint8_t *tail_data,
+    uint32_t tail_end)
+{
+    while (block != 0) {
+        const uint8_t *data = tail_data;
+        uint32_t end = tail_end;
+        uint32_t next = 0;
+        if (block != tail) {
+            data = buffer;
+            if (!getBlock(block, buffer)) {
+                break;
+            }
+            end = m_blocksize - 4;
+            next = dataToNum(buffer, m_blocksize - 4, 4);
+        }
+
+        uint32_t raw = dataToNum((uint8_t*)data, 2, 1);
+        uint32_t pos = entryStart(data);
+        if (raw == (META_DIR | META_INDEXED)
+            && dataToNum((uint8_t*)data, pos - 4, 4) != 0) {
+            freeIndex(dataToNum((uint8_t*)data, pos - 4, 4));
+        }
+        if (raw & META_INLINE) {
+            pos = end;
+        }
+        for (; pos + 4 * width <= end; pos += 4 * width) {
+            uint32_t start = dataToNum((uint8_t*)data, pos, 4);
+            if (start == 0) {
+                break;
+            }
+            uint32_t len = width == 2 ? dataToNum((uint8_t*)data, pos + 4, 4) : 1;
+            for (uint32_t i = 0; i < len; ++i) {
+                pushFreeBlock(start + i);
+            }
+        }
+        pushFreeBlock(block);
+        block = next;
+    }
+}
+
+uint32_t ClothesFS::nameHash(const uint8_t *name, uint32_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; ++i) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool ClothesFS::sameName(const uint8_t *data, const char *name) const
+{
+    uint32_t namelen = dataToNum((uint8_t*)data, 12, 4);
+    if (16 + namelen > m_blocksize) {
+        return false;
+    }
+    for (uint32_t i = 0; i < namelen; ++i) {
+        if (name[i] == 0 || (uint8_t)name[i] != data[16 + i]) {
+            return false;
+        }
+    }
+    return name[namelen] == 0;
+}
+
+uint32_t ClothesFS::dirIndex(uint32_t dir)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    const uint8_t *view = viewBlock(dir, data);
+    if (view == nullptr) {
+        return 0;
+    }
+    uint32_t index = 0;
+    if (dataToNum((uint8_t*)view, 2, 1) == (META_DIR | META_INDEXED)) {
+        index = dataToNum((uint8_t*)view, entryStart(view) - 4, 4);
+    }
+    dropView(dir, view, data);
+    return index;
+}
+
+bool ClothesFS::initIndex(uint32_t dir)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    if (!getBlock(dir, data)) {
+        returnError(false);
+    }
+    uint32_t pos = entryStart(data) - 4;
+    if (pos >= m_blocksize - 4) {
+        returnError(false);
+    }
+
+    // Empty bucket table
+    uint32_t index = takeFreeBlock();
+    if (index == 0) {
+        returnError(false);
+    }
+    if (!initMeta(index, META_DIR_CONT)) {
+        pushFreeBlock(index);
+        returnError(false);
+    }
+
+    numToData(index, data, pos, 4);
+    if (!putBlock(dir, data)) {
+        pushFreeBlock(index);
+        returnError(false);
+    }
+    return true;
+}
+
+bool ClothesFS::indexAdd(
+    uint32_t index,
+    uint32_t meta,
+    const char *name)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    if (!getBlock(index, data)) {
+        returnError(false);
+    }
+
+    uint32_t hash = nameHash((const uint8_t*)name, strlen(name));
+    uint32_t buckets = (m_blocksize - 8) / 4;
+    uint32_t pos = 4 + 4 * (hash % buckets);
+    uint32_t bucket = dataToNum(data, pos, 4);
+    if (bucket == 0) {
+        bucket = takeFreeBlock();
+        if (bucket == 0) {
+            returnError(false);
+        }
+        if (!initMeta(bucket, META_DIR_CONT)) {
+            pushFreeBlock(bucket);
+            returnError(false);
+        }
+        numToData(bucket, data, pos, 4);
+        if (!putBlock(index, data)) {
+            returnError(false);
+        }
+    }
+
+    uint32_t item[2] = { meta, hash };
+    return addToMetaList(bucket, item, 1, META_DIR_CONT, 2);
+}
+
+bool ClothesFS::indexRemove(
+    uint32_t index,
+    uint32_t meta,
+    const uint8_t *entry)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    const uint8_t *view = viewBlock(index, data);
+    if (view == nullptr) {
+        returnError(false);
+    }
+
+    uint32_t hash = nameHash(entry + 16, dataToNum((uint8_t*)entry, 12, 4));
+    uint32_t buckets = (m_blocksize - 8) / 4;
+    uint32_t bucket = dataToNum((uint8_t*)view, 4 + 4 * (hash % buckets), 4);
+    dropView(index, view, data);
+    if (bucket == 0) {
+        returnError(false);
+    }
+    return removeFromMeta(bucket, meta, 2);
+}
+
+uint32_t ClothesFS::indexFind(
+    uint32_t index,
+    const char *name)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    const uint8_t *view = viewBlock(index, data);
+    if (view == nullptr) {
+        return 0;
+    }
+
+    uint32_t hash = nameHash((const uint8_t*)name, strlen(name));
+    uint32_t buckets = (m_blocksize - 8) / 4;
+    uint32_t block = dataToNum((uint8_t*)view, 4 + 4 * (hash % buckets), 4);
+    dropView(index, view, data);
+    uint32_t found = 0;
+    while (block != 0 && found == 0) {
+        view = viewBlock(block, data);
+        if (view == nullptr) {
+            return 0;
+        }
+        uint32_t next = dataToNum((uint8_t*)view, m_blocksize - 4, 4);
+        for (uint32_t ptr = 4; ptr + 8 <= m_blocksize - 4; ptr += 8) {
+            uint32_t meta = dataToNum((uint8_t*)view, ptr, 4);
+            if (meta == 0) {
+                next = 0;
+                break;
+            }
+            if (dataToNum((uint8_t*)view, ptr + 4, 4) != hash) {
+                continue;
+            }
+            // Hashes may collide, name is only in entry block. Entry
+            // is not under our lock, so it is copied.
+            uint8_t entry[MAX_BLOCK_SIZE];
+            if (getBlock(meta, entry) && sameName(entry, name)) {
+                found = meta;
+                break;
+            }
+        }
+        dropView(block, view, data);
+        block = next;
+    }
+    return found;
+}
+
+void ClothesFS::freeIndex(uint32_t index)
+{
+    uint8_t data[MAX_BLOCK_SIZE];
+    uint8_t bucket[MAX_BLOCK_SIZE];
+    const uint8_t *view = viewBlock(index, data);
+    if (view == nullptr) {
+        return;
+    }
+    for (uint32_t pos = 4; pos < m_blocksize - 4; pos += 4) {
+        uint32_t block = dataToNum((uint8_t*)view, pos, 4);
+        while (block != 0) {
+            // Freeing rewrites the block, link is read before
+            const uint8_t *link = viewBlock(block, bucket);
+            if (link == nullptr) {
+                break;
+            }
+            uint32_t next = dataToNum((uint8_t*)link, m_blocksize - 4, 4);
+            dropView(block, link, bucket);
+            addFreeBlock(block);
+            block = next;
+        }
+    }
+    dropView(index, view, data);
+    addFreeBlock(index);
+}
+
+uint32_t ClothesFS::find(
+    uint32_t parent,
+    const char *name)
+{
+    if (parent == 0 || name == nullptr) {
+        return 0;
+    }
+
+    SharedGuard guard(nodeLock(parent));
+    return findEntry(parent, name);
+}
+
+uint32_t ClothesFS::findEntry(
+    uint32_t parent,
+    const char *name)
+{
+    uint32_t index = dirIndex(parent);
+    if (index != 0) {
+        return indexFind(index, name);
+    }
+
+    Iterator iter = list(parent);
+    while (iter.ok()) {
+        if (sameName(iter.m_data, name)) {
+            return iter.block();
+        }
+        if (!iter.next()) {
+            break;
+        }
+    }
+    return 0;
+}
+
+uint32_t ClothesFS::lookupEntry(
+    uint32_t parent,
+    const char *name,
+    uint32_t len,
+    uint8_t *type)
+{
+    // Missing name is cached under the lock, so addEntry can't be
+    // in between
+    SharedGuard guard(nodeLock(parent));
+    uint32_t block = 0;
+    if (m_dentry->find(parent, name, len, &block, type)) {
+        return block;
+    }
+
+    char buf[MAX_BLOCK_SIZE];
+    if (len >= MAX_BLOCK_SIZE) {
+        return 0;
+    }
+    copyBuffer((uint8_t*)buf, (const uint8_t*)name, len);
+    buf[len] = 0;
+
+    *type = 0;
+    block = findEntry(parent, buf);
+    if (block != 0) {
+        uint8_t data[MAX_BLOCK_SIZE];
+        if (!getBlock(block, data)) {
+            return 0;
+        }
+        *type = baseType(dataToNum(data, 2, 1));
+    }
+    // Misses are cached too
+    m_dentry->insert(parent, name, len, block, *type);
+    return block;
+}
+
+uint32_t ClothesFS::lookup(const char *path)
+{
+    if (path == nullptr || *path != '/' || m_root == 0) {
+        return 0;
+    }
+
+    uint32_t block = m_root;
+    uint8_t type = META_DIR;
+    while (*path != 0) {
+        while (*path == '/') {
+            ++path;
+        }
+        uint32_t len = 0;
+        while (path[len] != 0 && path[len] != '/') {
+            ++len;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (type != META_DIR) {
+            return 0;
+        }
+        block = lookupEntry(block, path, len, &type);
+        if (block == 0) {
+            return 0;
+        }
+        path += len;
+    }
+    return block;
+}
+
+bool ClothesFS::stat(const char *path, Stat *st)
+{
+    uint32_t block = lookup(path);
+    uint8_t data[MAX_BLOCK_SIZE];
+    while (true) {
+        if (block == 0) {
+            return false;
+        }
+        {
+            SharedGuard guard(nodeLock(block));
+            const uint8_t *view = viewBlock(block, data);
+            if (view == nullptr) {
+                returnError(false);
+            }
+            st->block = block;
+            st->type = baseType(dataToNum((uint8_t*)view, 2, 1));
+            st->attrib = dataToNum((uint8_t*)view, 3, 1);
+            st->size = 0;
+            if (st->type == META_FILE) {
+                st->size = dataToNum((uint8_t*)view, 4, 4)
+                    | ((uint64_t)dataToNum((uint8_t*)view, 8, 4) << 32);
+            }
+            dropView(block, view, data);
+        }
+        // Entry removed after lookup, block may be reused already
+        uint32_t again = lookup(path);
+        if (again == block) {
+            break;
+        }
+        block = again;
+    }
+    return true;
+}
+
+ClothesFS::Iterator ClothesFS::list(
+    uint32_t parent)
+{
+    Iterator iter(parent, 0);
+    if (parent == 0) {
+        returnError(iter);
+    }
+
+    // FIXME free old
+    iter.m_parent = allocBlocks(1);
+    iter.m_data = allocBlocks(1);
+    iter.m_content = allocBlocks(1);
+    iter.m_meta = allocBlocks(1);
+    if (iter.m_parent == nullptr
+        || iter.m_data == nullptr
+        || iter.m_content == nullptr
+        || iter.m_meta == nullptr) {
+        returnError(iter);
+    }
+    iter.m_parent_block = parent;
+    iter.m_dir = parent;
+    iter.attach(this);
+    iter.m_hazard->dir.set(parent);
+    iter.m_unlinks = m_unlinks.get();
+
+    if (!getBlock(parent, iter.m_parent)) {
+        returnError(iter);
+    }
+    if (!iter.getCurrent()) {
+        // Empty directory is not an error
+        if (iter.m_end) {
+            return iter;
+        }
+        returnError(iter);
+    }
+
+    iter.m_ok = true;
+    return iter;
+}
+
+ClothesFS::Iterator ClothesFS::open(
+    uint32_t parent,
+    uint32_t block,
+    uint32_t since)
+{
+    Iterator iter(block, 0);
+    if (parent == 0 || block == 0) {
+        returnError(iter);
+    }
+
+    iter.m_parent = allocBlocks(1);
+    iter.m_data = allocBlocks(1);
+    iter.m_content = allocBlocks(1);
+    iter.m_meta = allocBlocks(1);
+    if (iter.m_parent == nullptr
+        || iter.m_data == nullptr
+        || iter.m_content == nullptr
+        || iter.m_meta == nullptr) {
+        returnError(iter);
+    }
+    clearBuffer(iter.m_parent, m_blocksize);
+    iter.m_dir = parent;
+    iter.attach(this);
+    iter.m_hazard->dir.set(parent);
+    iter.m_hazard->file.set(block);
+
+    // Published now, so it stays if parent still has it
+    if (!getBlock(block, iter.m_data)) {
+        returnError(iter);
+    }
+    iter.m_unlinks = m_unlinks.get();
+    uint32_t namelen = iter.nameLen();
+    uint8_t type = 0;
+    if (iter.m_unlinks != since
+        && (namelen > m_blocksize - 16
+            || lookupEntry(parent, (const char*)iter.m_data + 16, namelen, &type)
+                != block)) {
+        iter.m_hazard->dir.set(0);
+        iter.m_hazard->file.set(0);
+        returnError(iter);
+    }
+
+    iter.m_ok = true;
+    return iter;
+}
+
+bool ClothesFS::Iterator::getCurrent()
+{
+    // Opened on one entry, there is no listing to go on with
+    m_end = false;
+    if (m_parent_block == 0) {
+        m_hazard->dir.set(0);
+        m_hazard->file.set(0);
+        m_end = true;
+        return false;
+    }
+    uint32_t type = dataToNum(m_parent, 2, 1);
+    if (type == 0) {
+        returnError(false);
+    }
+
+    while (true) {
+        uint32_t pos = 4  * m_index + m_fs->entryStart(m_parent);
+        if (pos >= m_fs->blockSize() - 4) {
+            uint32_t next_block = m_fs->dataToNum(
+                m_parent,
+                m_fs->blockSize() - 4,
+                4);
+            if (next_block == 0) {
+                // Listing is over
+                m_hazard->dir.set(0);
+                m_hazard->file.set(0);
+                m_end = true;
+                return false;
+            }
+            if (!m_fs->getBlock(next_block, m_parent)) {
+                return false;
+            }
+            m_parent_block = next_block;
+            m_index = 0;
+            pos = 4  * m_index + m_fs->entryStart(m_parent);
+        }
+
+        m_block = m_fs->dataToNum(m_parent, pos, 4);
+        if (m_block == 0) {
+            m_hazard->dir.set(0);
+            m_hazard->file.set(0);
+            m_end = true;
+            return false;
+        }
+        m_hazard->file.set(m_block);
+
+        // Entry is safe to read once published, unless a remove
+        // since directory block was read already freed it
+        uint32_t unlinks = m_fs->m_unlinks.get();
+        if (unlinks == m_unlinks) {
+            break;
+        }
+        m_unlinks = unlinks;
+        m_window_count = 0;
+        if (!m_fs->getBlock(m_parent_block, m_parent)) {
+            return false;
+        }
+    }
+    return fetchEntry();
+}
+
+bool ClothesFS::Iterator::fetchEntry()
+{
+    uint32_t block_size = m_fs->blockSize();
+
+    if (m_window_count == 0
+        || m_window_parent != m_parent_block
+        || m_index < m_window_index
+        || m_index >= m_window_index + m_window_count) {
+        // Fetch following entries too, they are likely visited next
+        uint32_t blocks[IO_BATCH_BLOCKS];
+        uint32_t count = 0;
+        uint32_t start = m_fs->entryStart(m_parent);
+        for (uint32_t index = m_index; count < IO_BATCH_BLOCKS; ++index) {
+            uint32_t pos = 4 * index + start;
+            if (pos >= block_size - 4) {
+                break;
+            }
+            uint32_t block = m_fs->dataToNum(m_parent, pos, 4);
+            if (block == 0) {
+                break;
+            }
+            blocks[count] = block;
+            ++count;
+        }
+
+        if (m_window == nullptr) {
+            m_window = m_fs->allocBlocks(IO_BATCH_BLOCKS);
+        }
+        m_window_count = 0;
+        if (count == 0
+            || m_window == nullptr
+            || !m_fs->getBlockList(blocks, count, m_window)) {
+            return false;
+        }
+        m_window_parent = m_parent_block;
+        m_window_index = m_index;
+        m_window_count = count;
+    }
+
+    m_fs->copyBuffer(
+        m_data,
+        m_window + (m_index - m_window_index) * block_size,
+        block_size);
+    return true;
+}
+
+uint32_t ClothesFS::Iterator::nextDataBlock()
+{
+    if (m_extent_left > 0) {
+        --m_extent_left;
+        ++m_extent_block;
+        return m_extent_block - 1;
+    }
+
+    // Modifier bits of directories mean something else
+    uint8_t type = m_fs->dataToNum(m_data, 2, 1);
+    if (m_fs->baseType(type) != META_FILE) {
+        type = 0;
+    }
+    if (type & META_INLINE) {
+        return 0;
+    }
+    bool extents = (type & META_EXTENTS) != 0;
+    uint32_t entry = extents ? 8 : 4;
+    while (true) {
+        uint8_t *meta = m_data;
+        if (m_meta_block != 0) {
+            meta = m_meta;
+        }
+
+        uint32_t pos = entry * m_data_index + m_fs->entryStart(meta);
+        if (pos + entry <= m_fs->blockSize() - 4) {
+            uint32_t block = m_fs->dataToNum(meta, pos, 4);
+            if (block == 0) {
+                return 0;
+            }
+            ++m_data_index;
+            if (extents) {
+                uint32_t len = m_fs->dataToNum(meta, pos + 4, 4);
+                if (len == 0) {
+                    return 0;
+                }
+                m_extent_block = block + 1;
+                m_extent_left = len - 1;
+            }
+            return block;
+        }
+
+        uint32_t next_block = m_fs->dataToNum(
+            meta,
+            m_fs->blockSize() - 4,
+            4);
+        if (next_block == 0) {
+            return 0;
+        }
+        if (!m_fs->getBlock(next_block, m_meta)) {
+            return 0;
+        }
+        m_meta_block = next_block;
+        m_data_index = 0;
+    }
+}
+
+uint32_t ClothesFS::Iterator::firstBlock()
+{
+    if (m_data == nullptr || type() != META_FILE) {
+        return m_block;
+    }
+    if ((m_fs->dataToNum(m_data, 2, 1) & META_INLINE) || !mapBlocks(1)) {
+        return m_block;
+    }
+    return m_map[0];
+}
+
+bool ClothesFS::Iterator::checkPayload(const uint8_t *data) const
+{
+    if (m_fs->dataToNum((uint8_t*)data, 0, 2) != payload_id) {
+        return false;
+    }
+    if (m_fs->dataToNum((uint8_t*)data, 2, 1) != PAYLOAD_USED) {
+        return false;
+    }
+    // Offsets are mapped with one payload size for whole file
+    uint32_t payload = m_fs->blockSize() - m_fs->dataStart(data[3]);
+    if (m_payload != 0 && payload != m_payload) {
+        return false;
+    }
+    if (!m_fs->verifyData(data)) {
+        returnError(false);
+    }
+    return true;
+}
+
+uint32_t ClothesFS::Iterator::payloadSize()
+{
+    if (m_payload != 0) {
+        return m_payload;
+    }
+
+    // First block tells the algorithm, and it is likely read next
+    if (!mapBlocks(1)) {
+        returnError(0);
+    }
+    releaseView();
+    m_data_block = 0;
+    if (!m_fs->getBlock(m_map[0], m_content)
+        || !checkPayload(m_content)) {
+        returnError(0);
+    }
+    setContent(m_map[0], m_content, false);
+    m_content_index = 0;
+    m_payload = m_fs->blockSize() - m_fs->dataStart(m_content[3]);
+    return m_payload;
+}
+
+void ClothesFS::Iterator::setContent(
+    uint32_t block,
+    const uint8_t *data,
+    bool borrowed)
+{
+    releaseView();
+    if (borrowed) {
+        m_view = data;
+    } else if (data != m_content) {
+        m_fs->copyBuffer(m_content, data, m_fs->blockSize());
+    }
+    m_data_block = block;
+}
+
+bool ClothesFS::Iterator::mapBlocks(uint32_t count)
+{
+    if (count <= m_map_count) {
+        return true;
+    }
+    if (count > m_map_size) {
+        uint32_t size = m_map_size * 2;
+        if (size < count) {
+            size = count;
+        }
+        if (size < IO_BATCH_BLOCKS) {
+            size = IO_BATCH_BLOCKS;
+        }
+        uint32_t *map = new uint32_t[size];
+        for (uint32_t i = 0; i < m_map_count; ++i) {
+            map[i] = m_map[i];
+        }
+        if (m_map != nullptr) {
+            delete[] m_map;
+        }
+        m_map = map;
+        m_map_size = size;
+    }
+
+    while (m_map_count < count) {
+        uint32_t block = nextDataBlock();
+        if (block == 0) {
+            return false;
+        }
+        m_map[m_map_count] = block;
+        ++m_map_count;
+    }
+    return true;
+}
+
+uint64_t ClothesFS::Iterator::read(
+    uint8_t *buf,
+    uint64_t cnt)
+{
+    uint64_t got = pread(m_offset, buf, cnt);
+    m_offset += got;
+    return got;
+}
+
+uint64_t ClothesFS::Iterator::pread(
+    uint64_t offset,
+    uint8_t *buf,
+    uint64_t cnt)
+{
+    if (m_data == nullptr || type() != META_FILE) {
+        returnError(0);
+    }
+
+    uint64_t file_size = size();
+    if (offset >= file_size) {
+        return 0;
+    }
+    if (cnt > file_size - offset) {
+        cnt = file_size - offset;
+    }
+
+    if (m_fs->dataToNum(m_data, 2, 1) & META_INLINE) {
+        uint32_t start = m_fs->entryStart(m_data);
+        if (start + file_size > m_fs->blockSize() - 4) {
+            returnError(0);
+        }
+        m_fs->copyBuffer(buf, m_data + start + offset, cnt);
+        return cnt;
+    }
+
+    uint32_t block_size = m_fs->blockSize();
+    uint32_t payload = payloadSize();
+    if (payload == 0) {
+        returnError(0);
+    }
+    uint32_t head = block_size - payload;
+    uint32_t index = offset / payload;
+    uint32_t skip = offset % payload;
+    uint32_t last = (offset + cnt - 1) / payload;
+    if (!mapBlocks(last + 1)) {
+        // Short chain, read what there is
+        if (index >= m_map_count) {
+            returnError(0);
+        }
+        last = m_map_count - 1;
+        cnt = (uint64_t)m_map_count * payload - offset;
+    }
+    uint64_t got = 0;
+
+    // Block kept from previous read
+    if (m_data_block != 0 && m_content_index == index) {
+        const uint8_t *current = m_content;
+        if (m_view != nullptr) {
+            current = m_view;
+        }
+        uint64_t len = payload - skip;
+        if (len > cnt) {
+            len = cnt;
+        }
+        m_fs->copyBuffer(buf, current + head + skip, len);
+        got += len;
+        skip = 0;
+        ++index;
+    }
+
+    // Following blocks are fetched in runs
+    uint8_t *batch = nullptr;
+    while (got < cnt && index <= last) {
+        uint32_t num = last + 1 - index;
+        if (num > IO_BATCH_BLOCKS) {
+            num = IO_BATCH_BLOCKS;
+        }
+        const uint32_t *blocks = m_map + index;
+
+        if (index >= m_ahead_index
+            && index < m_ahead_index + m_ahead_count) {
+            waitAhead();
+        }
+        const uint8_t *first = nullptr;
+        uint8_t *src = m_content;
+        if (index >= m_ahead_index
+            && index < m_ahead_index + m_ahead_count) {
+            src = m_ahead + (index - m_ahead_index) * block_size;
+            if (num > m_ahead_index + m_ahead_count - index) {
+                num = m_ahead_index + m_ahead_count - index;
+            }
+        } else {
+            // Mapped backends are read in place, others in one request
+            first = m_fs->borrowBlock(blocks[0]);
+        }
+        if (first == nullptr && src == m_content) {
+            if (num > 1) {
+                if (batch == nullptr) {
+                    batch = m_fs->allocBlocks(IO_BATCH_BLOCKS);
+                }
+                src = batch;
+            }
+            if (src == nullptr || !m_fs->getBlockList(blocks, num, src)) {
+                break;
+            }
+        }
+
+        bool valid = true;
+        for (uint32_t i = 0; i < num; ++i) {
+            const uint8_t *data = src + i * block_size;
+            if (first != nullptr) {
+                data = first;
+                if (i > 0) {
+                    data = m_fs->borrowBlock(blocks[i]);
+                }
+                if (data == nullptr) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (!checkPayload(data)) {
+                if (first != nullptr) {
+                    m_fs->releaseBlock(data);
+                }
+                valid = false;
+                break;
+            }
+
+            uint64_t len = payload - skip;
+            if (len > cnt - got) {
+                len = cnt - got;
+            }
+            m_fs->copyBuffer(buf + got, data + head + skip, len);
+            got += len;
+            skip = 0;
+
+            if (i == num - 1) {
+                setContent(blocks[i], data, first != nullptr);
+                m_content_index = index + i;
+            } else if (first != nullptr) {
+                m_fs->releaseBlock(data);
+            }
+        }
+        if (!valid) {
+            break;
+        }
+        index += num;
+    }
+
+    if (batch != nullptr) {
+        FilesystemPhys::freeBuffer(batch);
+    }
+
+    readAhead(offset, got, last + 1);
+    return got;
+}
+
+void ClothesFS::Iterator::readAhead(
+    uint64_t offset,
+    uint64_t got,
+    uint32_t next)
+{
+    // Sequential reads double the window, others drop it
+    if (got == 0 || offset != m_ahead_next) {
+        m_ahead_window = 0;
+        m_ahead_next = offset + got;
+        return;
+    }
+    m_ahead_next = offset + got;
+    if (m_ahead_window == 0) {
+        m_ahead_window = READ_AHEAD_MIN;
+    } else if (m_ahead_window < READ_AHEAD_MAX) {
+        m_ahead_window *= 2;
+        if (m_ahead_window > READ_AHEAD_MAX) {
+            m_ahead_window = READ_AHEAD_MAX;
+        }
+    }
+
+    // Mapped image needs no copies, and buffered blocks are still ahead
+    if (m_view != nullptr
+        || (next >= m_ahead_index
+            && next < m_ahead_index + m_ahead_count)) {
+        return;
+    }
+
+    // Buffer is reused, earlier requests have to land first
+    waitAhead();
+    m_ahead_count = 0;
+    mapBlocks(next + m_ahead_window);
+    if (next >= m_map_count) {
+        return;
+    }
+    uint32_t count = m_map_count - next;
+    if (count > m_ahead_window) {
+        count = m_ahead_window;
+    }
+
+    if (m_ahead == nullptr) {
+        m_ahead = m_fs->allocBlocks(READ_AHEAD_MAX);
+        m_ahead_req = new FilesystemPhysRequest[READ_AHEAD_MAX];
+    }
+    if (m_ahead == nullptr
+        || !m_fs->prefetchBlocks(
+            m_map + next,
+            count,
+            m_ahead,
+            m_ahead_req,
+            &m_ahead_pending)) {
+        return;
+    }
+    m_ahead_index = next;
+    m_ahead_count = count;
+}
+
+bool ClothesFS::Iterator::readView(View &view)
+{
+    view.release();
+    if (m_data == nullptr || type() != META_FILE) {
+        returnError(false);
+    }
+
+    uint64_t file_size = size();
+    if (m_offset >= file_size) {
+        return false;
+    }
+
+    bool inlined = (m_fs->dataToNum(m_data, 2, 1) & META_INLINE) != 0;
+    uint32_t block = m_block;
+    uint32_t index = 0;
+    uint64_t start = m_fs->entryStart(m_data) + m_offset;
+    uint64_t len = file_size - m_offset;
+    if (!inlined) {
+        uint32_t payload = payloadSize();
+        if (payload == 0) {
+            returnError(false);
+        }
+        index = m_offset / payload;
+        if (!mapBlocks(index + 1)) {
+            returnError(false);
+        }
+        block = m_map[index];
+        start = m_fs->blockSize() - payload + m_offset % payload;
+        if (len > m_fs->blockSize() - start) {
+            len = m_fs->blockSize() - start;
+        }
+    } else if (start + len > m_fs->blockSize() - 4) {
+        returnError(false);
+    }
+
+    const uint8_t *base = m_fs->pinBlock(block);
+    if (base == nullptr) {
+        return false;
+    }
+    if (!inlined && !checkPayload(base)) {
+        m_fs->unpinBlock(block, base);
+        returnError(false);
+    }
+
+    view.m_fs = m_fs;
+    view.m_block = block;
+    view.m_base = base;
+    view.m_data = base + start;
+    view.m_size = len;
+
+    // Warms cache for following views, mapped image needs nothing
+    if (!inlined && m_fs->m_cache != nullptr) {
+        readAhead(m_offset, len, index + 1);
+    }
+    m_offset += len;
+    return true;
+}
+
+void ClothesFS::View::assign(const View &another)
+{
+    if (this == &another) {
+        return;
+    }
+    release();
+    if (another.m_fs == nullptr) {
+        return;
+    }
+
+    // Every copy holds a pin of its own
+    const uint8_t *base = another.m_fs->pinBlock(another.m_block);
+    if (base == nullptr) {
+        return;
+    }
+    m_fs = another.m_fs;
+    m_block = another.m_block;
+    m_base = base;
+    m_data = base + (another.m_data - another.m_base);
+    m_size = another.m_size;
+}
+
+void ClothesFS::View::release()
+{
+    if (m_fs != nullptr) {
+        m_fs->unpinBlock(m_block, m_base);
+    }
+    m_fs = nullptr;
+    m_block = 0;
+    m_base = nullptr;
+    m_data = nullptr;
+    m_size = 0;
+}
+
+bool ClothesFS::Iterator::next()
+{
+    ++m_index;
+    releaseView();
+    resetAhead();
+    m_ok = getCurrent();
+    m_offset = 0;
+    m_data_block = 0;
+    m_content_index = 0;
+    m_payload = 0;
+    resetMap();
+    return m_ok;
+}
+
+uint32_t ClothesFS::Iterator::nameLen()
+{
+    if (m_data == nullptr) return 0;
+
+    return dataToNum(m_data, 12, 4);
+}
+
+STD_STRING_TYPE ClothesFS::Iterator::name()
+{
+    if (m_data == nullptr) return "";
+
+    STD_STRING_TYPE res;
+    uint32_t namelen = nameLen();
+    for (uint32_t i = 0; i < namelen; ++i) {
+        res += (char)m_data[16 + i];
+    }
+    return res;
+}
+
+uint64_t ClothesFS::Iterator::size()
+{
+    if (m_data == nullptr) return 0;
+
+    // Size is 8 bytes, dataToNum reads at most 4
+    return dataToNum(m_data, 4, 4)
+        | ((uint64_t)dataToNum(m_data, 8, 4) << 32);
+}
+
+uint8_t ClothesFS::Iterator::type() const
+{
+    if (m_data == nullptr) return 0;
+
+    return m_fs->baseType(dataToNum(m_data, 2, 1));
+}
+
+bool ClothesFS::Iterator::remove()
+{
+    if (m_data == nullptr) return false;
+    releaseView();
+    m_window_count = 0;
+    m_data_block = 0;
+    m_content_index = 0;
+    m_payload = 0;
+    m_offset = 0;
+    resetMap();
+    resetAhead();
+    // Own reads of the file end here
+    m_hazard->file.set(0);
+
+    // Stripes are taken in order, so removers can't deadlock
+    uint32_t first = m_dir;
+    uint32_t second = m_block;
+    if (first % NODE_LOCKS > second % NODE_LOCKS) {
+        first = m_block;
+        second = m_dir;
+    }
+    bool res;
+    {
+        ExclusiveGuard first_guard(m_fs->nodeLock(first));
+        if (first % NODE_LOCKS == second % NODE_LOCKS) {
+            res = unlinkEntry();
+        } else {
+            ExclusiveGuard second_guard(m_fs->nodeLock(second));
+            res = unlinkEntry();
+        }
+    }
+    if (!res) {
+        return false;
+    }
+
+    // Entries first, continuation blocks are still needed to find them
+    while (true) {
+        uint32_t block = nextDataBlock();
+        if (block == 0) {
+            break;
+        }
+        m_fs->freeNodeBlock(block, m_block);
+    }
+    resetMap();
+
+    if (m_fs->dataToNum(m_data, 2, 1) == (META_DIR | META_INDEXED)) {
+        m_fs->freeIndex(
+            m_fs->dataToNum(m_data, m_fs->entryStart(m_data) - 4, 4));
+    }
+
+    uint32_t next_block = m_fs->dataToNum(m_data, m_fs->blockSize() - 4, 4);
+    m_fs->freeNodeBlock(m_block, m_block);
+    while (next_block != 0) {
+        if (!m_fs->getBlock(next_block, m_meta)) {
+            break;
+        }
+        m_fs->freeNodeBlock(next_block, m_block);
+        next_block = m_fs->dataToNum(m_meta, m_fs->blockSize() - 4, 4);
+    }
+
+    // Blocks retired by earlier removes may be free by now
+    m_fs->releaseRetired();
+    return m_fs->endUpdate(true);
+}
+
+bool ClothesFS::Iterator::unlinkEntry()
+{
+    // Listing took no locks, entry may have changed or moved since
+    if (!m_fs->getBlock(m_block, m_data)) {
+        return false;
+    }
+    // Entries are packed, directory with an empty first slot is empty.
+    // Subtree would leak otherwise, its lock keeps adds out meanwhile.
+    if (type() == META_DIR
+        && m_fs->dataToNum(m_data, m_fs->entryStart(m_data), 4) != 0) {
+        return false;
+    }
+    if (!m_fs->removeFromMeta(m_dir, m_block)) {
+        return false;
+    }
+    m_fs->m_unlinks.inc();
+    uint32_t index = m_fs->dirIndex(m_dir);
+    if (index != 0) {
+        m_fs->indexRemove(index, m_block, m_data);
+    }
+    if (type() == META_DIR) {
+        // Entries below it go away with it
+        m_fs->m_dentry->invalidate();
+    } else {
+        m_fs->m_dentry->remove(m_dir, (const char*)m_data + 16, nameLen());
+    }
+    // Last entry moved to this slot, next() has to visit it
+    if (m_parent_block == 0) {
+        return true;
+    }
+    if (!m_fs->getBlock(m_parent_block, m_parent)) {
+        return false;
+    }
+    --m_index;
+    return true;
+}
+
+ClothesFS::Writer::Writer(
+    ClothesFS *fs,
+    uint32_t parent,
+    const char *name,
+    uint8_t mapping)
+    : m_ok(false),
+    m_open(false),
+    m_mapping(mapping),
+    m_algo(fs->m_algo),
+    m_parent(0),
+    m_meta(0),
+    m_tail(0),
+    m_tail_pos(0),
+    m_fill(0),
+    m_pending(0),
+    m_written(0),
+    m_extent_start(0),
+    m_extent_len(0),
+    m_group(fs->allocGroup()),
+    m_plan_start(0),
+    m_plan_len(0),
+    m_size(0),
+    m_fs(fs),
+    m_name(nullptr),
+    m_tailbuf(nullptr),
+    m_batch(nullptr)
+{
+    m_ok = open(parent, name);
+    m_open = m_ok;
+}
+
+bool ClothesFS::Writer::open(
+    uint32_t parent,
+    const char *name)
+{
+    if (parent == 0
+        || (m_mapping != MAP_BLOCKS && m_mapping != MAP_EXTENTS)) {
+        returnError(false);
+    }
+    uint32_t block = m_fs->takeFreeBlock();
+    if (block == 0) {
+        returnError(false);
+    }
+
+    // Head block stays off the directory until close()
+    uint32_t block_size = m_fs->blockSize();
+    m_tailbuf = m_fs->allocBlocks(1);
+    m_batch = m_fs->allocBlocks(IO_BATCH_BLOCKS);
+    if (m_tailbuf == nullptr
+        || m_batch == nullptr
+        || !m_fs->initMeta(block, META_FILE | m_mapping)
+        || !m_fs->updateMeta(block, (const uint8_t*)name, 0)
+        || !m_fs->getBlock(block, m_tailbuf)) {
+        m_fs->pushFreeBlock(block);
+        returnError(false);
+    }
+    m_tail_pos = m_fs->entryStart(m_tailbuf);
+    if (m_tail_pos > block_size - 4) {
+        m_fs->pushFreeBlock(block);
+        returnError(false);
+    }
+
+    uint32_t len = strlen(name);
+    m_name = new char[len + 1];
+    m_fs->copyBuffer((uint8_t*)m_name, (const uint8_t*)name, len + 1);
+    m_parent = parent;
+    m_meta = block;
+    m_tail = block;
+    return true;
+}
+
+ClothesFS::Writer::~Writer()
+{
+    close();
+    if (m_tailbuf != nullptr) {
+        FilesystemPhys::freeBuffer(m_tailbuf);
+    }
+    if (m_batch != nullptr) {
+        FilesystemPhys::freeBuffer(m_batch);
+    }
+    if (m_name != nullptr) {
+        delete[] m_name;
+    }
+}
+
+bool ClothesFS::Writer::reserve(uint64_t size)
+{
+    if (!m_open || !m_ok || m_plan_len > 0) {
+        returnError(false);
+    }
+
+    // Contents that stay inline need no payload
+    uint32_t block_size = m_fs->blockSize();
+    if (m_written == 0 && m_pending == 0 && m_tail == m_meta
+        && size <= block_size - 4 - m_tail_pos) {
+        return true;
+    }
+    uint64_t payload = block_size - m_fs->dataStart(m_algo);
+    uint64_t want = (size + payload - 1) / payload;
+    if (want <= m_written + m_pending) {
+        return true;
+    }
+    want -= m_written + m_pending;
+    if (want > 0xFFFFFFFF) {
+        want = 0xFFFFFFFF;
+    }
+
+    // Shorter run than asked is fine, rest is allocated as it comes
+    m_plan_len = m_fs->takeFreeRun(want, &m_plan_start, m_group);
+    return m_plan_len > 0;
+}
+
+bool ClothesFS::Writer::write(const uint8_t *buf, uint64_t cnt)
+{
+    if (!m_open || !m_ok) {
+        returnError(false);
+    }
+
+    uint32_t block_size = m_fs->blockSize();
+    while (cnt > 0) {
+        uint8_t *data = m_batch + m_pending * block_size;
+        if (m_fill == 0) {
+            m_fill = m_fs->initData(data, PAYLOAD_USED, m_algo);
+        }
+        uint64_t len = block_size - m_fill;
+        if (len > cnt) {
+            len = cnt;
+        }
+        m_fs->copyBuffer(data + m_fill, buf, len);
+        m_fill += len;
+        m_size += len;
+        buf += len;
+        cnt -= len;
+
+        if (m_fill == block_size) {
+            m_fill = 0;
+            ++m_pending;
+            if (m_pending == IO_BATCH_BLOCKS && !flushBatch()) {
+                m_ok = false;
+                returnError(false);
+            }
+        }
+    }
+    return true;
+}
+
+bool ClothesFS::Writer::flushBatch()
+{
+    if (m_pending == 0) {
+        return true;
+    }
+
+    ExclusiveGuard guard(m_fs->nodeLock(m_meta));
+    // Whole batch is allocated at once, so it lands in few runs
+    uint32_t blocks[IO_BATCH_BLOCKS];
+    uint32_t planned = m_pending < m_plan_len ? m_pending : m_plan_len;
+    for (uint32_t i = 0; i < planned; ++i) {
+        blocks[i] = m_plan_start + i;
+    }
+    if (planned < m_pending
+        && m_fs->takeFreeBlocks(m_pending - planned, blocks + planned, m_group)
+            != m_pending - planned) {
+        returnError(false);
+    }
+    m_plan_start += planned;
+    m_plan_len -= planned;
+    for (uint32_t i = 0; i < m_pending; ++i) {
+        m_fs->sealData(m_batch + i * m_fs->blockSize());
+    }
+    if (!m_fs->putBlockList(blocks, m_pending, m_batch, false)) {
+        for (uint32_t i = 0; i < m_pending; ++i) {
+            m_fs->pushFreeBlock(blocks[i]);
+        }
+        returnError(false);
+    }
+    for (uint32_t i = 0; i < m_pending; ++i) {
+        if (!appendBlock(blocks[i])) {
+            // Blocks not in the file yet are not found by discard()
+            for (; i < m_pending; ++i) {
+                m_fs->pushFreeBlock(blocks[i]);
+            }
+            returnError(false);
+        }
+    }
+    m_written += m_pending;
+    m_pending = 0;
+    return true;
+}
+
+bool ClothesFS::Writer::appendBlock(uint32_t block)
+{
+    if (m_mapping != MAP_EXTENTS) {
+        return appendEntry(&block, 1);
+    }
+
+    // Extent is written once it can't grow any more
+    if (m_extent_len > 0
+        && block == m_extent_start + m_extent_len) {
+        ++m_extent_len;
+        return true;
+    }
+    if (m_extent_len > 0) {
+        uint32_t extent[2] = { m_extent_start, m_extent_len };
+        if (!appendEntry(extent, 2)) {
+            returnError(false);
+        }
+    }
+    m_extent_start = block;
+    m_extent_len = 1;
+    return true;
+}
+
+bool ClothesFS::Writer::appendEntry(const uint32_t *words, uint32_t width)
+{
+    uint32_t block_size = m_fs->blockSize();
+    uint32_t entry = 4 * width;
+    if (m_tail_pos + entry > block_size - 4) {
+        uint32_t next = m_fs->takeFreeBlock();
+        if (next == 0) {
+            returnError(false);
+        }
+        m_fs->numToData(next, m_tailbuf, block_size - 4, 4);
+        if (!m_fs->putBlock(m_tail, m_tailbuf)) {
+            m_fs->pushFreeBlock(next);
+            returnError(false);
+        }
+
+        m_fs->clearBuffer(m_tailbuf, block_size);
+        m_fs->numToData(metadata_id, m_tailbuf, 0, 2);
+        m_fs->numToData(META_FILE_CONT, m_tailbuf, 2, 1);
+        m_fs->numToData(ATTRIB_NONE, m_tailbuf, 3, 1);
+        m_tail = next;
+        m_tail_pos = m_fs->entryStart(m_tailbuf);
+    }
+
+    for (uint32_t w = 0; w < width; ++w) {
+        m_fs->numToData(words[w], m_tailbuf, m_tail_pos, 4);
+        m_tail_pos += 4;
+    }
+    return true;
+}
+
+bool ClothesFS::Writer::writeInline()
+{
+    uint32_t block_size = m_fs->blockSize();
+    uint32_t head = m_fs->dataStart(m_algo);
+    uint32_t len = 0;
+    if (m_fill > 0) {
+        len = m_fill - head;
+    }
+    if (m_written > 0
+        || m_pending > 0
+        || m_tail != m_meta
+        || len > block_size - 4 - m_tail_pos) {
+        return false;
+    }
+
+    m_fs->numToData(META_FILE | META_INLINE, m_tailbuf, 2, 1);
+    m_fs->copyBuffer(m_tailbuf + m_tail_pos, m_batch + head, len);
+    m_fill = 0;
+    return true;
+}
+
+void ClothesFS::Writer::releasePlan()
+{
+    // Never referenced by the file, so freed right away
+    for (uint32_t i = 0; i < m_plan_len; ++i) {
+        m_fs->pushFreeBlock(m_plan_start + i);
+    }
+    m_plan_len = 0;
+}
+
+bool ClothesFS::Writer::close()
+{
+    if (!m_open) {
+        return m_ok;
+    }
+    m_open = false;
+
+    if (m_ok && !writeInline()) {
+        if (m_fill > 0) {
+            m_fill = 0;
+            ++m_pending;
+        }
+        m_ok = flushBatch();
+        if (m_ok && m_extent_len > 0) {
+            uint32_t extent[2] = { m_extent_start, m_extent_len };
+            m_ok = appendEntry(extent, 2);
+        }
+    }
+    releasePlan();
+
+    // Size goes to head block, which may still be the tail
+    if (m_ok) {
+        ExclusiveGuard guard(m_fs->nodeLock(m_meta));
+        if (m_tail == m_meta) {
+            m_fs->numToData(m_size, m_tailbuf, 4, 8);
+            m_ok = m_fs->putBlock(m_tail, m_tailbuf);
+        } else {
+            // Batch is empty by now, tail buffer stays as it is
+            m_ok = m_fs->putBlock(m_tail, m_tailbuf)
+                && m_fs->getBlock(m_meta, m_batch);
+            if (m_ok) {
+                m_fs->numToData(m_size, m_batch, 4, 8);
+                m_ok = m_fs->putBlock(m_meta, m_batch);
+            }
+        }
+    }
+    if (!m_ok) {
+        discard();
+        m_fs->endUpdate(false);
+        returnError(false);
+    }
+
+    // Entry goes in last, file is complete once it can be found
+    bool res;
+    {
+        ExclusiveGuard guard(m_fs->nodeLock(m_parent));
+        res = m_fs->addEntry(m_parent, m_meta, m_name);
+    }
+    m_ok = m_fs->endUpdate(res);
+    return m_ok;
+}
+
+/* Frees blocks of a file that was never linked, no reader can
+ * know of them */
+void ClothesFS::Writer::discard()
+{
+    uint32_t width = m_mapping == MAP_EXTENTS ? 2 : 1;
+
+    // Extent still growing is in no block yet
+    for (uint32_t i = 0; i < m_extent_len; ++i) {
+        m_fs->pushFreeBlock(m_extent_start + i);
+    }
+    m_extent_len = 0;
+
+    // Tail is current only in memory, earlier ones are on disk
+    m_fs->discardChain(m_meta, width, m_batch, m_tail, m_tailbuf, m_tail_pos);
+    m_meta = 0;
+    m_tail = 0;
 }
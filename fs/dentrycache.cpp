@@ -0,0 +1,125 @@
+#include "fs/dentrycache.hh"
+
+DentryCache::DentryCache(uint32_t slots)
+    : m_slots(slots),
+    m_entries(nullptr),
+    m_hits(0),
+    m_misses(0)
+{
+    if (m_slots == 0) {
+        return;
+    }
+    m_entries = new Entry[m_slots];
+    invalidate();
+}
+
+DentryCache::~DentryCache()
+{
+    if (m_entries != nullptr) {
+        delete[] m_entries;
+    }
+}
+
+void DentryCache::invalidate()
+{
+    MutexGuard guard(m_lock);
+    for (uint32_t i = 0; i < m_slots; ++i) {
+        m_entries[i].valid = false;
+    }
+}
+
+uint32_t DentryCache::slot(
+    uint32_t parent,
+    const char *name,
+    uint32_t len) const
+{
+    // FNV-1a over parent and name
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < 4; ++i) {
+        hash ^= (parent >> (i * 8)) & 0xFF;
+        hash *= 16777619u;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash % m_slots;
+}
+
+bool DentryCache::match(
+    const Entry &entry,
+    uint32_t parent,
+    const char *name,
+    uint32_t len) const
+{
+    if (!entry.valid
+        || entry.parent != parent
+        || entry.len != len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        if (entry.name[i] != name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DentryCache::find(
+    uint32_t parent,
+    const char *name,
+    uint32_t len,
+    uint32_t *block,
+    uint8_t *type)
+{
+    MutexGuard guard(m_lock);
+    if (m_slots == 0 || len > NAME_LEN) {
+        return false;
+    }
+
+    const Entry &entry = m_entries[slot(parent, name, len)];
+    if (!match(entry, parent, name, len)) {
+        ++m_misses;
+        return false;
+    }
+    ++m_hits;
+    *block = entry.block;
+    *type = entry.type;
+    return true;
+}
+
+void DentryCache::insert(
+    uint32_t parent,
+    const char *name,
+    uint32_t len,
+    uint32_t block,
+    uint8_t type)
+{
+    MutexGuard guard(m_lock);
+    if (m_slots == 0 || len > NAME_LEN) {
+        return;
+    }
+
+    Entry &entry = m_entries[slot(parent, name, len)];
+    entry.valid = true;
+    entry.type = type;
+    entry.len = len;
+    entry.parent = parent;
+    entry.block = block;
+    for (uint32_t i = 0; i < len; ++i) {
+        entry.name[i] = name[i];
+    }
+}
+
+void DentryCache::remove(uint32_t parent, const char *name, uint32_t len)
+{
+    MutexGuard guard(m_lock);
+    if (m_slots == 0 || len > NAME_LEN) {
+        return;
+    }
+
+    Entry &entry = m_entries[slot(parent, name, len)];
+    if (match(entry, parent, name, len)) {
+        entry.valid = false;
+    }
+}
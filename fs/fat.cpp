@@ -122,12 +122,18 @@ uint32_t FAT::solveSector(uint32_t relative_cluster)
     return m_data_base + 32 + (relative_cluster - 2) * m_sectors_per_cluster;
 }
 
+bool FAT::readSector(uint32_t sector, uint8_t *data)
+{
+    uint64_t pos = (uint64_t)sector * m_phys->sectorSize();
+    return m_phys->read(data, 1, pos & 0xFFFFFFFF, pos >> 32);
+}
+
 FATInfo *FAT::readDir(uint32_t cluster)
 {
     uint32_t sector = solveSector(cluster);
 
     uint8_t data[m_phys->sectorSize()];
-    if (!m_phys->read(data, 1, sector * m_phys->sectorSize(), 0)) {
+    if (!readSector(sector, data)) {
         return NULL;
     }
 
@@ -187,7 +193,7 @@ FATInfo *FAT::readDir(uint32_t cluster)
 
         if (pos >= data + m_phys->sectorSize()) {
             ++sector;
-            if (!m_phys->read(data, 1, sector * m_phys->sectorSize(), 0)) {
+            if (!readSector(sector, data)) {
                 return NULL;
             }
             pos = data;
@@ -210,7 +216,7 @@ bool FAT::readFile(FATInfo *info)
     info->m_data = new uint8_t[cnt];
     uint8_t data[m_phys->sectorSize()];
 
-    if (!m_phys->read(data, 1, sector * m_phys->sectorSize(), 0)) {
+    if (!readSector(sector, data)) {
         return false;
     }
     uint32_t pos = 0;
@@ -222,7 +228,7 @@ bool FAT::readFile(FATInfo *info)
         ++pos;
         if (pos >= 512) {
             ++sector;
-            if (!m_phys->read(data, 1, sector * m_phys->sectorSize(), 0)) {
+            if (!readSector(sector, data)) {
                 return false;
             }
             pos = 0;
@@ -0,0 +1,227 @@
+#include "fs/filephys.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// When device doesn't tell, largest logical sector size in use
+static const uint32_t DIRECT_ALIGN = 4096;
+
+FilePhys::FilePhys(std::string fname, uint64_t maxsize, bool direct)
+    : m_fd(-1),
+    m_direct(false),
+    m_size(maxsize),
+    m_mem_align(1),
+    m_offset_align(1)
+{
+    int flags = O_RDWR | O_CREAT;
+#ifdef O_DIRECT
+    if (direct) {
+        m_fd = open(fname.c_str(), flags | O_DIRECT, 0644);
+        m_direct = m_fd >= 0;
+    }
+    if (m_direct) {
+        probeAlign();
+        if (!m_direct) {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+#endif
+    // Filesystem may not support direct I/O
+    if (m_fd < 0) {
+        m_fd = open(fname.c_str(), flags, 0644);
+    }
+}
+
+FilePhys::~FilePhys()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+/* Block devices report logical sector size, files on newer kernels
+ * report alignment direct I/O needs or that it isn't supported */
+void FilePhys::probeAlign()
+{
+    m_mem_align = DIRECT_ALIGN;
+    m_offset_align = DIRECT_ALIGN;
+
+    struct stat st;
+    int sector = 0;
+    if (fstat(m_fd, &st) == 0
+        && S_ISBLK(st.st_mode)
+        && ioctl(m_fd, BLKSSZGET, &sector) == 0
+        && sector > 0) {
+        m_mem_align = sector;
+        m_offset_align = sector;
+        return;
+    }
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(m_fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+        && (stx.stx_mask & STATX_DIOALIGN)) {
+        if (stx.stx_dio_offset_align == 0) {
+            m_direct = false;
+            return;
+        }
+        m_mem_align = stx.stx_dio_mem_align;
+        m_offset_align = stx.stx_dio_offset_align;
+    }
+#endif
+}
+
+bool FilePhys::aligned(
+    const uint8_t *buffer,
+    uint64_t len,
+    uint64_t pos) const
+{
+    return ((uintptr_t)buffer % m_mem_align) == 0
+        && (len % m_offset_align) == 0
+        && (pos % m_offset_align) == 0;
+}
+
+bool FilePhys::readAt(uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+    uint64_t got = 0;
+    while (got < len) {
+        ssize_t res = pread(m_fd, buffer + got, len - got, pos + got);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (res == 0) {
+            // Past end of image, reads as zeros
+            memset(buffer + got, 0, len - got);
+            break;
+        }
+        got += res;
+    }
+    return true;
+}
+
+bool FilePhys::writeAt(const uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t res = pwrite(m_fd, buffer + done, len - done, pos + done);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+bool FilePhys::bounceRead(uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+    uint64_t start = pos - pos % m_offset_align;
+    uint64_t end = pos + len;
+    end += (m_offset_align - end % m_offset_align) % m_offset_align;
+
+    uint8_t *buf = allocBuffer(end - start);
+    if (buf == nullptr) {
+        return false;
+    }
+    bool res = readAt(buf, end - start, start);
+    if (res) {
+        memcpy(buffer, buf + (pos - start), len);
+    }
+    freeBuffer(buf);
+    return res;
+}
+
+bool FilePhys::bounceWrite(const uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+    uint64_t start = pos - pos % m_offset_align;
+    uint64_t end = pos + len;
+    end += (m_offset_align - end % m_offset_align) % m_offset_align;
+
+    uint8_t *buf = allocBuffer(end - start);
+    if (buf == nullptr) {
+        return false;
+    }
+    if (start == pos && end == pos + len) {
+        memcpy(buf, buffer, len);
+        bool res = writeAt(buf, len, pos);
+        freeBuffer(buf);
+        return res;
+    }
+
+    // Partial head or tail needs the old contents, other writers of
+    // the same device blocks wait. Middle ones are overwritten whole.
+    uint32_t first = (start / m_offset_align) % EDGE_LOCKS;
+    uint32_t last = ((end - 1) / m_offset_align) % EDGE_LOCKS;
+    if (first > last) {
+        uint32_t tmp = first;
+        first = last;
+        last = tmp;
+    }
+    bool res;
+    {
+        MutexGuard first_guard(m_edge_locks[first]);
+        MutexGuard last_guard(m_edge_locks[last]);
+        res = readAt(buf, end - start, start);
+        if (res) {
+            memcpy(buf + (pos - start), buffer, len);
+            res = writeAt(buf, end - start, start);
+        }
+    }
+    freeBuffer(buf);
+    return res;
+}
+
+bool FilePhys::read(
+    uint8_t *buffer,
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    uint64_t start = ((uint64_t)pos_hi << 32) | pos;
+    uint64_t len = (uint64_t)sectors * sectorSize();
+    if (m_fd < 0 || start >= m_size || len > m_size - start) {
+        return false;
+    }
+
+    if (m_direct && !aligned(buffer, len, start)) {
+        return bounceRead(buffer, len, start);
+    }
+    return readAt(buffer, len, start);
+}
+
+bool FilePhys::write(
+    uint8_t *buffer,
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    uint64_t start = ((uint64_t)pos_hi << 32) | pos;
+    uint64_t len = (uint64_t)sectors * sectorSize();
+    if (m_fd < 0 || start >= m_size || len > m_size - start) {
+        return false;
+    }
+
+    if (m_direct && !aligned(buffer, len, start)) {
+        return bounceWrite(buffer, len, start);
+    }
+    return writeAt(buffer, len, start);
+}
+
+bool FilePhys::sync()
+{
+    if (m_fd < 0) {
+        return false;
+    }
+    return fdatasync(m_fd) == 0;
+}
@@ -0,0 +1,430 @@
+#include "fs/iouringphys.hh"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(
+    int fd,
+    uint32_t to_submit,
+    uint32_t min_complete,
+    uint32_t flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+        flags, nullptr, 0);
+}
+
+IoUringPhys::IoUringPhys(
+    std::string fname,
+    uint64_t maxsize,
+    uint32_t depth)
+    : m_fd(-1),
+    m_ring_fd(-1),
+    m_depth(depth),
+    m_size(maxsize),
+    m_queued(0),
+    m_outstanding(0),
+    m_completed(0),
+    m_waiting(false),
+    m_failures(0),
+    m_sq_ring(nullptr),
+    m_cq_ring(nullptr),
+    m_sq_ring_size(0),
+    m_cq_ring_size(0),
+    m_sqes(nullptr),
+    m_sqes_size(0)
+{
+    pthread_mutex_init(&m_cq_lock, nullptr);
+    pthread_cond_init(&m_cq_cond, nullptr);
+    m_fd = open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+        return;
+    }
+    if (maxsize == 0) {
+        m_size = st.st_size;
+    } else if ((uint64_t)st.st_size < maxsize) {
+        if (ftruncate(m_fd, maxsize) != 0) {
+            return;
+        }
+    }
+
+    if (m_depth == 0) {
+        m_depth = 1;
+    }
+    setup();
+}
+
+IoUringPhys::~IoUringPhys()
+{
+    while (m_ring_fd >= 0 && pending() > 0) {
+        if (complete(1) == 0) {
+            break;
+        }
+    }
+    if (m_sqes != nullptr) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if (m_sq_ring != nullptr) {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if (m_ring_fd >= 0) {
+        close(m_ring_fd);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    pthread_cond_destroy(&m_cq_cond);
+    pthread_mutex_destroy(&m_cq_lock);
+}
+
+bool IoUringPhys::setup()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = sys_io_uring_setup(m_depth, &p);
+    if (fd < 0) {
+        return false;
+    }
+    m_depth = p.sq_entries;
+
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && m_cq_ring_size > m_sq_ring_size) {
+        m_sq_ring_size = m_cq_ring_size;
+    }
+
+    void *sq = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    m_sq_ring = (uint8_t*)sq;
+
+    if (single) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        void *cq = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        m_cq_ring = (uint8_t*)cq;
+    }
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    m_sqes = (struct io_uring_sqe*)sqes;
+
+    m_sq_head = (uint32_t*)(m_sq_ring + p.sq_off.head);
+    m_sq_tail = (uint32_t*)(m_sq_ring + p.sq_off.tail);
+    m_sq_mask = (uint32_t*)(m_sq_ring + p.sq_off.ring_mask);
+    m_sq_array = (uint32_t*)(m_sq_ring + p.sq_off.array);
+    m_cq_head = (uint32_t*)(m_cq_ring + p.cq_off.head);
+    m_cq_tail = (uint32_t*)(m_cq_ring + p.cq_off.tail);
+    m_cq_mask = (uint32_t*)(m_cq_ring + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe*)(m_cq_ring + p.cq_off.cqes);
+
+    m_ring_fd = fd;
+    return true;
+}
+
+/* Hands queued entries to kernel, submission lock is held */
+bool IoUringPhys::flush()
+{
+    while (m_queued > 0) {
+        int res = sys_io_uring_enter(m_ring_fd, m_queued, 0, 0);
+        if (res > 0) {
+            m_queued -= res;
+        } else if (res == 0 || errno != EINTR) {
+            __atomic_add_fetch(&m_failures, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Sleeps until a completion arrives, no lock is held */
+bool IoUringPhys::wait()
+{
+    while (true) {
+        int res = sys_io_uring_enter(m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (res >= 0) {
+            return true;
+        }
+        if (errno != EINTR) {
+            __atomic_add_fetch(&m_failures, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+}
+
+/* Puts part of request not yet moved to submission ring, submission
+ * lock is held */
+void IoUringPhys::queue(FilesystemPhysRequest *req)
+{
+    uint64_t pos = ((uint64_t)req->vec.pos_hi << 32) | req->vec.pos;
+    uint64_t len = (uint64_t)req->vec.sectors * sectorSize();
+
+    uint32_t tail = *m_sq_tail;
+    uint32_t index = tail & *m_sq_mask;
+    struct io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = m_fd;
+    sqe->off = pos + req->moved;
+    sqe->addr = (uint64_t)(uintptr_t)(req->vec.buffer + req->moved);
+    sqe->len = len - req->moved;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    m_sq_array[index] = index;
+
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++m_queued;
+}
+
+/* Completion lock is held, and no other thread waits in kernel */
+uint32_t IoUringPhys::reap()
+{
+    uint32_t done = 0;
+    uint32_t requeued = 0;
+    uint32_t head = *m_cq_head;
+    uint32_t tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &m_cqes[head & *m_cq_mask];
+        FilesystemPhysRequest *req = (FilesystemPhysRequest*)cqe->user_data;
+        uint64_t len = (uint64_t)req->vec.sectors * sectorSize();
+        int32_t res = cqe->res;
+        ++head;
+
+        if (res > 0 && req->moved + res < len) {
+            // Short transfer, rest goes in again from where it stopped
+            MutexGuard guard(m_sq_lock);
+            req->moved += res;
+            queue(req);
+            ++requeued;
+            continue;
+        }
+        req->ok = res >= 0 && req->moved + res == len;
+        if (!req->write && res == 0) {
+            // Past end of image file, reads as zeros
+            memset(req->vec.buffer + req->moved, 0, len - req->moved);
+            req->ok = true;
+        }
+        __atomic_store_n(&req->done, true, __ATOMIC_RELEASE);
+        ++done;
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+    // Failing here leaves them queued for the next flush
+    if (requeued > 0) {
+        MutexGuard guard(m_sq_lock);
+        flush();
+    }
+    m_completed += done;
+    __atomic_sub_fetch(&m_outstanding, done, __ATOMIC_RELEASE);
+    return done;
+}
+
+bool IoUringPhys::submit(
+    FilesystemPhysRequest *req,
+    uint32_t count)
+{
+    if (m_ring_fd < 0) {
+        return false;
+    }
+
+    uint32_t i = 0;
+    while (i < count) {
+        // Ring full, wait for room without holding submission lock.
+        // Nothing reaped without a failure means ring drained meanwhile.
+        while (__atomic_load_n(&m_outstanding, __ATOMIC_ACQUIRE) >= m_depth) {
+            uint32_t failures = __atomic_load_n(&m_failures, __ATOMIC_RELAXED);
+            if (complete(1) == 0
+                && __atomic_load_n(&m_failures, __ATOMIC_RELAXED) != failures) {
+                return false;
+            }
+        }
+
+        // Outstanding grows only here, so room can't run out meanwhile
+        MutexGuard guard(m_sq_lock);
+        while (i < count
+            && __atomic_load_n(&m_outstanding, __ATOMIC_ACQUIRE) < m_depth) {
+            req[i].done = false;
+            req[i].ok = false;
+            req[i].moved = 0;
+
+            uint64_t pos = ((uint64_t)req[i].vec.pos_hi << 32) | req[i].vec.pos;
+            uint64_t len = (uint64_t)req[i].vec.sectors * sectorSize();
+            if (pos >= m_size || len > m_size - pos) {
+                req[i].done = true;
+            } else {
+                __atomic_add_fetch(&m_outstanding, 1, __ATOMIC_RELEASE);
+                queue(&req[i]);
+            }
+            ++i;
+        }
+
+        // Whole batch goes in with one system call
+        if (!flush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* One thread at a time sleeps in kernel with no lock held and reaps
+ * for everyone, others wait for its broadcast. Completion lock may
+ * take submission lock, never the other way around. */
+uint32_t IoUringPhys::complete(uint32_t min_done)
+{
+    if (m_ring_fd < 0) {
+        return 0;
+    }
+
+    // Entries left behind by a failed submit go in first
+    {
+        MutexGuard guard(m_sq_lock);
+        if (!flush()) {
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&m_cq_lock);
+    uint32_t start = m_completed;
+    if (!m_waiting) {
+        reap();
+    }
+    bool res = true;
+    while (res && m_completed - start < min_done
+        && __atomic_load_n(&m_outstanding, __ATOMIC_ACQUIRE) > 0) {
+        if (m_waiting) {
+            pthread_cond_wait(&m_cq_cond, &m_cq_lock);
+            continue;
+        }
+        {
+            // Sleeping with requests kernel hasn't seen could last forever
+            MutexGuard guard(m_sq_lock);
+            if (!flush()) {
+                break;
+            }
+        }
+        m_waiting = true;
+        pthread_mutex_unlock(&m_cq_lock);
+        res = wait();
+        pthread_mutex_lock(&m_cq_lock);
+        m_waiting = false;
+        reap();
+        pthread_cond_broadcast(&m_cq_cond);
+    }
+    // Completions reaped by any thread count, callers check their own
+    uint32_t done = m_completed - start;
+    pthread_mutex_unlock(&m_cq_lock);
+    return done;
+}
+
+bool IoUringPhys::transfer(
+    const FilesystemPhysVec *vec,
+    uint32_t count,
+    bool write)
+{
+    FilesystemPhysRequest *req = new FilesystemPhysRequest[count];
+    for (uint32_t i = 0; i < count; ++i) {
+        req[i].vec = vec[i];
+        req[i].write = write;
+        req[i].done = false;
+    }
+
+    // Other threads may reap these, done is checked after each wait
+    bool res = submit(req, count);
+    for (uint32_t i = 0; res && i < count; ++i) {
+        while (!req[i].finished()) {
+            if (complete(1) == 0 && !req[i].finished()) {
+                res = false;
+                break;
+            }
+        }
+        res = res && req[i].ok;
+    }
+
+    // Requests can't be freed while kernel still owns them
+    for (uint32_t i = 0; i < count; ++i) {
+        while (!req[i].finished()) {
+            if (complete(1) == 0 && !req[i].finished()) {
+                break;
+            }
+        }
+    }
+    delete[] req;
+    return res;
+}
+
+bool IoUringPhys::read(
+    uint8_t *buffer,
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    FilesystemPhysVec vec = { buffer, sectors, pos, pos_hi };
+    return transfer(&vec, 1, false);
+}
+
+bool IoUringPhys::write(
+    uint8_t *buffer,
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    FilesystemPhysVec vec = { buffer, sectors, pos, pos_hi };
+    return transfer(&vec, 1, true);
+}
+
+bool IoUringPhys::readv(
+    const FilesystemPhysVec *vec,
+    uint32_t count)
+{
+    return transfer(vec, count, false);
+}
+
+bool IoUringPhys::writev(
+    const FilesystemPhysVec *vec,
+    uint32_t count)
+{
+    return transfer(vec, count, true);
+}
+
+bool IoUringPhys::sync()
+{
+    while (pending() > 0) {
+        if (complete(1) == 0) {
+            return false;
+        }
+    }
+    return fsync(m_fd) == 0;
+}
@@ -0,0 +1,572 @@
+#include "fs/journal.hh"
+#include "fs/checksum.hh"
+
+#ifdef LINUX_BUILD
+#include <string.h>
+#endif
+
+// Descriptor layout, entries are logged blocks followed by revoked ones
+static const uint32_t desc_seq = 4;
+static const uint32_t desc_logged = 8;
+static const uint32_t desc_revoked = 10;
+static const uint32_t desc_check = 12;
+static const uint32_t desc_entries = 16;
+static const uint8_t desc_magic[4] = { 0x42, 0x42, 0x80, 0x80 };
+
+static void copyBlock(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+#ifdef LINUX_BUILD
+    memcpy(dst, src, size);
+#else
+    Mem::move(dst, src, size);
+#endif
+}
+
+static uint32_t getNum(const uint8_t *buf, uint32_t start, uint32_t cnt)
+{
+    uint32_t res = 0;
+    for (uint32_t i = 0; i < cnt; ++i) {
+        res |= (uint32_t)buf[start + i] << (i * 8);
+    }
+    return res;
+}
+
+static void putNum(uint32_t num, uint8_t *buf, uint32_t start, uint32_t cnt)
+{
+    for (uint32_t i = 0; i < cnt; ++i) {
+        buf[start + i] = (num >> (i * 8)) & 0xFF;
+    }
+}
+
+Journal::Journal(
+    FilesystemPhys *phys,
+    uint32_t blocksize,
+    uint32_t area1,
+    uint32_t area2)
+    : m_phys(phys),
+    m_blocksize(blocksize),
+    m_block_in_sectors(blocksize / phys->sectorSize()),
+    m_area1(area1),
+    m_area2(area2),
+    m_capacity(areaBlocks(blocksize) - 1),
+    m_buckets(1),
+    m_buf(nullptr),
+    m_blocks(nullptr),
+    m_count(0),
+    m_hash_head(nullptr),
+    m_hash_next(nullptr),
+    m_revoke(nullptr),
+    m_revoked(0),
+    m_prev(nullptr),
+    m_prev_count(0),
+    m_free(nullptr),
+    m_free_count(0),
+    m_free_size(0),
+    m_taken(nullptr),
+    m_taken_count(0),
+    m_taken_size(0),
+    m_seq(0),
+    m_commits(0)
+{
+    while (m_buckets < m_capacity) {
+        m_buckets <<= 1;
+    }
+
+    // Whole transaction goes out in one write from here
+    m_buf = m_phys->allocBuffer((uint64_t)(m_capacity + 1) * m_blocksize);
+    m_blocks = new uint32_t[m_capacity];
+    m_hash_next = new uint32_t[m_capacity];
+    m_revoke = new uint32_t[m_capacity];
+    m_prev = new uint32_t[m_capacity];
+    m_hash_head = new uint32_t[m_buckets];
+    for (uint32_t i = 0; i < m_buckets; ++i) {
+        m_hash_head[i] = NONE;
+    }
+}
+
+Journal::~Journal()
+{
+    if (m_buf != nullptr) {
+        FilesystemPhys::freeBuffer(m_buf);
+    }
+    delete[] m_blocks;
+    delete[] m_hash_next;
+    delete[] m_revoke;
+    delete[] m_prev;
+    delete[] m_hash_head;
+    if (m_free != nullptr) {
+        delete[] m_free;
+    }
+    if (m_taken != nullptr) {
+        delete[] m_taken;
+    }
+}
+
+uint32_t Journal::areaBlocks(uint32_t blocksize)
+{
+    // Descriptor ends with a next pointer like other journal blocks
+    return (blocksize - desc_entries - 4) / 4 + 1;
+}
+
+uint32_t Journal::hash(uint32_t index) const
+{
+    return (index ^ (index >> 16)) & (m_buckets - 1);
+}
+
+uint32_t Journal::find(uint32_t index) const
+{
+    uint32_t slot = m_hash_head[hash(index)];
+    while (slot != NONE && m_blocks[slot] != index) {
+        slot = m_hash_next[slot];
+    }
+    return slot;
+}
+
+void Journal::hashRemove(uint32_t slot)
+{
+    uint32_t *link = &m_hash_head[hash(m_blocks[slot])];
+    while (*link != NONE) {
+        if (*link == slot) {
+            *link = m_hash_next[slot];
+            return;
+        }
+        link = &m_hash_next[*link];
+    }
+}
+
+void Journal::remove(uint32_t slot)
+{
+    hashRemove(slot);
+    uint32_t last = m_count - 1;
+    if (slot != last) {
+        // Last image fills the hole, so images stay packed for write
+        hashRemove(last);
+        m_blocks[slot] = m_blocks[last];
+        copyBlock(
+            m_buf + (uint64_t)(slot + 1) * m_blocksize,
+            m_buf + (uint64_t)(last + 1) * m_blocksize,
+            m_blocksize);
+        uint32_t bucket = hash(m_blocks[slot]);
+        m_hash_next[slot] = m_hash_head[bucket];
+        m_hash_head[bucket] = slot;
+    }
+    --m_count;
+}
+
+bool Journal::log(uint32_t index, const uint8_t *data)
+{
+    uint32_t slot = find(index);
+    if (slot == NONE) {
+        if (room() == 0) {
+            return false;
+        }
+        slot = m_count;
+        ++m_count;
+        m_blocks[slot] = index;
+        uint32_t bucket = hash(index);
+        m_hash_next[slot] = m_hash_head[bucket];
+        m_hash_head[bucket] = slot;
+    }
+    copyBlock(m_buf + (uint64_t)(slot + 1) * m_blocksize, data, m_blocksize);
+    return true;
+}
+
+bool Journal::contains(uint32_t index) const
+{
+    return m_count > 0 && find(index) != NONE;
+}
+
+void Journal::overlay(uint32_t index, uint32_t count, uint8_t *data) const
+{
+    if (m_count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = find(index + i);
+        if (slot != NONE) {
+            copyBlock(
+                data + (uint64_t)i * m_blocksize,
+                m_buf + (uint64_t)(slot + 1) * m_blocksize,
+                m_blocksize);
+        }
+    }
+}
+
+void Journal::overlayList(
+    const uint32_t *indices,
+    uint32_t count,
+    uint8_t *data) const
+{
+    if (m_count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t slot = find(indices[i]);
+        if (slot != NONE) {
+            copyBlock(
+                data + (uint64_t)i * m_blocksize,
+                m_buf + (uint64_t)(slot + 1) * m_blocksize,
+                m_blocksize);
+        }
+    }
+}
+
+bool Journal::needsRevoke(uint32_t index) const
+{
+    uint32_t low = 0;
+    uint32_t high = m_prev_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (m_prev[mid] < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low >= m_prev_count || m_prev[low] != index) {
+        return false;
+    }
+    for (uint32_t i = 0; i < m_revoked; ++i) {
+        if (m_revoke[i] == index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Journal::revoke(uint32_t index)
+{
+    if (m_count > 0) {
+        uint32_t slot = find(index);
+        if (slot != NONE) {
+            remove(slot);
+        }
+    }
+    if (!needsRevoke(index)) {
+        return true;
+    }
+    if (room() == 0) {
+        return false;
+    }
+    m_revoke[m_revoked] = index;
+    ++m_revoked;
+    return true;
+}
+
+void Journal::noteTaken(uint32_t index)
+{
+    if (2 * (m_taken_count + 1) > m_taken_size) {
+        // Grow and rehash, keeps set at most half full
+        uint32_t size = m_taken_size > 0 ? m_taken_size * 2 : 64;
+        uint32_t *old = m_taken;
+        uint32_t old_size = m_taken_size;
+        m_taken = new uint32_t[size];
+        m_taken_size = size;
+        m_taken_count = 0;
+        for (uint32_t i = 0; i < size; ++i) {
+            m_taken[i] = 0;
+        }
+        for (uint32_t i = 0; i < old_size; ++i) {
+            if (old[i] != 0) {
+                noteTaken(old[i]);
+            }
+        }
+        if (old != nullptr) {
+            delete[] old;
+        }
+    }
+
+    uint32_t slot = (index * 2654435761u) & (m_taken_size - 1);
+    while (m_taken[slot] != 0) {
+        if (m_taken[slot] == index) {
+            return;
+        }
+        slot = (slot + 1) & (m_taken_size - 1);
+    }
+    m_taken[slot] = index;
+    ++m_taken_count;
+}
+
+bool Journal::taken(uint32_t index) const
+{
+    if (m_taken_count == 0) {
+        return false;
+    }
+    uint32_t slot = (index * 2654435761u) & (m_taken_size - 1);
+    while (m_taken[slot] != 0) {
+        if (m_taken[slot] == index) {
+            return true;
+        }
+        slot = (slot + 1) & (m_taken_size - 1);
+    }
+    return false;
+}
+
+void Journal::deferFree(uint32_t index)
+{
+    if (m_free_count == m_free_size) {
+        uint32_t size = m_free_size > 0 ? m_free_size * 2 : 64;
+        uint32_t *blocks = new uint32_t[size];
+        for (uint32_t i = 0; i < m_free_count; ++i) {
+            blocks[i] = m_free[i];
+        }
+        if (m_free != nullptr) {
+            delete[] m_free;
+        }
+        m_free = blocks;
+        m_free_size = size;
+    }
+    m_free[m_free_count] = index;
+    ++m_free_count;
+}
+
+uint32_t Journal::takeFree()
+{
+    if (m_free_count == 0) {
+        return 0;
+    }
+    --m_free_count;
+    return m_free[m_free_count];
+}
+
+uint32_t Journal::area(uint32_t seq) const
+{
+    return (seq & 1) ? m_area1 : m_area2;
+}
+
+bool Journal::write()
+{
+    if (empty()) {
+        return true;
+    }
+
+    uint32_t seq = m_seq + 1;
+    for (uint32_t i = 0; i < m_blocksize; ++i) {
+        m_buf[i] = 0;
+    }
+    copyBlock(m_buf, desc_magic, 4);
+    putNum(seq, m_buf, desc_seq, 4);
+    putNum(m_count, m_buf, desc_logged, 2);
+    putNum(m_revoked, m_buf, desc_revoked, 2);
+    uint32_t pos = desc_entries;
+    for (uint32_t i = 0; i < m_count; ++i) {
+        putNum(m_blocks[i], m_buf, pos, 4);
+        pos += 4;
+    }
+    for (uint32_t i = 0; i < m_revoked; ++i) {
+        putNum(m_revoke[i], m_buf, pos, 4);
+        pos += 4;
+    }
+
+    // Torn write of transaction fails the check and is not replayed
+    uint64_t size = (uint64_t)(m_count + 1) * m_blocksize;
+    putNum(Checksum::crc32c(0, m_buf, (uint32_t)size), m_buf, desc_check, 4);
+
+    uint64_t where = (uint64_t)area(seq) * m_blocksize;
+    if (!m_phys->write(
+            m_buf,
+            (m_count + 1) * m_block_in_sectors,
+            where & 0xFFFFFFFF,
+            (where >> 32) & 0xFFFFFFFF)) {
+        return false;
+    }
+    if (!m_phys->sync()) {
+        return false;
+    }
+
+    m_seq = seq;
+    ++m_commits;
+    return true;
+}
+
+void Journal::setPrevious(const uint32_t *blocks, uint32_t count)
+{
+    // Insertion sort, transactions are small
+    m_prev_count = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t pos = m_prev_count;
+        while (pos > 0 && m_prev[pos - 1] > blocks[i]) {
+            m_prev[pos] = m_prev[pos - 1];
+            --pos;
+        }
+        m_prev[pos] = blocks[i];
+        ++m_prev_count;
+    }
+}
+
+void Journal::finish()
+{
+    setPrevious(m_blocks, m_count);
+    for (uint32_t i = 0; i < m_buckets; ++i) {
+        m_hash_head[i] = NONE;
+    }
+    m_count = 0;
+    m_revoked = 0;
+    for (uint32_t i = 0; i < m_taken_size && m_taken_count > 0; ++i) {
+        m_taken[i] = 0;
+    }
+    m_taken_count = 0;
+}
+
+bool Journal::load(uint32_t start, uint32_t *seq)
+{
+    uint64_t where = (uint64_t)start * m_blocksize;
+    if (!m_phys->read(
+            m_buf,
+            m_block_in_sectors,
+            where & 0xFFFFFFFF,
+            (where >> 32) & 0xFFFFFFFF)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < 4; ++i) {
+        if (m_buf[i] != desc_magic[i]) {
+            return false;
+        }
+    }
+
+    uint32_t logged = getNum(m_buf, desc_logged, 2);
+    uint32_t revoked = getNum(m_buf, desc_revoked, 2);
+    if (logged + revoked > m_capacity) {
+        return false;
+    }
+    where += m_blocksize;
+    if (logged > 0 && !m_phys->read(
+            m_buf + m_blocksize,
+            logged * m_block_in_sectors,
+            where & 0xFFFFFFFF,
+            (where >> 32) & 0xFFFFFFFF)) {
+        return false;
+    }
+
+    uint32_t check = getNum(m_buf, desc_check, 4);
+    putNum(0, m_buf, desc_check, 4);
+    uint64_t size = (uint64_t)(logged + 1) * m_blocksize;
+    if (Checksum::crc32c(0, m_buf, (uint32_t)size) != check) {
+        return false;
+    }
+
+    *seq = getNum(m_buf, desc_seq, 4);
+    return true;
+}
+
+bool Journal::apply(
+    uint32_t start,
+    const uint32_t *skip,
+    uint32_t skip_count)
+{
+    uint32_t seq;
+    if (!load(start, &seq)) {
+        return false;
+    }
+
+    uint32_t logged = getNum(m_buf, desc_logged, 2);
+    for (uint32_t i = 0; i < logged; ++i) {
+        uint32_t index = getNum(m_buf, desc_entries + i * 4, 4);
+        bool skipped = false;
+        for (uint32_t s = 0; s < skip_count; ++s) {
+            if (skip[s] == index) {
+                skipped = true;
+                break;
+            }
+        }
+        if (skipped) {
+            continue;
+        }
+        uint64_t where = (uint64_t)index * m_blocksize;
+        if (!m_phys->write(
+                m_buf + (uint64_t)(i + 1) * m_blocksize,
+                m_block_in_sectors,
+                where & 0xFFFFFFFF,
+                (where >> 32) & 0xFFFFFFFF)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Journal::replay()
+{
+    if (m_buf == nullptr) {
+        return false;
+    }
+    uint32_t seq1 = 0;
+    uint32_t seq2 = 0;
+    bool valid1 = load(m_area1, &seq1);
+    bool valid2 = load(m_area2, &seq2);
+
+    m_seq = 0;
+    m_prev_count = 0;
+    if (!valid1 && !valid2) {
+        return true;
+    }
+
+    uint32_t newer = m_area1;
+    uint32_t newer_seq = seq1;
+    uint32_t older = m_area2;
+    uint32_t older_seq = seq2;
+    bool both = valid1 && valid2;
+    if (!valid1 || (valid2 && (int32_t)(seq2 - seq1) > 0)) {
+        newer = m_area2;
+        newer_seq = seq2;
+        older = m_area1;
+        older_seq = seq1;
+    }
+
+    // Newer transaction tells which images of older one are stale
+    uint32_t seq;
+    if (!load(newer, &seq)) {
+        return false;
+    }
+    uint32_t logged = getNum(m_buf, desc_logged, 2);
+    uint32_t revoked = getNum(m_buf, desc_revoked, 2);
+    uint32_t *skip = new uint32_t[revoked + 1];
+    for (uint32_t i = 0; i < revoked; ++i) {
+        skip[i] = getNum(m_buf, desc_entries + (logged + i) * 4, 4);
+    }
+
+    bool res = true;
+    if (both && older_seq == newer_seq - 1) {
+        res = apply(older, skip, revoked);
+    }
+    delete[] skip;
+    if (!res || !apply(newer, nullptr, 0)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < logged; ++i) {
+        m_blocks[i] = getNum(m_buf, desc_entries + i * 4, 4);
+    }
+    setPrevious(m_blocks, logged);
+    m_seq = newer_seq;
+
+    return m_phys->sync();
+}
+
+bool Journal::clear()
+{
+    uint8_t *buf = m_phys->allocBuffer(m_blocksize);
+    if (m_buf == nullptr || buf == nullptr) {
+        if (buf != nullptr) {
+            FilesystemPhys::freeBuffer(buf);
+        }
+        return false;
+    }
+    for (uint32_t i = 0; i < m_blocksize; ++i) {
+        buf[i] = 0;
+    }
+    bool res = true;
+    uint32_t areas[2] = { m_area1, m_area2 };
+    for (uint32_t i = 0; res && i < 2; ++i) {
+        uint64_t where = (uint64_t)areas[i] * m_blocksize;
+        res = m_phys->write(
+            buf,
+            m_block_in_sectors,
+            where & 0xFFFFFFFF,
+            (where >> 32) & 0xFFFFFFFF);
+    }
+    FilesystemPhys::freeBuffer(buf);
+
+    m_seq = 0;
+    m_prev_count = 0;
+    return res && m_phys->sync();
+}
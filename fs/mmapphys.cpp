@@ -0,0 +1,128 @@
+#include "fs/mmapphys.hh"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MmapPhys::MmapPhys(std::string fname, uint64_t maxsize, bool readonly)
+    : m_fd(-1),
+    m_readonly(readonly),
+    m_map(nullptr),
+    m_size(0)
+{
+    int flags = readonly ? O_RDONLY : (O_RDWR | O_CREAT);
+    m_fd = open(fname.c_str(), flags, 0644);
+    if (m_fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+        return;
+    }
+    m_size = st.st_size;
+    if (maxsize != 0) {
+        if (!readonly && (uint64_t)st.st_size < maxsize) {
+            if (ftruncate(m_fd, maxsize) != 0) {
+                return;
+            }
+            m_size = maxsize;
+        } else if (maxsize < m_size) {
+            m_size = maxsize;
+        }
+    }
+    if (m_size == 0) {
+        return;
+    }
+
+    int prot = PROT_READ;
+    if (!readonly) {
+        prot |= PROT_WRITE;
+    }
+    void *map = mmap(nullptr, m_size, prot, MAP_SHARED, m_fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    m_map = (uint8_t*)map;
+}
+
+MmapPhys::~MmapPhys()
+{
+    if (m_map != nullptr) {
+        if (!m_readonly) {
+            msync(m_map, m_size, MS_SYNC);
+        }
+        munmap(m_map, m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+uint8_t *MmapPhys::range(
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi) const
+{
+    if (m_map == nullptr) {
+        return nullptr;
+    }
+
+    uint64_t start = ((uint64_t)pos_hi << 32) | pos;
+    uint64_t len = (uint64_t)sectors * sectorSize();
+    if (start >= m_size || len > m_size - start) {
+        return nullptr;
+    }
+    return m_map + start;
+}
+
+bool MmapPhys::read(
+    uint8_t *buffer,
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    uint8_t *src = range(sectors, pos, pos_hi);
+    if (src == nullptr) {
+        return false;
+    }
+    SharedGuard guard(m_lock);
+    memcpy(buffer, src, (size_t)sectors * sectorSize());
+    return true;
+}
+
+bool MmapPhys::write(
+    uint8_t *buffer,
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    uint8_t *dst = range(sectors, pos, pos_hi);
+    if (m_readonly || dst == nullptr) {
+        return false;
+    }
+    ExclusiveGuard guard(m_lock);
+    memcpy(dst, buffer, (size_t)sectors * sectorSize());
+    return true;
+}
+
+uint8_t *MmapPhys::borrow(
+    uint32_t sectors,
+    uint32_t pos,
+    uint32_t pos_hi)
+{
+    return range(sectors, pos, pos_hi);
+}
+
+bool MmapPhys::sync()
+{
+    if (m_map == nullptr) {
+        return false;
+    }
+    if (m_readonly) {
+        return true;
+    }
+    return msync(m_map, m_size, MS_SYNC) == 0;
+}
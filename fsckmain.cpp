@@ -0,0 +1,96 @@
+#include "fs/clothesfs.hh"
+#include "fs/clothescheck.hh"
+#include "fs/filephys.hh"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Exit codes as with other fsck tools
+static const int FSCK_OK = 0;
+static const int FSCK_FIXED = 1;
+static const int FSCK_UNCORRECTED = 4;
+static const int FSCK_ERROR = 8;
+// Volume size in header
+static const uint32_t HEADER_SIZE_POS = 48;
+
+int main(int argc, char **argv)
+{
+    bool repair = false;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *image = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--repair") == 0) {
+            repair = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (image == nullptr && argv[i][0] != '-') {
+            image = argv[i];
+        } else {
+            image = nullptr;
+            break;
+        }
+    }
+    if (image == nullptr || threads <= 0) {
+        printf("Usage: %s [--repair] [--threads N] image\n", argv[0]);
+        return FSCK_ERROR;
+    }
+
+    struct stat st;
+    if (stat(image, &st) != 0) {
+        printf("Can't open %s\n", image);
+        return FSCK_ERROR;
+    }
+    // Image may end before volume does when its tail was never written
+    uint64_t size = st.st_size;
+    FILE *f = fopen(image, "rb");
+    uint8_t header[HEADER_SIZE_POS + 4];
+    if (f == nullptr) {
+        printf("Can't open %s\n", image);
+        return FSCK_ERROR;
+    }
+    if (fread(header, 1, sizeof(header), f) == sizeof(header)
+        && ClothesFS::dataToNum(header, HEADER_SIZE_POS, 4) > size) {
+        size = ClothesFS::dataToNum(header, HEADER_SIZE_POS, 4);
+    }
+    fclose(f);
+
+    FilePhys phys(image, size);
+    if (!phys.ok()) {
+        printf("Can't open %s\n", image);
+        return FSCK_ERROR;
+    }
+
+    // Mounting replays committed journal transactions first
+    ClothesFS cloth;
+    cloth.setPhysical(&phys);
+    if (!cloth.detect()) {
+        printf("%s: no ClothesFS volume\n", image);
+        return FSCK_ERROR;
+    }
+
+    ClothesCheck check(&cloth, threads);
+    bool clean = check.check();
+    printf("%s: %u files, %u directories, %u blocks used, %u leaked, %u problems\n",
+        image, check.files(), check.dirs(), check.owned(), check.leaked(),
+        check.problems());
+    if (clean) {
+        return FSCK_OK;
+    }
+    if (!repair) {
+        return FSCK_UNCORRECTED;
+    }
+
+    if (!check.repair()) {
+        printf("%s: repair failed\n", image);
+        return FSCK_ERROR;
+    }
+    printf("%s: free space map rebuilt\n", image);
+    if (check.remaining() > 0) {
+        printf("%s: %u problems left\n", image, check.remaining());
+        return FSCK_UNCORRECTED;
+    }
+    return FSCK_FIXED;
+}
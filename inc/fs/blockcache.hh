@@ -0,0 +1,99 @@
+#ifndef __BLOCKCACHE_HH
+#define __BLOCKCACHE_HH
+
+#ifdef LINUX_BUILD
+#include <stdint.h>
+#include <stddef.h>
+#else
+#include <platform.h>
+#endif
+
+#include <fs/filesystem.hh>
+#include <fs/lock.hh>
+
+/* LRU cache of filesystem blocks on top of physical layer.
+ * Budget is given in bytes, whole blocks are cached.
+ * In write back mode dirty blocks are written on eviction or sync().
+ * Pinned blocks are not evicted until unpinned as many times.
+ * Safe to share between threads, misses are read without the lock. */
+class BlockCache
+{
+public:
+    enum Mode {
+        WRITE_THROUGH = 0,
+        WRITE_BACK = 1
+    };
+
+    BlockCache(
+        FilesystemPhys *phys,
+        uint32_t blocksize,
+        uint64_t budget,
+        Mode mode);
+    ~BlockCache();
+
+    bool read(uint32_t index, uint8_t *data);
+    bool write(uint32_t index, const uint8_t *data);
+    bool readList(const uint32_t *indices, uint32_t count, uint8_t *data);
+    const uint8_t *pin(uint32_t index);
+    void unpin(uint32_t index);
+    bool flush();
+    bool sync();
+    void invalidate();
+
+    inline Mode mode() const
+    {
+        return m_mode;
+    }
+    inline uint32_t slots() const
+    {
+        return m_slots;
+    }
+    inline uint64_t hits() const
+    {
+        return m_hits;
+    }
+    inline uint64_t misses() const
+    {
+        return m_misses;
+    }
+
+protected:
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    uint32_t find(uint32_t index) const;
+    uint32_t allocate(uint32_t index);
+    bool evict(uint32_t slot);
+    void unlink(uint32_t slot);
+    void touch(uint32_t slot);
+    void hashRemove(uint32_t slot);
+    uint32_t hash(uint32_t index) const;
+    bool writeSlots(uint32_t *slots, uint32_t count);
+
+    FilesystemPhys *m_phys;
+    uint32_t m_blocksize;
+    uint32_t m_block_in_sectors;
+    Mode m_mode;
+    Mutex m_lock;
+    // Bumped by writes and evictions, read misses fetched meanwhile
+    // may be stale and are not cached
+    uint64_t m_changes;
+
+    uint32_t m_slots;
+    uint32_t m_used;
+    uint32_t m_buckets;
+    uint8_t *m_data;
+    uint32_t *m_index;
+    bool *m_dirty;
+    uint32_t *m_pins;
+    uint32_t *m_hash_head;
+    uint32_t *m_hash_next;
+    uint32_t *m_prev;
+    uint32_t *m_next;
+    uint32_t m_mru;
+    uint32_t m_lru;
+
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __CHECKSUM_HH
+#define __CHECKSUM_HH
+
+#ifdef LINUX_BUILD
+#include <stdint.h>
+#include <stddef.h>
+#else
+#include <platform.h>
+#endif
+
+/* Payload block checksums. Implementation is picked on first use
+ * by what the CPU supports, first use may come from several threads. */
+class Checksum
+{
+public:
+    enum {
+        ALGO_XOR = 0x01,
+        ALGO_CRC = 0x02,
+        ALGO_SUMMOD = 0x04
+    };
+
+    /* Instruction set levels for kernel selection */
+    enum {
+        ISA_PORTABLE = 0,
+        ISA_SSE = 1,
+        ISA_AVX2 = 2
+    };
+
+    /* Algorithms of mask applied from lowest bit up, results combined
+     * with XOR. Returns false when mask has unknown algorithms. */
+    static bool compute(
+        uint8_t algo,
+        const uint8_t *data,
+        uint32_t len,
+        uint32_t *res);
+
+    /* CRC32C (Castagnoli), crc is running value starting from 0 */
+    static uint32_t crc32c(uint32_t crc, const uint8_t *data, uint32_t len);
+    static uint32_t crc32cPortable(
+        uint32_t crc,
+        const uint8_t *data,
+        uint32_t len);
+
+    /* XOR of little endian 32-bit words, short tail zero padded */
+    static uint32_t xor32(const uint8_t *data, uint32_t len);
+    static uint32_t xor32Portable(const uint8_t *data, uint32_t len);
+
+    /* Sum of bytes mod 2^32 */
+    static uint32_t sumBytes(const uint8_t *data, uint32_t len);
+    static uint32_t sumBytesPortable(const uint8_t *data, uint32_t len);
+
+    /* Name of implementation picked for a single algorithm */
+    static const char *name(uint8_t algo);
+
+    /* Cap kernels to given instruction set level, for benchmarking
+     * and testing fallbacks. Returns level actually in use. Must not
+     * run while other threads compute checksums. */
+    static uint32_t limitIsa(uint32_t isa);
+};
+
+#endif
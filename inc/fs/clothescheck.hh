@@ -0,0 +1,133 @@
+#ifndef __CLOTHES_CHECK_HH
+#define __CLOTHES_CHECK_HH
+
+#include "fs/clothesfs.hh"
+#include <pthread.h>
+#include <stdint.h>
+
+/* Offline consistency check of a detected ClothesFS volume. Tree is
+ * walked from root by a pool of threads, each referenced block is
+ * claimed in a shared ownership bitmap. Second claim of a block means
+ * it is referenced twice. Free space map is then compared with owned
+ * blocks: blocks neither owned nor free have leaked, owned blocks in
+ * freechain or marked free in bitmap would be handed out again.
+ * Problems are printed as they are found. */
+class ClothesCheck
+{
+public:
+    ClothesCheck(ClothesFS *fs, uint32_t threads);
+    ~ClothesCheck();
+
+    /* Returns false when problems were found */
+    bool check();
+    /* Rebuilds free space map and used count from owned blocks, so
+     * leaked blocks are free and owned ones used. Doubly referenced
+     * blocks and bad pointers are left as is. Call after check(). */
+    bool repair();
+
+    inline uint32_t problems() const
+    {
+        return m_problems;
+    }
+    /* Problems repair() can't fix */
+    inline uint32_t remaining() const
+    {
+        return m_shared_count + m_bad;
+    }
+    inline uint32_t files() const
+    {
+        return m_files;
+    }
+    inline uint32_t dirs() const
+    {
+        return m_dirs;
+    }
+    inline uint32_t owned() const
+    {
+        return m_owned_count;
+    }
+    inline uint32_t leaked() const
+    {
+        return m_leaked;
+    }
+
+protected:
+    ClothesCheck(const ClothesCheck &another);
+    ClothesCheck &operator=(const ClothesCheck &another);
+
+    enum {
+        SPACE_OK = 0,
+        // Neither owned nor free
+        SPACE_LEAKED,
+        // Owned but free
+        SPACE_CONFLICT
+    };
+
+    struct Node {
+        uint32_t block;
+        uint32_t parent;
+    };
+
+    static void *worker(void *arg);
+    void work();
+    void push(uint32_t block, uint32_t parent);
+    bool pop(Node *node);
+    void done();
+
+    void walk(const Node &node, uint8_t *data);
+    void walkIndex(uint32_t index, uint32_t dir, uint8_t *data);
+    bool claim(uint32_t block, uint32_t node);
+    bool readMeta(uint32_t block, uint8_t type, uint8_t *data);
+    void report(const char *fmt, ...);
+
+    static inline bool test(const uint32_t *bits, uint32_t block)
+    {
+        return (bits[block / 32] >> (block % 32)) & 1;
+    }
+    static inline void set(uint32_t *bits, uint32_t block)
+    {
+        bits[block / 32] |= 1u << (block % 32);
+    }
+
+    void reserve(uint32_t start, uint32_t count);
+    void checkFreechain();
+    uint8_t spaceState(uint32_t block) const;
+    uint32_t reportRuns(uint8_t state, const char *what);
+    bool rebuildFreechain();
+
+    ClothesFS *m_fs;
+    uint32_t m_threads;
+    uint32_t m_blocksize;
+    uint32_t m_blocks;
+    bool m_checked;
+
+    // Bit per block, set by first reference
+    uint32_t *m_owned;
+    // Blocks referenced more than once
+    uint32_t *m_shared;
+    // Blocks found in freechain
+    uint32_t *m_free;
+    // Freechain has no cycle, no foreign or used blocks
+    bool m_chain_ok;
+    // Highest owned block, untouched area must start after it
+    uint32_t m_owned_max;
+
+    // Nodes waiting for a worker, last in first out
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_cond;
+    Node *m_queue;
+    uint32_t m_queue_count;
+    uint32_t m_queue_size;
+    uint32_t m_active;
+    pthread_mutex_t m_report_lock;
+
+    uint32_t m_problems;
+    uint32_t m_bad;
+    uint32_t m_shared_count;
+    uint32_t m_files;
+    uint32_t m_dirs;
+    uint32_t m_owned_count;
+    uint32_t m_leaked;
+};
+
+#endif
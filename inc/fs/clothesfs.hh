@@ -11,6 +11,11 @@
 #endif
 
 #include <fs/filesystem.hh>
+#include <fs/blockcache.hh>
+#include <fs/dentrycache.hh>
+#include <fs/checksum.hh>
+#include <fs/journal.hh>
+#include <fs/lock.hh>
 
 #ifdef USE_CUSTOM_STRING
 #include <string.hh>
@@ -20,9 +25,34 @@
 #define STD_STRING_TYPE std::string
 #endif
 static const uint32_t FS_BLOCKSIZE = 512;
+// Blocks moved to physical layer in one request
+static const uint32_t IO_BATCH_BLOCKS = 32;
+// Read-ahead window of sequential reads grows between these, in blocks
+static const uint32_t READ_AHEAD_MIN = 4;
+static const uint32_t READ_AHEAD_MAX = 4 * IO_BATCH_BLOCKS;
+// Default number of cached directory entries
+static const uint32_t DENTRY_SLOTS = 256;
+// Stripes of shared/exclusive locks, directories and files hash to them
+static const uint32_t NODE_LOCKS = 64;
+// Most allocation groups a bitmap is split to, and least blocks in one
+static const uint32_t ALLOC_GROUPS = 32;
+static const uint32_t ALLOC_GROUP_MIN = 1024;
 
+/* Calls may come from several threads. Directory and file updates
+ * take exclusive lock of the node, lookups take it shared. Bitmap
+ * volumes are split into allocation groups with a lock each, a thread
+ * takes blocks from its own group and from others only when it is
+ * full. Freechain, header and journal are under one mutex, bitmap
+ * changes are under it too when journal is used. list() and Iterator reads
+ * take no node locks, they see each block as it was when read.
+ * Iterator publishes the directory and file it reads, blocks of a
+ * removed node are not reused while it is published. Setup calls
+ * like setPhysical, setCache, format, detect, enableJournal and
+ * convertToBitmap must not run concurrently with others. */
 class ClothesFS
 {
+    // Offline checker reads and rebuilds allocator state
+    friend class ClothesCheck;
 public:
     enum {
         META_FREE = 0x00,
@@ -30,8 +60,22 @@ public:
         META_DIR = 0x04,
         META_FILE_CONT = 0x08,
         META_DIR_CONT = 0x10,
+        // Modifier on META_FILE, entries are extents instead of blocks
+        META_EXTENTS = 0x20,
+        // Modifier on META_FILE, contents follow the name
+        META_INLINE = 0x40,
+        // Modifier on META_DIR, names are also in a hash index
+        META_INDEXED = 0x20,
         META_JOURNAL = 0x80
     };
+    enum {
+        MAP_BLOCKS = 0x00,
+        MAP_EXTENTS = META_EXTENTS
+    };
+    enum {
+        DIR_LINEAR = 0x00,
+        DIR_HASHED = META_INDEXED
+    };
     enum {
         ATTRIB_NONE = 0x00,
         ATTRIB_EXEC = 0x01,
@@ -48,6 +92,15 @@ public:
         PAYLOAD_USED = 0x01,
         PAYLOAD_FREED = 0x02
     };
+    enum {
+        FLAG_NONE = 0x00,
+        FLAG_MIRROR = 0x01,
+        FLAG_ENCRYPTED = 0x02,
+        FLAG_LOGICAL_GROUP = 0x04,
+        FLAG_MERGE_GROUP = 0x08,
+        FLAG_BITMAP = 0x10,
+        FLAG_LAZY = 0x20
+    };
     enum {
         ALGO_DISABLED = 0x00,
         ALGO_XOR = 0x01,
@@ -55,56 +108,194 @@ public:
         ALGO_SUMMOD = 0x04
     };
 
+    /* Nodes read by an Iterator without locks */
+    struct Hazard {
+        bool used;
+        AtomicWord dir;
+        AtomicWord file;
+        Hazard *next;
+    };
+
+    struct Stat {
+        uint32_t block;
+        uint8_t type;
+        uint8_t attrib;
+        uint64_t size;
+    };
+
+    /* Read-only piece of a file in block cache or mapped image.
+     * Its block stays pinned while any copy of the view exists. */
+    class View {
+        friend class ClothesFS;
+    public:
+        View()
+            : m_fs(nullptr),
+            m_block(0),
+            m_size(0),
+            m_base(nullptr),
+            m_data(nullptr)
+        {
+        }
+        View(const View &another)
+            : m_fs(nullptr),
+            m_block(0),
+            m_size(0),
+            m_base(nullptr),
+            m_data(nullptr)
+        {
+            assign(another);
+        }
+        ~View()
+        {
+            release();
+        }
+
+        View &operator=(const View &another)
+        {
+            assign(another);
+            return *this;
+        }
+
+        void assign(const View &another);
+        void release();
+        inline const uint8_t *data() const
+        {
+            return m_data;
+        }
+        inline uint32_t size() const
+        {
+            return m_size;
+        }
+
+    protected:
+        ClothesFS *m_fs;
+        uint32_t m_block;
+        uint32_t m_size;
+        const uint8_t *m_base;
+        const uint8_t *m_data;
+    };
+
     class Iterator {
         friend class ClothesFS;
     public:
         Iterator()
             : m_ok(false),
+            m_end(false),
             m_block(0),
             m_index(0),
-            m_pos(0),
+            m_content_index(0),
+            m_offset(0),
             m_data_block(0),
             m_data_index(0),
+            m_meta_block(0),
+            m_extent_block(0),
+            m_extent_left(0),
+            m_parent_block(0),
+            m_dir(0),
+            m_window_parent(0),
+            m_window_index(0),
+            m_window_count(0),
+            m_map_count(0),
+            m_map_size(0),
+            m_ahead_index(0),
+            m_ahead_count(0),
+            m_ahead_window(0),
+            m_ahead_pending(0),
+            m_ahead_next(0),
+            m_payload(0),
+            m_unlinks(0),
             m_fs(nullptr),
+            m_hazard(nullptr),
             m_parent(nullptr),
-            m_data(nullptr)
+            m_data(nullptr),
+            m_content(nullptr),
+            m_meta(nullptr),
+            m_view(nullptr),
+            m_window(nullptr),
+            m_map(nullptr),
+            m_ahead(nullptr),
+            m_ahead_req(nullptr)
         {
         }
         Iterator(uint32_t blk, uint32_t index)
             : m_ok(false),
+            m_end(false),
             m_block(blk),
             m_index(index),
-            m_pos(0),
+            m_content_index(0),
+            m_offset(0),
             m_data_block(0),
             m_data_index(0),
+            m_meta_block(0),
+            m_extent_block(0),
+            m_extent_left(0),
+            m_parent_block(0),
+            m_dir(0),
+            m_window_parent(0),
+            m_window_index(0),
+            m_window_count(0),
+            m_map_count(0),
+            m_map_size(0),
+            m_ahead_index(0),
+            m_ahead_count(0),
+            m_ahead_window(0),
+            m_ahead_pending(0),
+            m_ahead_next(0),
+            m_payload(0),
+            m_unlinks(0),
             m_fs(nullptr),
+            m_hazard(nullptr),
             m_parent(nullptr),
-            m_data(nullptr)
+            m_data(nullptr),
+            m_content(nullptr),
+            m_meta(nullptr),
+            m_view(nullptr),
+            m_window(nullptr),
+            m_map(nullptr),
+            m_ahead(nullptr),
+            m_ahead_req(nullptr)
         {
         }
         ~Iterator() {
             m_ok = false;
-            if (m_parent != nullptr) {
-                delete[] m_parent;
-            }
-            if (m_data != nullptr) {
-                delete[] m_data;
-            }
-            if (m_content != nullptr) {
-                delete[] m_content;
-            }
-            m_parent = nullptr;
-            m_data = nullptr;
-            m_content = nullptr;
+            freeBuffers();
+            detach();
         }
         Iterator(const Iterator &another)
             : m_ok(false),
-            m_pos(0),
+            m_end(false),
+            m_content_index(0),
+            m_offset(0),
             m_data_block(0),
             m_data_index(0),
+            m_meta_block(0),
+            m_extent_block(0),
+            m_extent_left(0),
+            m_parent_block(0),
+            m_dir(0),
+            m_window_parent(0),
+            m_window_index(0),
+            m_window_count(0),
+            m_map_count(0),
+            m_map_size(0),
+            m_ahead_index(0),
+            m_ahead_count(0),
+            m_ahead_window(0),
+            m_ahead_pending(0),
+            m_ahead_next(0),
+            m_payload(0),
+            m_unlinks(0),
             m_fs(nullptr),
+            m_hazard(nullptr),
             m_parent(nullptr),
-            m_data(nullptr)
+            m_data(nullptr),
+            m_content(nullptr),
+            m_meta(nullptr),
+            m_view(nullptr),
+            m_window(nullptr),
+            m_map(nullptr),
+            m_ahead(nullptr),
+            m_ahead_req(nullptr)
         {
             assign(another);
         }
@@ -117,39 +308,56 @@ public:
 
         void assign(const Iterator &another)
         {
-            m_fs = another.m_fs;
+            if (this == &another) {
+                return;
+            }
+            freeBuffers();
+            detach();
+
+            attach(another.m_fs);
+            if (m_hazard != nullptr) {
+                // Other one holds these, so they can't go away meanwhile
+                m_hazard->dir.set(another.m_dir);
+                m_hazard->file.set(another.m_block);
+            }
+            m_unlinks = another.m_unlinks;
             m_block = another.m_block;
             m_index = another.m_index;
+            m_content_index = another.m_content_index;
+            m_payload = another.m_payload;
+            m_offset = another.m_offset;
             m_data_block = another.m_data_block;
             m_data_index = another.m_data_index;
+            m_meta_block = another.m_meta_block;
+            m_extent_block = another.m_extent_block;
+            m_extent_left = another.m_extent_left;
+            m_parent_block = another.m_parent_block;
+            m_dir = another.m_dir;
+            m_window_count = 0;
+            m_ahead_window = another.m_ahead_window;
+            m_ahead_next = another.m_ahead_next;
             m_ok = another.m_ok;
+            m_end = another.m_end;
 
             if (m_fs != nullptr) {
-                m_parent = new uint8_t[m_fs->m_blocksize];
-                m_data = new uint8_t[m_fs->m_blocksize];
-                m_content = new uint8_t[m_fs->m_blocksize];
-
-#ifdef LINUX_BUILD
-                if (another.m_parent != nullptr) {
-                    memmove(m_parent, another.m_parent, m_fs->m_blocksize);
-                }
-                if (another.m_data != nullptr) {
-                    memmove(m_data, another.m_data, m_fs->m_blocksize);
-                }
-                if (another.m_content != nullptr) {
-                    memmove(m_content, another.m_content, m_fs->m_blocksize);
-                }
-#else
-                if (another.m_parent != nullptr) {
-                    Mem::move(m_parent, another.m_parent, m_fs->m_blocksize);
-                }
-                if (another.m_data != nullptr) {
-                    Mem::move(m_data, another.m_data, m_fs->m_blocksize);
+                m_parent = cloneBuffer(another.m_parent);
+                m_data = cloneBuffer(another.m_data);
+                m_content = cloneBuffer(another.m_content);
+                m_meta = cloneBuffer(another.m_meta);
+                // Borrowed block is not shared, take a copy
+                if (another.m_view != nullptr && m_content != nullptr) {
+                    copyBuffer(m_content, another.m_view, m_fs->m_blocksize);
                 }
-                if (another.m_content != nullptr) {
-                    Mem::move(m_content, another.m_content, m_fs->m_blocksize);
+            }
+            m_map_count = 0;
+            m_map_size = 0;
+            if (another.m_map != nullptr) {
+                m_map = new uint32_t[another.m_map_size];
+                m_map_size = another.m_map_size;
+                m_map_count = another.m_map_count;
+                for (uint32_t i = 0; i < m_map_count; ++i) {
+                    m_map[i] = another.m_map[i];
                 }
-#endif
             }
         }
 
@@ -158,6 +366,12 @@ public:
         {
             return m_ok;
         }
+        /* Listing reached its last entry, not ok() because of an error
+         * otherwise */
+        inline bool end() const
+        {
+            return m_end;
+        }
         inline uint8_t *data()
         {
             return m_data;
@@ -167,32 +381,277 @@ public:
         uint64_t size();
         uint8_t type() const;
         uint64_t read(uint8_t *buf, uint64_t cnt);
+        /* Read at offset, does not move position of read() */
+        uint64_t pread(uint64_t offset, uint8_t *buf, uint64_t cnt);
+        /* Next piece of file as a view, moves position like read().
+         * Needs block cache or a backend lending memory, false
+         * at end of file or when blocks can't be lent. */
+        bool readView(View &view);
         uint32_t block() const
         {
             return m_block;
         }
+        /* First payload block, metadata block when contents are
+         * inline or empty. Reading many files in its order keeps
+         * the image read mostly sequential. */
+        uint32_t firstBlock();
+        /* Directory is removed only when empty */
         bool remove();
 
     protected:
         bool getCurrent();
+        bool fetchEntry();
+        uint32_t nextDataBlock();
+        bool mapBlocks(uint32_t count);
+        void readAhead(uint64_t offset, uint64_t got, uint32_t next);
+        void waitAhead()
+        {
+            if (m_ahead_pending > 0
+                && !m_fs->waitBlocks(m_ahead_req, m_ahead_pending)) {
+                m_ahead_count = 0;
+            }
+            m_ahead_pending = 0;
+        }
+        void resetAhead()
+        {
+            waitAhead();
+            m_ahead_count = 0;
+            m_ahead_window = 0;
+            m_ahead_next = 0;
+        }
+        void resetMap()
+        {
+            m_map_count = 0;
+            m_data_index = 0;
+            m_meta_block = 0;
+            m_extent_block = 0;
+            m_extent_left = 0;
+        }
+        void attach(ClothesFS *fs)
+        {
+            m_fs = fs;
+            if (m_fs != nullptr) {
+                m_hazard = m_fs->takeHazard();
+            }
+        }
+        void detach()
+        {
+            if (m_hazard != nullptr) {
+                m_fs->dropHazard(m_hazard);
+            }
+            m_hazard = nullptr;
+            m_fs = nullptr;
+        }
+        bool unlinkEntry();
+        bool checkPayload(const uint8_t *data) const;
+        uint32_t payloadSize();
+        void setContent(uint32_t block, const uint8_t *data, bool borrowed);
+
+        uint8_t *cloneBuffer(const uint8_t *src) const
+        {
+            uint8_t *res = m_fs->allocBlocks(1);
+            if (res != nullptr && src != nullptr) {
+                copyBuffer(res, src, m_fs->m_blocksize);
+            }
+            return res;
+        }
+        void releaseView()
+        {
+            if (m_view != nullptr) {
+                m_fs->releaseBlock(m_view);
+            }
+            m_view = nullptr;
+        }
+        void freeBuffers()
+        {
+            // Requests in flight still write to read-ahead buffer
+            resetAhead();
+            releaseView();
+            if (m_parent != nullptr) {
+                FilesystemPhys::freeBuffer(m_parent);
+            }
+            if (m_data != nullptr) {
+                FilesystemPhys::freeBuffer(m_data);
+            }
+            if (m_content != nullptr) {
+                FilesystemPhys::freeBuffer(m_content);
+            }
+            if (m_meta != nullptr) {
+                FilesystemPhys::freeBuffer(m_meta);
+            }
+            if (m_window != nullptr) {
+                FilesystemPhys::freeBuffer(m_window);
+            }
+            if (m_map != nullptr) {
+                delete[] m_map;
+            }
+            if (m_ahead != nullptr) {
+                FilesystemPhys::freeBuffer(m_ahead);
+            }
+            if (m_ahead_req != nullptr) {
+                delete[] m_ahead_req;
+            }
+            m_parent = nullptr;
+            m_data = nullptr;
+            m_content = nullptr;
+            m_meta = nullptr;
+            m_window = nullptr;
+            m_window_count = 0;
+            m_map = nullptr;
+            m_map_count = 0;
+            m_map_size = 0;
+            m_ahead = nullptr;
+            m_ahead_req = nullptr;
+        }
 
         bool m_ok;
+        // Listing is over, as opposed to stopped by an error
+        bool m_end;
         uint32_t m_block;
         uint32_t m_index;
-        uint64_t m_pos;
+        // File block index held in m_content or m_view
+        uint32_t m_content_index;
+        uint64_t m_offset;
         uint32_t m_data_block;
         uint32_t m_data_index;
+        uint32_t m_meta_block;
+        // Rest of current extent with MAP_EXTENTS
+        uint32_t m_extent_block;
+        uint32_t m_extent_left;
+        uint32_t m_parent_block;
+        // Head block of listed directory
+        uint32_t m_dir;
+        uint32_t m_window_parent;
+        uint32_t m_window_index;
+        uint32_t m_window_count;
+        uint32_t m_map_count;
+        uint32_t m_map_size;
+        uint32_t m_ahead_index;
+        uint32_t m_ahead_count;
+        uint32_t m_ahead_window;
+        uint32_t m_ahead_pending;
+        // End of previous read, next read starting here is sequential
+        uint64_t m_ahead_next;
+        // Data bytes in each payload block of the file, 0 until known
+        uint32_t m_payload;
+        // Removes seen when directory block was read
+        uint32_t m_unlinks;
 
         ClothesFS *m_fs;
+        Hazard *m_hazard;
         uint8_t *m_parent;
         uint8_t *m_data;
         uint8_t *m_content;
+        uint8_t *m_meta;
+        // Borrowed payload block, replaces m_content when set
+        const uint8_t *m_view;
+        // Entry metadata blocks fetched ahead in one request
+        uint8_t *m_window;
+        // Payload blocks of the file in order, extended on demand
+        uint32_t *m_map;
+        // Blocks m_ahead_index onwards read ahead, requests may be in flight
+        uint8_t *m_ahead;
+        FilesystemPhysRequest *m_ahead_req;
+    };
+
+    /* Streams a new file into directory parent. Blocks are allocated
+     * as contents arrive, tail metadata block is kept in memory.
+     * Size is written and entry linked on close(), which destructor
+     * calls if needed. Failed file is never linked, its blocks are
+     * freed. */
+    class Writer {
+        friend class ClothesFS;
+    public:
+        Writer(
+            ClothesFS *fs,
+            uint32_t parent,
+            const char *name,
+            uint8_t mapping = MAP_BLOCKS);
+        ~Writer();
+
+        /* Takes one contiguous run for size bytes of contents up
+         * front, payload fills it before other blocks are taken.
+         * Unused part is freed on close(). */
+        bool reserve(uint64_t size);
+        bool write(const uint8_t *buf, uint64_t cnt);
+        bool close();
+        inline bool ok() const
+        {
+            return m_ok;
+        }
+        uint32_t block() const
+        {
+            return m_meta;
+        }
+        uint64_t size() const
+        {
+            return m_size;
+        }
+
+    protected:
+        Writer(const Writer &another);
+        Writer &operator=(const Writer &another);
+
+        bool open(uint32_t parent, const char *name);
+        bool flushBatch();
+        bool appendBlock(uint32_t block);
+        bool appendEntry(const uint32_t *words, uint32_t width);
+        bool writeInline();
+        void releasePlan();
+        void discard();
+
+        bool m_ok;
+        bool m_open;
+        uint8_t m_mapping;
+        uint8_t m_algo;
+        uint32_t m_parent;
+        uint32_t m_meta;
+        uint32_t m_tail;
+        uint32_t m_tail_pos;
+        uint32_t m_fill;
+        uint32_t m_pending;
+        uint32_t m_written;
+        uint32_t m_extent_start;
+        uint32_t m_extent_len;
+        // Allocation group payload is taken from
+        uint32_t m_group;
+        // Reserved run not filled yet
+        uint32_t m_plan_start;
+        uint32_t m_plan_len;
+        uint64_t m_size;
+
+        ClothesFS *m_fs;
+        // Entry name, linked to parent on close()
+        char *m_name;
+        // Last metadata block of the file, entries are appended here
+        uint8_t *m_tailbuf;
+        // Filled payload blocks waiting for allocation, last one partial
+        uint8_t *m_batch;
     };
 
     ClothesFS();
     ~ClothesFS();
 
     void setPhysical(FilesystemPhys *phys);
+    /* Cache budget in bytes, zero disables cache */
+    void setCache(uint64_t budget, BlockCache::Mode mode);
+    /* Number of cached directory entries, zero disables cache */
+    void setDentryCache(uint32_t slots);
+    /* Checksum algorithms of new payload blocks, ALGO_* mask */
+    bool setChecksum(uint8_t algo);
+    /* Log metadata updates through journal, areas are allocated on
+     * first use. Updates are committed in groups, on sync() or when
+     * journal fills up. */
+    bool enableJournal();
+    inline const Journal *journal() const
+    {
+        return m_journal;
+    }
+    /* Writes open transaction to journal but not its blocks in place,
+     * as a crash right after commit leaves it. For checking recovery,
+     * process has to stop without touching the volume again. */
+    bool commitWithoutCheckpoint();
+    bool sync();
     inline uint32_t blockSize() const
     {
         return m_blocksize;
@@ -201,44 +660,271 @@ public:
     static uint32_t dataToNum(uint8_t *buf, int start, int cnt);
     static void numToData(uint64_t num, uint8_t *buf, int start, int cnt);
     bool detect();
-    bool format(const char *volid);
+    bool format(const char *volid, uint8_t flags = FLAG_NONE);
+    bool convertToBitmap();
     bool addFile(
         uint32_t parent,
         const char *name,
         const char *contents,
-        uint64_t size);
+        uint64_t size,
+        uint8_t mapping = MAP_BLOCKS);
     bool addDir(
         uint32_t parent,
-        const char *name);
+        const char *name,
+        uint8_t layout = DIR_LINEAR);
     ClothesFS::Iterator list(
         uint32_t parent);
+    /* Iterator on entry block of directory parent, block found
+     * earlier by list() or find() after unlinkCount() was since.
+     * Not ok() when entry is gone. Entry is looked up again only
+     * if something was removed meanwhile, next() ends listing. */
+    ClothesFS::Iterator open(
+        uint32_t parent,
+        uint32_t block,
+        uint32_t since);
+    /* Number of entries removed so far, wraps around */
+    inline uint32_t unlinkCount() const
+    {
+        return m_unlinks.get();
+    }
+    /* Block of entry called name in directory parent, 0 if none */
+    uint32_t find(
+        uint32_t parent,
+        const char *name);
+    /* Block of entry at absolute path like "/a/b", 0 if none */
+    uint32_t lookup(const char *path);
+    bool stat(const char *path, Stat *st);
 
 protected:
+    /* Range of blocks allocated under own lock. Ranges start at byte
+     * boundary of bitmap, neighbouring groups may share bitmap block. */
+    struct AllocGroup {
+        Mutex lock;
+        uint32_t start;
+        uint32_t end;
+        // Search for next allocation starts here
+        uint32_t hint;
+        uint32_t free;
+    };
+
+    /* Holds allocation group. With journal bitmap changes are logged,
+     * so meta lock is taken first. */
+    class GroupGuard
+    {
+    public:
+        GroupGuard(ClothesFS *fs, uint32_t group);
+        ~GroupGuard();
+
+    protected:
+        GroupGuard(const GroupGuard &another);
+        GroupGuard &operator=(const GroupGuard &another);
+
+        ClothesFS *m_fs;
+        Mutex &m_lock;
+        bool m_meta;
+    };
+
+    bool loadSuper();
+    bool flushSuper();
     uint32_t takeFreeBlock();
+    uint32_t takeFreeRun(uint32_t want, uint32_t *start, uint32_t group);
+    uint32_t takeFreeBlocks(uint32_t count, uint32_t *blocks, uint32_t group);
+    /* Group of calling thread */
+    inline uint32_t allocGroup() const
+    {
+        return m_group_count > 0 ? threadSlot() % m_group_count : 0;
+    }
+    inline uint32_t groupOf(uint32_t block) const
+    {
+        return block / m_group_blocks;
+    }
+    uint32_t findGroupRun(uint32_t group, uint32_t want, uint32_t *start) const;
+    uint32_t takeGroupRun(uint32_t group, uint32_t want, uint32_t *start);
+    bool claimRun(uint32_t start, uint32_t len);
+    void countUsed(int32_t delta);
+    uint32_t bitmapSize() const;
+    void allocBitmap();
+    void freeBitmap();
+    void countBitmap();
+    bool initBitmap(uint32_t start);
+    bool loadBitmap(uint32_t start);
+    bool flushBitmap();
+    bool bitmapTest(uint32_t block) const;
+    bool bitmapSet(uint32_t block, bool used);
+    uint32_t bitmapFind(uint32_t from, uint32_t end) const;
     bool addFreeBlock(uint32_t id);
+    bool pushFreeBlock(uint32_t id);
     bool formatBlock(uint32_t num, uint32_t next);
     uint32_t formatBlocks();
+    inline RwLock &nodeLock(uint32_t block)
+    {
+        return m_node_locks[block % NODE_LOCKS];
+    }
+    Hazard *takeHazard();
+    void dropHazard(Hazard *hazard);
+    bool hazardHeld(uint32_t node) const;
+    bool freeNodeBlock(uint32_t id, uint32_t node);
+    void releaseRetired();
+
     bool getBlock(uint32_t index, uint8_t *buffer);
     bool putBlock(uint32_t index, uint8_t *buffer);
+    bool getBlocks(uint32_t index, uint32_t count, uint8_t *buffer);
+    bool putBlocks(uint32_t index, uint32_t count, uint8_t *buffer);
+    bool storeBlocks(uint32_t index, uint32_t count, uint8_t *buffer);
+    const uint8_t *borrowBlock(uint32_t index);
+    void releaseBlock(const uint8_t *buffer);
+    const uint8_t *pinBlock(uint32_t index);
+    void unpinBlock(uint32_t index, const uint8_t *buffer);
+    /* Read-only look at a block, pinned or borrowed when possible and
+     * copied to buffer otherwise. Caller's node lock keeps writers out
+     * while the view is held. */
+    const uint8_t *viewBlock(uint32_t index, uint8_t *buffer);
+    void dropView(uint32_t index, const uint8_t *view, const uint8_t *buffer);
+    bool getBlockList(const uint32_t *indices, uint32_t count, uint8_t *buffer);
+    /* Payload is not logged, it goes in place before the commit
+     * of metadata pointing to it */
+    bool putBlockList(
+        const uint32_t *indices,
+        uint32_t count,
+        uint8_t *buffer,
+        bool logged = true);
+    bool storeBlockList(
+        const uint32_t *indices,
+        uint32_t count,
+        uint8_t *buffer);
+    bool prefetchBlocks(
+        const uint32_t *indices,
+        uint32_t count,
+        uint8_t *buffer,
+        FilesystemPhysRequest *req,
+        uint32_t *pending);
+    bool waitBlocks(FilesystemPhysRequest *req, uint32_t count);
+    uint32_t blockRuns(
+        const uint32_t *indices,
+        uint32_t count,
+        uint8_t *buffer,
+        FilesystemPhysVec *vec);
     void clearBuffer(uint8_t *buf, uint32_t size);
+    /* Blocks for transfers, aligned so backend needs no copy */
+    uint8_t *allocBlocks(uint32_t count) const;
+    static void copyBuffer(uint8_t *dst, const uint8_t *src, uint32_t size);
 
     bool initMeta(uint32_t index,uint8_t type);
-    uint32_t initData(uint32_t index, uint8_t type, uint8_t algo);
+    uint32_t initData(uint8_t *data, uint8_t type, uint8_t algo);
+    uint32_t dataStart(uint8_t algo) const;
+    void sealData(uint8_t *data);
+    bool verifyData(const uint8_t *data) const;
     bool addToMeta(uint32_t index, uint32_t meta, uint8_t type);
-    bool dirContinues(uint32_t index, uint32_t next);
-    bool addData(uint32_t meta, const char *contents, uint64_t size);
+    bool addToMetaList(
+        uint32_t index,
+        const uint32_t *metas,
+        uint32_t count,
+        uint8_t type,
+        uint32_t width = 1);
+    bool removeFromMeta(uint32_t index, uint32_t meta, uint32_t width = 1);
+    bool addData(
+        uint32_t meta,
+        const char *contents,
+        uint64_t size,
+        uint8_t mapping);
     bool updateMeta(uint32_t index, const uint8_t *name, uint64_t size);
+    bool addEntry(uint32_t parent, uint32_t meta, const char *name);
+    void discardChain(
+        uint32_t block,
+        uint32_t width,
+        uint8_t *buffer,
+        uint32_t tail = 0,
+        const uint8_t *tail_data = nullptr,
+        uint32_t tail_end = 0);
+    uint32_t findEntry(
+        uint32_t parent,
+        const char *name);
+    uint32_t lookupEntry(
+        uint32_t parent,
+        const char *name,
+        uint32_t len,
+        uint8_t *type);
+
+    static uint32_t nameHash(const uint8_t *name, uint32_t len);
+    bool sameName(const uint8_t *data, const char *name) const;
+    uint32_t dirIndex(uint32_t dir);
+    bool initIndex(uint32_t dir);
+    bool indexAdd(uint32_t index, uint32_t meta, const char *name);
+    bool indexRemove(uint32_t index, uint32_t meta, const uint8_t *data);
+    uint32_t indexFind(uint32_t index, const char *name);
+    void freeIndex(uint32_t index);
 
     uint8_t baseType(uint8_t type) const;
+    uint32_t entryStart(const uint8_t *data) const;
     bool validType(uint8_t type, uint8_t valid) const;
 
+    bool journalHas(uint32_t index);
+    uint64_t journalCommits();
+    bool overlayJournal(
+        uint32_t index,
+        const uint32_t *indices,
+        uint32_t count,
+        uint8_t *buffer,
+        uint64_t *commits);
+    bool logBlock(uint32_t index, const uint8_t *buffer);
+    bool revokeBlock(uint32_t index);
+    bool writeJournal();
+    bool commitJournal();
+    bool endUpdate(bool res);
+    bool openJournal(uint32_t area1, uint32_t area2);
+    void dropJournal();
+
     bool verifySectorSize() const;
+    void dropCache(bool discard);
+    void resetCache();
 
     FilesystemPhys *m_phys;
     uint32_t m_blocksize;
     uint32_t m_blocks;
-    uint32_t m_freechain;
     uint32_t m_block_in_sectors;
+
+    // Resident copy of header, written back by flushSuper()
+    uint32_t m_freechain;
+    uint32_t m_root;
+    uint32_t m_used;
+    uint32_t m_journal1;
+    uint32_t m_journal2;
+    bool m_super_dirty;
+    uint8_t m_flags;
+    // First never used block with FLAG_LAZY
+    uint32_t m_untouched;
+
+    // Allocation bitmap, resident when FLAG_BITMAP is set
+    uint8_t *m_bitmap;
+    bool *m_bitmap_dirty;
+    uint32_t *m_bitmap_free;
+    uint32_t m_bitmap_start;
+    uint32_t m_bitmap_blocks;
+    AllocGroup *m_groups;
+    uint32_t m_group_count;
+    uint32_t m_group_blocks;
+
+    BlockCache *m_cache;
+    uint64_t m_cache_budget;
+    BlockCache::Mode m_cache_mode;
+    DentryCache *m_dentry;
+    uint8_t m_algo;
+    // Open transaction when journal areas exist
+    Journal *m_journal;
+
+    // Guards allocator, header and journal
+    Mutex m_meta_lock;
+    RwLock m_node_locks[NODE_LOCKS];
+    // Guards hazards and retired blocks
+    Mutex m_hazard_lock;
+    Hazard *m_hazards;
+    // Bumped by each remove, Iterator reads its directory block again
+    // when it changed since
+    AtomicWord m_unlinks;
+    // Pairs of block and node it belonged to
+    uint32_t *m_retired;
+    uint32_t m_retired_count;
+    uint32_t m_retired_size;
 };
 
 #endif
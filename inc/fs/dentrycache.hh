@@ -0,0 +1,79 @@
+#ifndef __DENTRYCACHE_HH
+#define __DENTRYCACHE_HH
+
+#ifdef LINUX_BUILD
+#include <stdint.h>
+#include <stddef.h>
+#else
+#include <platform.h>
+#endif
+
+#include <fs/lock.hh>
+
+/* Cache of directory entries, maps (parent block, name) to entry block.
+ * Block zero is a negative entry, name is known to be missing.
+ * Direct mapped, colliding names replace each other.
+ * Names longer than NAME_LEN are not cached. Calls are serialized
+ * by an internal lock. */
+class DentryCache
+{
+public:
+    static const uint32_t NAME_LEN = 60;
+
+    DentryCache(uint32_t slots);
+    ~DentryCache();
+
+    bool find(
+        uint32_t parent,
+        const char *name,
+        uint32_t len,
+        uint32_t *block,
+        uint8_t *type);
+    void insert(
+        uint32_t parent,
+        const char *name,
+        uint32_t len,
+        uint32_t block,
+        uint8_t type);
+    void remove(uint32_t parent, const char *name, uint32_t len);
+    void invalidate();
+
+    inline uint32_t slots() const
+    {
+        return m_slots;
+    }
+    inline uint64_t hits() const
+    {
+        return m_hits;
+    }
+    inline uint64_t misses() const
+    {
+        return m_misses;
+    }
+
+protected:
+    struct Entry {
+        bool valid;
+        uint8_t type;
+        uint8_t len;
+        uint32_t parent;
+        uint32_t block;
+        char name[NAME_LEN];
+    };
+
+    uint32_t slot(uint32_t parent, const char *name, uint32_t len) const;
+    bool match(
+        const Entry &entry,
+        uint32_t parent,
+        const char *name,
+        uint32_t len) const;
+
+    Mutex m_lock;
+    uint32_t m_slots;
+    Entry *m_entries;
+
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
+
+#endif
@@ -2,25 +2,29 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <string>
 
 class FATPhys
 {
 public:
-    FATPhys(std::string fname, uint32_t maxsize)
+    FATPhys(std::string fname, uint64_t maxsize)
     {
-        m_fp = fopen(fname.c_str(), "r+");
-        int res = fseek(m_fp, 0, SEEK_END);
-        if (res == 0) {
-            m_size = ftell(m_fp);
+        m_fd = open(fname.c_str(), O_RDWR);
+        struct stat st;
+        if (m_fd >= 0 && fstat(m_fd, &st) == 0) {
+            m_size = st.st_size;
         } else {
             m_size = maxsize;
         }
     }
     ~FATPhys()
     {
-        fclose(m_fp);
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
     }
 
     bool read(
@@ -29,21 +33,14 @@ public:
         uint32_t pos,
         uint32_t pos_hi)
     {
-        if (pos >= m_size) {
+        uint64_t start = ((uint64_t)pos_hi << 32) | pos;
+        uint64_t len = (uint64_t)sectors * sectorSize();
+        if (m_fd < 0 || start >= m_size || len > m_size - start) {
             return false;
         }
 
-        for (uint32_t i = 0; i < sectorSize(); ++i) {
-            buffer[i] = 0;
-        }
-
-        int res = fseek(m_fp, pos, SEEK_SET);
-        if (res == 0) {
-            res = fread(buffer, 1, sectorSize(), m_fp);
-            if (res != (int)sectorSize()) return false;
-        } else {
-            return false;
-        }
+        ssize_t res = pread(m_fd, buffer, len, start);
+        if (res != (ssize_t)len) return false;
         return true;
     }
 
@@ -53,18 +50,18 @@ public:
         uint32_t pos,
         uint32_t pos_hi)
     {
-        if (pos >= m_size) {
+        uint64_t start = ((uint64_t)pos_hi << 32) | pos;
+        uint64_t len = (uint64_t)sectors * sectorSize();
+        if (m_fd < 0 || start >= m_size || len > m_size - start) {
             return false;
         }
-        int res = fseek(m_fp, pos, SEEK_SET);
 
-        if (res == 0) {
-            res = fwrite(buffer, 1, sectorSize(), m_fp);
-        }
+        ssize_t res = pwrite(m_fd, buffer, len, start);
+        if (res != (ssize_t)len) return false;
         return true;
     }
 
-    uint32_t size()
+    uint64_t size()
     {
         return m_size;
     }
@@ -75,8 +72,8 @@ public:
     }
 
 protected:
-    FILE *m_fp;
-    uint32_t m_size;
+    int m_fd;
+    uint64_t m_size;
 };
 
 class FATInfo
@@ -161,6 +158,7 @@ protected:
     bool parseBootRecord(uint8_t *buf);
     uint32_t sectorSize();
     uint32_t solveSector(uint32_t relative_cluster);
+    bool readSector(uint32_t sector, uint8_t *data);
 
     std::string m_identifier;
     std::string m_label;
@@ -0,0 +1,75 @@
+#ifndef __FILE_PHYS_HH
+#define __FILE_PHYS_HH
+
+#include "fs/filesystem.hh"
+#include "fs/lock.hh"
+#include <string>
+#include <stdint.h>
+
+/* Image file accessed with positional pread/pwrite. In direct mode
+ * file is opened with O_DIRECT, so transfers bypass page cache.
+ * Alignment comes from the device, buffers from allocBuffer() meet
+ * it. Other transfers go through a bounce buffer of their own, a
+ * partial write of a device block holds a lock on that block. */
+class FilePhys : public FilesystemPhys
+{
+public:
+    FilePhys(std::string fname, uint64_t maxsize, bool direct = false);
+    ~FilePhys();
+
+    inline bool ok() const
+    {
+        return m_fd >= 0;
+    }
+    inline bool direct() const
+    {
+        return m_direct;
+    }
+
+    virtual bool read(
+        uint8_t *buffer,
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual bool write(
+        uint8_t *buffer,
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual bool sync();
+
+    virtual uint64_t size() const
+    {
+        return m_size;
+    }
+
+    virtual uint32_t sectorSize() const
+    {
+        return 512;
+    }
+
+    virtual uint32_t alignment() const
+    {
+        return m_direct ? m_mem_align : 1;
+    }
+
+protected:
+    bool readAt(uint8_t *buffer, uint64_t len, uint64_t pos);
+    bool writeAt(const uint8_t *buffer, uint64_t len, uint64_t pos);
+    bool bounceRead(uint8_t *buffer, uint64_t len, uint64_t pos);
+    bool bounceWrite(const uint8_t *buffer, uint64_t len, uint64_t pos);
+    bool aligned(const uint8_t *buffer, uint64_t len, uint64_t pos) const;
+    void probeAlign();
+
+    // Partial writes of device blocks hashing here are serialized
+    static const uint32_t EDGE_LOCKS = 64;
+
+    int m_fd;
+    bool m_direct;
+    uint64_t m_size;
+    uint32_t m_mem_align;
+    uint32_t m_offset_align;
+    Mutex m_edge_locks[EDGE_LOCKS];
+};
+
+#endif
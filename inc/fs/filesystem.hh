@@ -2,10 +2,41 @@
 #define __FILESYSTEM_PHYS_HH
 
 #include <stdint.h>
+#ifdef LINUX_BUILD
+#include <stdlib.h>
+#endif
+
+struct FilesystemPhysVec
+{
+    uint8_t *buffer;
+    uint32_t sectors;
+    uint32_t pos;
+    uint32_t pos_hi;
+};
+
+struct FilesystemPhysRequest
+{
+    FilesystemPhysVec vec;
+    bool write;
+    bool done;
+    bool ok;
+    // Bytes moved so far, backend keeps it while a request is split
+    uint64_t moved;
+
+    /* Another thread reaping completions may set done */
+    inline bool finished() const
+    {
+        return __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+    }
+};
 
 class FilesystemPhys
 {
 public:
+    virtual ~FilesystemPhys() {}
+
+    /* Transfer 'sectors' contiguous sectors starting at byte
+     * position pos/pos_hi */
     virtual bool read(
         uint8_t *buffer,
         uint32_t sectors,
@@ -17,8 +48,117 @@ public:
         uint32_t pos,
         uint32_t pos_hi) = 0;
 
+    /* Scatter/gather variants, override when backend can do
+     * several ranges in one request */
+    virtual bool readv(
+        const FilesystemPhysVec *vec,
+        uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!read(vec[i].buffer, vec[i].sectors,
+                    vec[i].pos, vec[i].pos_hi)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    virtual bool writev(
+        const FilesystemPhysVec *vec,
+        uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!write(vec[i].buffer, vec[i].sectors,
+                    vec[i].pos, vec[i].pos_hi)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Asynchronous interface. Queue requests with submit() and
+     * reap them with complete(), which waits until at least min_done
+     * requests have finished and returns number of finished ones.
+     * Result of each request is in its ok field once done is set.
+     * Completions of any thread's requests may be reaped by any call.
+     * Default runs requests synchronously on submit. */
+    virtual bool submit(
+        FilesystemPhysRequest *req,
+        uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (req[i].write) {
+                req[i].ok = write(req[i].vec.buffer, req[i].vec.sectors,
+                    req[i].vec.pos, req[i].vec.pos_hi);
+            } else {
+                req[i].ok = read(req[i].vec.buffer, req[i].vec.sectors,
+                    req[i].vec.pos, req[i].vec.pos_hi);
+            }
+            req[i].done = true;
+        }
+        return true;
+    }
+    virtual uint32_t complete(uint32_t min_done)
+    {
+        return 0;
+    }
+    virtual uint32_t pending() const
+    {
+        return 0;
+    }
+
+    /* Pointer to backend memory holding 'sectors' sectors at pos,
+     * or nullptr when backend can't lend it. Valid until release() */
+    virtual uint8_t *borrow(
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi)
+    {
+        return nullptr;
+    }
+    virtual void release(uint8_t *buffer)
+    {
+    }
+
+    /* Flush written data to backing store */
+    virtual bool sync()
+    {
+        return true;
+    }
+
     virtual uint64_t size() const = 0;
     virtual uint32_t sectorSize() const = 0;
+
+    /* Buffers at this alignment are transferred without a copy */
+    virtual uint32_t alignment() const
+    {
+        return 1;
+    }
+    /* Memory for transfers, aligned for this backend. Released with
+     * freeBuffer(), nullptr when out of memory. */
+    uint8_t *allocBuffer(uint64_t size) const
+    {
+#ifdef LINUX_BUILD
+        void *buf = nullptr;
+        uint32_t align = alignment();
+        if (align < sizeof(void*)) {
+            align = sizeof(void*);
+        }
+        if (posix_memalign(&buf, align, size) != 0) {
+            return nullptr;
+        }
+        return (uint8_t*)buf;
+#else
+        return new uint8_t[size];
+#endif
+    }
+    static void freeBuffer(uint8_t *buffer)
+    {
+#ifdef LINUX_BUILD
+        free(buffer);
+#else
+        delete[] buffer;
+#endif
+    }
 };
 
 #endif
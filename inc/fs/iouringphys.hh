@@ -0,0 +1,120 @@
+#ifndef __IOURING_PHYS_HH
+#define __IOURING_PHYS_HH
+
+#include "fs/filesystem.hh"
+#include "fs/lock.hh"
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* Positional I/O through io_uring. Requests are queued to the
+ * submission ring and handed to kernel with one system call per
+ * batch, up to queue depth requests are kept in flight.
+ * Submission and completion rings have their own locks, neither is
+ * held while sleeping in kernel, so submits go on during a wait. */
+class IoUringPhys : public FilesystemPhys
+{
+public:
+    IoUringPhys(
+        std::string fname,
+        uint64_t maxsize,
+        uint32_t depth = 64);
+    ~IoUringPhys();
+
+    inline bool ok() const
+    {
+        return m_ring_fd >= 0;
+    }
+    inline uint32_t depth() const
+    {
+        return m_depth;
+    }
+
+    virtual bool read(
+        uint8_t *buffer,
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual bool write(
+        uint8_t *buffer,
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual bool readv(
+        const FilesystemPhysVec *vec,
+        uint32_t count);
+    virtual bool writev(
+        const FilesystemPhysVec *vec,
+        uint32_t count);
+
+    virtual bool submit(
+        FilesystemPhysRequest *req,
+        uint32_t count);
+    virtual uint32_t complete(uint32_t min_done);
+    virtual uint32_t pending() const
+    {
+        return __atomic_load_n(&m_outstanding, __ATOMIC_ACQUIRE);
+    }
+    virtual bool sync();
+
+    virtual uint64_t size() const
+    {
+        return m_size;
+    }
+
+    virtual uint32_t sectorSize() const
+    {
+        return 512;
+    }
+
+protected:
+    bool setup();
+    bool flush();
+    bool wait();
+    void queue(FilesystemPhysRequest *req);
+    uint32_t reap();
+    bool transfer(
+        const FilesystemPhysVec *vec,
+        uint32_t count,
+        bool write);
+
+    int m_fd;
+    int m_ring_fd;
+    uint32_t m_depth;
+    uint64_t m_size;
+
+    // Submission ring and entries not yet handed to kernel
+    Mutex m_sq_lock;
+    uint32_t m_queued;
+    // Submitted requests not finished, atomic
+    uint32_t m_outstanding;
+
+    // Completion ring, count of finished requests and a thread in kernel
+    pthread_mutex_t m_cq_lock;
+    pthread_cond_t m_cq_cond;
+    uint32_t m_completed;
+    bool m_waiting;
+    // Failed system calls, atomic
+    uint32_t m_failures;
+
+    uint8_t *m_sq_ring;
+    uint8_t *m_cq_ring;
+    size_t m_sq_ring_size;
+    size_t m_cq_ring_size;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+
+    uint32_t *m_sq_head;
+    uint32_t *m_sq_tail;
+    uint32_t *m_sq_mask;
+    uint32_t *m_sq_array;
+    uint32_t *m_cq_head;
+    uint32_t *m_cq_tail;
+    uint32_t *m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef __JOURNAL_HH
+#define __JOURNAL_HH
+
+#ifdef LINUX_BUILD
+#include <stdint.h>
+#include <stddef.h>
+#else
+#include <platform.h>
+#endif
+
+#include <fs/filesystem.hh>
+
+/* Write-ahead log of metadata blocks. Blocks written by updates are
+ * held in an open transaction, which is committed as one sequential
+ * write of a descriptor and block images followed by a single flush.
+ * Two journal areas are used in turns, so at most the newest two
+ * transactions are replayed after a crash.
+ *
+ * Blocks written outside the journal are revoked, so images of them
+ * in the previous transaction are skipped on replay. Freed blocks are
+ * held back until the transaction releasing them is committed.
+ * Blocks taken from freechain in open transaction are tracked, their
+ * links are still needed if it never commits. */
+class Journal
+{
+public:
+    Journal(
+        FilesystemPhys *phys,
+        uint32_t blocksize,
+        uint32_t area1,
+        uint32_t area2);
+    ~Journal();
+
+    /* Blocks in each journal area */
+    static uint32_t areaBlocks(uint32_t blocksize);
+
+    /* Image of block in open transaction, false when full */
+    bool log(uint32_t index, const uint8_t *data);
+    bool contains(uint32_t index) const;
+    /* Copies logged images over blocks read from disk */
+    void overlay(uint32_t index, uint32_t count, uint8_t *data) const;
+    void overlayList(
+        const uint32_t *indices,
+        uint32_t count,
+        uint8_t *data) const;
+
+    /* Block is written in place directly. Drops its image and records
+     * revoke when previous transaction has it, false when full. */
+    bool revoke(uint32_t index);
+    bool needsRevoke(uint32_t index) const;
+
+    void noteTaken(uint32_t index);
+    bool taken(uint32_t index) const;
+
+    void deferFree(uint32_t index);
+    /* Next block waiting to be freed, 0 when none */
+    uint32_t takeFree();
+    inline uint32_t freeCount() const
+    {
+        return m_free_count;
+    }
+
+    /* Writes open transaction to next area and flushes it */
+    bool write();
+    /* Open transaction is in place, start next one */
+    void finish();
+    /* Writes committed transactions of both areas in place */
+    bool replay();
+    /* Marks both areas empty */
+    bool clear();
+
+    inline const uint32_t *blocks() const
+    {
+        return m_blocks;
+    }
+    inline const uint8_t *images() const
+    {
+        return m_buf + m_blocksize;
+    }
+    inline uint32_t count() const
+    {
+        return m_count;
+    }
+    inline bool empty() const
+    {
+        return m_count == 0 && m_revoked == 0;
+    }
+    /* Entries left in descriptor */
+    inline uint32_t room() const
+    {
+        return m_capacity - m_count - m_revoked;
+    }
+    /* Half full, or freed blocks would no longer be released by the
+     * same commit as the updates freeing them, good time to commit
+     * between updates. Release needs an entry per block at most. */
+    inline bool needsCommit() const
+    {
+        return room() <= m_capacity / 2 || 2 * m_free_count + 2 >= room();
+    }
+    inline uint32_t sequence() const
+    {
+        return m_seq;
+    }
+    inline uint64_t commits() const
+    {
+        return m_commits;
+    }
+
+protected:
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    uint32_t hash(uint32_t index) const;
+    uint32_t find(uint32_t index) const;
+    void hashRemove(uint32_t slot);
+    void remove(uint32_t slot);
+    uint32_t area(uint32_t seq) const;
+    bool load(uint32_t start, uint32_t *seq);
+    bool apply(
+        uint32_t start,
+        const uint32_t *skip,
+        uint32_t skip_count);
+    void setPrevious(const uint32_t *blocks, uint32_t count);
+
+    FilesystemPhys *m_phys;
+    uint32_t m_blocksize;
+    uint32_t m_block_in_sectors;
+    uint32_t m_area1;
+    uint32_t m_area2;
+    uint32_t m_capacity;
+    uint32_t m_buckets;
+
+    // Descriptor followed by images, written out as is
+    uint8_t *m_buf;
+    uint32_t *m_blocks;
+    uint32_t m_count;
+    uint32_t *m_hash_head;
+    uint32_t *m_hash_next;
+    uint32_t *m_revoke;
+    uint32_t m_revoked;
+
+    // Sorted blocks of last committed transaction
+    uint32_t *m_prev;
+    uint32_t m_prev_count;
+
+    uint32_t *m_free;
+    uint32_t m_free_count;
+    uint32_t m_free_size;
+
+    // Open addressed set of taken blocks, zero is empty slot
+    uint32_t *m_taken;
+    uint32_t m_taken_count;
+    uint32_t m_taken_size;
+
+    uint32_t m_seq;
+    uint64_t m_commits;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef __LOCK_HH
+#define __LOCK_HH
+
+#ifdef LINUX_BUILD
+#include <stdint.h>
+#include <pthread.h>
+#else
+#include <platform.h>
+#endif
+
+/* Recursive mutex. Without LINUX_BUILD there is a single thread
+ * and locking does nothing. */
+class Mutex
+{
+public:
+    Mutex()
+    {
+#ifdef LINUX_BUILD
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&m_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+#endif
+    }
+    ~Mutex()
+    {
+#ifdef LINUX_BUILD
+        pthread_mutex_destroy(&m_mutex);
+#endif
+    }
+
+    inline void lock()
+    {
+#ifdef LINUX_BUILD
+        pthread_mutex_lock(&m_mutex);
+#endif
+    }
+    inline void unlock()
+    {
+#ifdef LINUX_BUILD
+        pthread_mutex_unlock(&m_mutex);
+#endif
+    }
+
+protected:
+    Mutex(const Mutex &another);
+    Mutex &operator=(const Mutex &another);
+
+#ifdef LINUX_BUILD
+    pthread_mutex_t m_mutex;
+#endif
+};
+
+/* Shared/exclusive lock. Shared side may be taken recursively,
+ * exclusive side may not. */
+class RwLock
+{
+public:
+    RwLock()
+    {
+#ifdef LINUX_BUILD
+        pthread_rwlock_init(&m_lock, nullptr);
+#endif
+    }
+    ~RwLock()
+    {
+#ifdef LINUX_BUILD
+        pthread_rwlock_destroy(&m_lock);
+#endif
+    }
+
+    inline void lockShared()
+    {
+#ifdef LINUX_BUILD
+        pthread_rwlock_rdlock(&m_lock);
+#endif
+    }
+    inline void lock()
+    {
+#ifdef LINUX_BUILD
+        pthread_rwlock_wrlock(&m_lock);
+#endif
+    }
+    inline void unlock()
+    {
+#ifdef LINUX_BUILD
+        pthread_rwlock_unlock(&m_lock);
+#endif
+    }
+
+protected:
+    RwLock(const RwLock &another);
+    RwLock &operator=(const RwLock &another);
+
+#ifdef LINUX_BUILD
+    pthread_rwlock_t m_lock;
+#endif
+};
+
+/* Holds lock until end of scope */
+class MutexGuard
+{
+public:
+    MutexGuard(Mutex &mutex)
+        : m_mutex(mutex)
+    {
+        m_mutex.lock();
+    }
+    ~MutexGuard()
+    {
+        m_mutex.unlock();
+    }
+
+protected:
+    MutexGuard(const MutexGuard &another);
+    MutexGuard &operator=(const MutexGuard &another);
+
+    Mutex &m_mutex;
+};
+
+class SharedGuard
+{
+public:
+    SharedGuard(RwLock &lock)
+        : m_lock(lock)
+    {
+        m_lock.lockShared();
+    }
+    ~SharedGuard()
+    {
+        m_lock.unlock();
+    }
+
+protected:
+    SharedGuard(const SharedGuard &another);
+    SharedGuard &operator=(const SharedGuard &another);
+
+    RwLock &m_lock;
+};
+
+class ExclusiveGuard
+{
+public:
+    ExclusiveGuard(RwLock &lock)
+        : m_lock(lock)
+    {
+        m_lock.lock();
+    }
+    ~ExclusiveGuard()
+    {
+        m_lock.unlock();
+    }
+
+protected:
+    ExclusiveGuard(const ExclusiveGuard &another);
+    ExclusiveGuard &operator=(const ExclusiveGuard &another);
+
+    RwLock &m_lock;
+};
+
+/* Word read and updated without a lock. Accesses are sequentially
+ * consistent, so a store followed by a load of another word can't
+ * pass a store and load done in the other order by another thread. */
+class AtomicWord
+{
+public:
+    AtomicWord()
+        : m_value(0)
+    {
+    }
+
+    inline uint32_t get() const
+    {
+        return __atomic_load_n(&m_value, __ATOMIC_SEQ_CST);
+    }
+    inline void set(uint32_t value)
+    {
+        __atomic_store_n(&m_value, value, __ATOMIC_SEQ_CST);
+    }
+    /* Returns new value */
+    inline uint32_t inc()
+    {
+        return __atomic_add_fetch(&m_value, 1, __ATOMIC_SEQ_CST);
+    }
+
+protected:
+    AtomicWord(const AtomicWord &another);
+    AtomicWord &operator=(const AtomicWord &another);
+
+    uint32_t m_value;
+};
+
+/* Small number of calling thread, threads are numbered in order of
+ * their first call. Always 0 without LINUX_BUILD. */
+inline uint32_t threadSlot()
+{
+#ifdef LINUX_BUILD
+    static uint32_t next = 0;
+    static __thread uint32_t slot = 0;
+    if (slot == 0) {
+        slot = __atomic_add_fetch(&next, 1, __ATOMIC_RELAXED);
+    }
+    return slot - 1;
+#else
+    return 0;
+#endif
+}
+
+#endif
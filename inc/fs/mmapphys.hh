@@ -0,0 +1,60 @@
+#ifndef __MMAP_PHYS_HH
+#define __MMAP_PHYS_HH
+
+#include "fs/filesystem.hh"
+#include "fs/lock.hh"
+#include <string>
+#include <stdint.h>
+
+/* Maps whole image to memory. Reads and writes are plain copies,
+ * a write excludes reads so no copy sees half of it. borrow() lends
+ * pointers straight into the mapping. */
+class MmapPhys : public FilesystemPhys
+{
+public:
+    /* maxsize 0 uses current image size */
+    MmapPhys(std::string fname, uint64_t maxsize, bool readonly = false);
+    ~MmapPhys();
+
+    inline bool ok() const
+    {
+        return m_map != nullptr;
+    }
+
+    virtual bool read(
+        uint8_t *buffer,
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual bool write(
+        uint8_t *buffer,
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual uint8_t *borrow(
+        uint32_t sectors,
+        uint32_t pos,
+        uint32_t pos_hi);
+    virtual bool sync();
+
+    virtual uint64_t size() const
+    {
+        return m_size;
+    }
+
+    virtual uint32_t sectorSize() const
+    {
+        return 512;
+    }
+
+protected:
+    uint8_t *range(uint32_t sectors, uint32_t pos, uint32_t pos_hi) const;
+
+    RwLock m_lock;
+    int m_fd;
+    bool m_readonly;
+    uint8_t *m_map;
+    uint64_t m_size;
+};
+
+#endif
@@ -1,86 +1,48 @@
 #include "fs/filesystem.hh"
 #include "fs/clothesfs.hh"
+#include "fs/filephys.hh"
+#include "fs/mmapphys.hh"
+#ifdef HAVE_IO_URING
+#include "fs/iouringphys.hh"
+#endif
 #include <string>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 
-class FilePhys : public FilesystemPhys
+int main(int argc, char **argv)
 {
-public:
-    FilePhys(std::string fname, uint32_t maxsize)
-    {
-        m_fp = fopen(fname.c_str(), "r+");
-        if (m_fp == NULL) {
-            m_fp = fopen(fname.c_str(), "w+");
-        }
-        m_size = maxsize;
-    }
-    ~FilePhys()
-    {
-        fclose(m_fp);
-    }
-
-    virtual bool read(
-        uint8_t *buffer,
-        uint32_t sectors,
-        uint32_t pos,
-        uint32_t pos_hi)
-    {
-        if (pos >= m_size) {
-            return false;
-        }
-        int res = fseek(m_fp, pos, SEEK_SET);
-
-        for (uint32_t i = 0; i < sectorSize(); ++i) {
-            buffer[i] = 0;
-        }
-
-        if (res == 0) {
-            res = fread(buffer, 1, sectorSize(), m_fp);
-        }
-        return true;
-    }
-
-    virtual bool write(
-        uint8_t *buffer,
-        uint32_t sectors,
-        uint32_t pos,
-        uint32_t pos_hi)
-    {
-        if (pos >= m_size) {
-            return false;
-        }
-        int res = fseek(m_fp, pos, SEEK_SET);
-
-        if (res == 0) {
-            res = fwrite(buffer, 1, sectorSize(), m_fp);
+    FilesystemPhys *phys;
+    if (argc > 1 && strcmp(argv[1], "--mmap") == 0) {
+        phys = new MmapPhys("test.img", 1024 * 1024);
+#ifdef HAVE_IO_URING
+    } else if (argc > 1 && strcmp(argv[1], "--uring") == 0) {
+        IoUringPhys *uring = new IoUringPhys("test.img", 1024 * 1024);
+        if (uring->ok()) {
+            phys = uring;
+        } else {
+            // Kernel without io_uring or ring limits reached
+            printf("Can't set up io_uring, using plain file I/O\n");
+            delete uring;
+            phys = new FilePhys("test.img", 1024 * 1024);
         }
-        return true;
-    }
-
-    virtual uint64_t size() const
-    {
-        return m_size;
-    }
-
-    virtual uint32_t sectorSize() const
-    {
-        return 512;
+#endif
+    } else if (argc > 1 && strcmp(argv[1], "--direct") == 0) {
+        phys = new FilePhys("test.img", 1024 * 1024, true);
+    } else {
+        phys = new FilePhys("test.img", 1024 * 1024);
     }
 
-protected:
-    FILE *m_fp;
-    uint32_t m_size;
-};
-
-int main(int argc, char **argv)
-{
-    FilePhys phys("test.img", 1024 * 1024);
-
     ClothesFS cloth;
-    cloth.setPhysical(&phys);
+    cloth.setPhysical(phys);
+    cloth.setCache(256 * 1024, BlockCache::WRITE_BACK);
     cloth.format("My impressive volume");
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--journal") == 0 && !cloth.enableJournal()) {
+            printf("Can't enable journal\n");
+        }
+    }
 
     const char *data = "This is\ntest file\n with contents...\n";
     bool res = cloth.addFile(1, "test", data, strlen(data));
@@ -90,19 +52,18 @@ int main(int argc, char **argv)
 
     FILE *tmpf = fopen("test.md", "r");
     if (tmpf != NULL) {
-        fseek(tmpf, 0L, SEEK_END);
-        long size = ftell(tmpf);
-        fseek(tmpf, 0L, SEEK_SET);
-
-        char *fdata = (char*)malloc(size);
-        size_t cnt = fread(fdata, 1, size, tmpf);
+        ClothesFS::Writer writer(&cloth, 1, "test.md");
+        uint8_t fdata[4096];
+        size_t cnt;
+        while ((cnt = fread(fdata, 1, sizeof(fdata), tmpf)) > 0) {
+            writer.write(fdata, cnt);
+        }
         fclose(tmpf);
-        res = cloth.addFile(1, "test.md", fdata, cnt);
-        free(fdata);
+        res = writer.close();
     }
 
     cloth.addDir(1, "folder");
-    res = cloth.addFile(4, "fileinfolder", "data42.", 7);
+    res = cloth.addFile(cloth.lookup("/folder"), "fileinfolder", "data42.", 7);
 
     printf("ok: %d %d\n", cloth.detect(), res);
 
@@ -150,4 +111,7 @@ int main(int argc, char **argv)
 #endif
         if (!iter.next()) break;
     }
+
+    cloth.sync();
+    delete phys;
 }
@@ -0,0 +1,386 @@
+#include "fs/clothesfs.hh"
+#include "fs/filephys.hh"
+#include "fs/mmapphys.hh"
+#ifdef HAVE_IO_URING
+#include "fs/iouringphys.hh"
+#endif
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Host file is read in pieces of this many bytes
+static const uint32_t READ_CHUNK = 1024 * 1024;
+// Files are handed to readers in runs of about this many bytes
+static const uint64_t PLAN_CHUNK = 8 * 1024 * 1024;
+// Directories with more entries than this get a hash index
+static const uint32_t HASHED_DIR_MIN = 64;
+
+enum Backend {
+    BACKEND_FILE,
+    BACKEND_DIRECT,
+    BACKEND_MMAP,
+    BACKEND_URING
+};
+
+struct Entry {
+    std::string path;
+    std::string name;
+    // Index of parent directory entry, root has none
+    uint32_t parent;
+    bool dir;
+    uint64_t size;
+    uint32_t children;
+    // Metadata block of created directory
+    uint32_t block;
+};
+
+struct Import {
+    ClothesFS *fs;
+    std::vector<Entry> entries;
+    // Entry indices of files, in order they are laid out
+    std::vector<uint32_t> files;
+    // Runs of files handed out together, start index in files
+    std::vector<uint32_t> runs;
+    uint32_t next_run;
+    uint32_t failed;
+    uint64_t bytes;
+};
+
+static bool walk(Import *imp, uint32_t dir)
+{
+    DIR *host = opendir(imp->entries[dir].path.c_str());
+    if (host == nullptr) {
+        printf("Can't open %s\n", imp->entries[dir].path.c_str());
+        return false;
+    }
+
+    // Files of a directory first, so they end up next to each other
+    std::vector<uint32_t> subdirs;
+    struct dirent *ent;
+    while ((ent = readdir(host)) != nullptr) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        Entry entry;
+        entry.path = imp->entries[dir].path + "/" + ent->d_name;
+        entry.name = ent->d_name;
+        entry.parent = dir;
+        entry.children = 0;
+        entry.block = 0;
+
+        struct stat st;
+        if (lstat(entry.path.c_str(), &st) != 0) {
+            printf("Can't stat %s\n", entry.path.c_str());
+            ++imp->failed;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            entry.dir = true;
+            entry.size = 0;
+        } else if (S_ISREG(st.st_mode)) {
+            entry.dir = false;
+            entry.size = st.st_size;
+        } else {
+            printf("Skipping %s, not a file or directory\n", entry.path.c_str());
+            continue;
+        }
+
+        imp->entries.push_back(entry);
+        ++imp->entries[dir].children;
+        if (entry.dir) {
+            subdirs.push_back(imp->entries.size() - 1);
+        } else {
+            imp->files.push_back(imp->entries.size() - 1);
+        }
+    }
+    closedir(host);
+
+    for (size_t i = 0; i < subdirs.size(); ++i) {
+        if (!walk(imp, subdirs[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Volume size that holds the tree, with room for metadata and
+ * allocation groups that don't fill up evenly */
+static uint64_t planSize(const Import &imp)
+{
+    uint64_t payload = FS_BLOCKSIZE - 8;
+    uint64_t blocks = 2;
+    for (size_t i = 0; i < imp.entries.size(); ++i) {
+        const Entry &entry = imp.entries[i];
+        if (entry.dir) {
+            blocks += 2 + (entry.children * 4 + 8) / (FS_BLOCKSIZE - 24);
+            if (entry.children > HASHED_DIR_MIN) {
+                blocks += 1 + (entry.children * 8) / (FS_BLOCKSIZE - 8);
+            }
+        } else {
+            blocks += 2 + (entry.size + payload - 1) / payload;
+        }
+    }
+    blocks += blocks / 16 + ALLOC_GROUPS * IO_BATCH_BLOCKS;
+    blocks += blocks / (FS_BLOCKSIZE * 8) + 1;
+    return blocks * FS_BLOCKSIZE;
+}
+
+/* Splits file list to runs of neighbouring files. A reader takes a
+ * whole run, so files of one directory land in the same allocation
+ * group one after another. */
+static void planRuns(Import *imp)
+{
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < imp->files.size(); ++i) {
+        if (i == 0 || bytes >= PLAN_CHUNK) {
+            imp->runs.push_back(i);
+            bytes = 0;
+        }
+        bytes += imp->entries[imp->files[i]].size;
+    }
+    imp->runs.push_back(imp->files.size());
+    imp->next_run = 0;
+}
+
+static bool createDirs(Import *imp)
+{
+    for (size_t i = 1; i < imp->entries.size(); ++i) {
+        Entry &entry = imp->entries[i];
+        if (!entry.dir) {
+            continue;
+        }
+        uint32_t parent = imp->entries[entry.parent].block;
+        uint8_t layout = ClothesFS::DIR_LINEAR;
+        if (entry.children > HASHED_DIR_MIN) {
+            layout = ClothesFS::DIR_HASHED;
+        }
+        if (!imp->fs->addDir(parent, entry.name.c_str(), layout)) {
+            printf("Can't create directory %s\n", entry.path.c_str());
+            return false;
+        }
+        entry.block = imp->fs->find(parent, entry.name.c_str());
+        if (entry.block == 0) {
+            printf("Can't create directory %s\n", entry.path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool importFile(Import *imp, const Entry &entry, uint8_t *buf)
+{
+    int fd = open(entry.path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        printf("Can't open %s\n", entry.path.c_str());
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ClothesFS::Writer writer(
+        imp->fs,
+        imp->entries[entry.parent].block,
+        entry.name.c_str(),
+        ClothesFS::MAP_EXTENTS);
+    bool res = writer.ok();
+    if (res && entry.size > 0) {
+        // Failing to reserve means scattered blocks, not a failure
+        writer.reserve(entry.size);
+    }
+    while (res) {
+        ssize_t cnt = read(fd, buf, READ_CHUNK);
+        if (cnt < 0) {
+            res = false;
+        }
+        if (cnt <= 0) {
+            break;
+        }
+        res = writer.write(buf, cnt);
+    }
+    close(fd);
+
+    if (!writer.close()) {
+        res = false;
+    }
+    if (!res) {
+        printf("Can't import %s\n", entry.path.c_str());
+        return false;
+    }
+    __atomic_add_fetch(&imp->bytes, writer.size(), __ATOMIC_RELAXED);
+    return true;
+}
+
+static void *reader(void *arg)
+{
+    Import *imp = (Import*)arg;
+    uint8_t *buf = new uint8_t[READ_CHUNK];
+    uint32_t runs = imp->runs.size() - 1;
+    while (true) {
+        uint32_t run = __atomic_fetch_add(&imp->next_run, 1, __ATOMIC_RELAXED);
+        if (run >= runs) {
+            break;
+        }
+        for (uint32_t i = imp->runs[run]; i < imp->runs[run + 1]; ++i) {
+            if (!importFile(imp, imp->entries[imp->files[i]], buf)) {
+                __atomic_add_fetch(&imp->failed, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    delete[] buf;
+    return nullptr;
+}
+
+/* Image through backend picked on command line, plain file I/O when
+ * io_uring can't be set up */
+static FilesystemPhys *openImage(
+    const char *image,
+    uint64_t size,
+    Backend backend)
+{
+    if (backend == BACKEND_MMAP) {
+        MmapPhys *mapped = new MmapPhys(image, size);
+        if (mapped->ok()) {
+            return mapped;
+        }
+        delete mapped;
+        return nullptr;
+    }
+#ifdef HAVE_IO_URING
+    if (backend == BACKEND_URING) {
+        IoUringPhys *uring = new IoUringPhys(image, size);
+        if (uring->ok()) {
+            return uring;
+        }
+        // Kernel without io_uring or ring limits reached
+        printf("Can't set up io_uring, using plain file I/O\n");
+        delete uring;
+    }
+#endif
+    FilePhys *file = new FilePhys(image, size, backend == BACKEND_DIRECT);
+    if (file->ok()) {
+        return file;
+    }
+    delete file;
+    return nullptr;
+}
+
+/* Formats image and imports tree, volume is flushed when this returns */
+static int build(
+    Import *imp,
+    FilesystemPhys *phys,
+    const char *image,
+    const char *source,
+    long threads)
+{
+    ClothesFS cloth;
+    cloth.setPhysical(phys);
+    if (!cloth.format(source, ClothesFS::FLAG_BITMAP)) {
+        printf("Can't format %s\n", image);
+        return 1;
+    }
+    imp->fs = &cloth;
+    if (!createDirs(imp)) {
+        return 1;
+    }
+
+    // Each reader allocates from its own group
+    std::vector<pthread_t> pool(threads);
+    for (long i = 0; i < threads; ++i) {
+        if (pthread_create(&pool[i], nullptr, reader, imp) != 0) {
+            pool.resize(i);
+            break;
+        }
+    }
+    if (pool.empty()) {
+        reader(imp);
+    }
+    for (size_t i = 0; i < pool.size(); ++i) {
+        pthread_join(pool[i], nullptr);
+    }
+
+    if (!cloth.sync()) {
+        printf("Can't write %s\n", image);
+        return 1;
+    }
+    printf("%s: %zu files, %zu directories, %llu bytes\n",
+        image, imp->files.size(), imp->entries.size() - imp->files.size() - 1,
+        (unsigned long long)imp->bytes);
+    if (imp->failed > 0) {
+        printf("%s: %u entries failed\n", image, imp->failed);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t size = 0;
+    Backend backend = BACKEND_FILE;
+    const char *image = nullptr;
+    const char *source = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = strtoull(argv[++i], nullptr, 0);
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            backend = BACKEND_DIRECT;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            backend = BACKEND_MMAP;
+#ifdef HAVE_IO_URING
+        } else if (strcmp(argv[i], "--uring") == 0) {
+            backend = BACKEND_URING;
+#endif
+        } else if (image == nullptr && argv[i][0] != '-') {
+            image = argv[i];
+        } else if (source == nullptr && argv[i][0] != '-') {
+            source = argv[i];
+        } else {
+            source = nullptr;
+            break;
+        }
+    }
+    if (source == nullptr || threads <= 0) {
+        printf("Usage: %s [--threads N] [--size BYTES] [--direct | --mmap | --uring] image directory\n", argv[0]);
+        return 1;
+    }
+
+    Import imp;
+    Entry root;
+    root.path = source;
+    root.parent = 0;
+    root.dir = true;
+    root.size = 0;
+    root.children = 0;
+    root.block = 1;
+    imp.entries.push_back(root);
+    imp.failed = 0;
+    imp.bytes = 0;
+    if (!walk(&imp, 0)) {
+        return 1;
+    }
+    planRuns(&imp);
+    if (size == 0) {
+        size = planSize(imp);
+    }
+    size -= size % FS_BLOCKSIZE;
+
+    // Image is rewritten from scratch
+    remove(image);
+    FilesystemPhys *phys = openImage(image, size, backend);
+    if (phys == nullptr) {
+        printf("Can't open %s\n", image);
+        return 1;
+    }
+    int res = build(&imp, phys, image, source, threads);
+    delete phys;
+    return res;
+}